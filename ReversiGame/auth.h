@@ -0,0 +1,286 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <algorithm>
+
+// Passwords are stored as "pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>"; anything else in the
+// password column is a plaintext password left by an older server and is rehashed on startup.
+#define PASSWORD_SCHEME "pbkdf2-sha256$"
+#define PASSWORD_ITERATIONS 10000
+#define PASSWORD_SALT_SIZE 16
+#define PASSWORD_RECORD_SIZE 128
+#define MAX_PASSWORD_LENGTH 64
+#define SESSION_TOKEN_BYTES 16
+#define SESSION_TOKEN_SIZE (SESSION_TOKEN_BYTES * 2 + 1)
+#define SHA256_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCK_SIZE];
+    size_t used;
+} Sha256;
+
+static const uint32_t sha256_rounds[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotate_right(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+inline void sha256_compress(uint32_t *state, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25)) + ((e & f) ^ (~e & g)) + sha256_rounds[i] + w[i];
+        uint32_t t2 = (rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+inline void sha256_init(Sha256 &hash)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(hash.state, initial, sizeof(initial));
+    hash.length = 0;
+    hash.used = 0;
+}
+
+inline void sha256_update(Sha256 &hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    hash.length += length;
+    while (length > 0)
+    {
+        size_t take = std::min(length, SHA256_BLOCK_SIZE - hash.used);
+        memcpy(hash.block + hash.used, bytes, take);
+        hash.used += take;
+        bytes += take;
+        length -= take;
+        if (hash.used == SHA256_BLOCK_SIZE)
+        {
+            sha256_compress(hash.state, hash.block);
+            hash.used = 0;
+        }
+    }
+}
+
+inline void sha256_final(Sha256 &hash, uint8_t *digest)
+{
+    uint64_t bits = hash.length * 8;
+    uint8_t padding = 0x80;
+    sha256_update(hash, &padding, 1);
+    padding = 0;
+    while (hash.used != SHA256_BLOCK_SIZE - 8)
+        sha256_update(hash, &padding, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++)
+        length[i] = bits >> (56 - i * 8);
+    sha256_update(hash, length, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = hash.state[i] >> 24;
+        digest[i * 4 + 1] = hash.state[i] >> 16;
+        digest[i * 4 + 2] = hash.state[i] >> 8;
+        digest[i * 4 + 3] = hash.state[i];
+    }
+}
+
+// HMAC keyed by the password, with the inner and outer pads hashed once and reused for every iteration.
+typedef struct
+{
+    Sha256 inner;
+    Sha256 outer;
+} Hmac_Sha256;
+
+inline void hmac_init(Hmac_Sha256 &hmac, const char *key, size_t key_length)
+{
+    uint8_t block[SHA256_BLOCK_SIZE] = {0};
+    if (key_length > SHA256_BLOCK_SIZE)
+    {
+        Sha256 hash;
+        sha256_init(hash);
+        sha256_update(hash, key, key_length);
+        sha256_final(hash, block);
+    }
+    else
+    {
+        memcpy(block, key, key_length);
+    }
+
+    uint8_t pad[SHA256_BLOCK_SIZE];
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] = block[i] ^ 0x36;
+    sha256_init(hmac.inner);
+    sha256_update(hmac.inner, pad, SHA256_BLOCK_SIZE);
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++)
+        pad[i] = block[i] ^ 0x5c;
+    sha256_init(hmac.outer);
+    sha256_update(hmac.outer, pad, SHA256_BLOCK_SIZE);
+}
+
+inline void hmac_digest(const Hmac_Sha256 &hmac, const uint8_t *data, size_t length, uint8_t *digest)
+{
+    Sha256 hash = hmac.inner;
+    sha256_update(hash, data, length);
+    sha256_final(hash, digest);
+    hash = hmac.outer;
+    sha256_update(hash, digest, SHA256_SIZE);
+    sha256_final(hash, digest);
+}
+
+// PBKDF2-HMAC-SHA256 with a single output block, which is all a 32-byte key needs.
+inline void pbkdf2_sha256(const char *password, const uint8_t *salt, size_t salt_length, int iterations, uint8_t *key)
+{
+    Hmac_Sha256 hmac;
+    hmac_init(hmac, password, strlen(password));
+
+    uint8_t first[PASSWORD_SALT_SIZE + 4];
+    memcpy(first, salt, salt_length);
+    memcpy(first + salt_length, "\0\0\0\1", 4);
+    uint8_t block[SHA256_SIZE];
+    hmac_digest(hmac, first, salt_length + 4, block);
+    memcpy(key, block, SHA256_SIZE);
+    for (int i = 1; i < iterations; i++)
+    {
+        hmac_digest(hmac, block, SHA256_SIZE, block);
+        for (int j = 0; j < SHA256_SIZE; j++)
+            key[j] ^= block[j];
+    }
+}
+
+inline void hex_encode(const uint8_t *bytes, size_t length, char *out)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        out[i * 2] = "0123456789abcdef"[bytes[i] >> 4];
+        out[i * 2 + 1] = "0123456789abcdef"[bytes[i] & 15];
+    }
+    out[length * 2] = 0;
+}
+
+inline bool hex_decode(const char *text, size_t length, uint8_t *out)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        int value = 0;
+        for (int j = 0; j < 2; j++)
+        {
+            char c = text[i * 2 + j];
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+            if (digit < 0)
+                return false;
+            value = value * 16 + digit;
+        }
+        out[i] = value;
+    }
+    return true;
+}
+
+inline bool random_bytes(uint8_t *out, size_t length)
+{
+    return getrandom(out, length, 0) == (ssize_t)length;
+}
+
+// Compares every byte, so how long a check takes says nothing about how much of the secret matched.
+inline bool constant_time_equal(const void *a, const void *b, size_t length)
+{
+    const uint8_t *left = (const uint8_t *)a, *right = (const uint8_t *)b;
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++)
+        difference |= left[i] ^ right[i];
+    return difference == 0;
+}
+
+inline bool is_password_hash(const char *record)
+{
+    return strncmp(record, PASSWORD_SCHEME, strlen(PASSWORD_SCHEME)) == 0;
+}
+
+inline bool hash_password(const char *password, char *record)
+{
+    uint8_t salt[PASSWORD_SALT_SIZE], key[SHA256_SIZE];
+    if (!random_bytes(salt, sizeof(salt)))
+        return false;
+    pbkdf2_sha256(password, salt, sizeof(salt), PASSWORD_ITERATIONS, key);
+
+    char salt_hex[PASSWORD_SALT_SIZE * 2 + 1], key_hex[SHA256_SIZE * 2 + 1];
+    hex_encode(salt, sizeof(salt), salt_hex);
+    hex_encode(key, sizeof(key), key_hex);
+    snprintf(record, PASSWORD_RECORD_SIZE, "%s%d$%s$%s", PASSWORD_SCHEME, PASSWORD_ITERATIONS, salt_hex, key_hex);
+    return true;
+}
+
+inline bool verify_password(const char *password, const char *record)
+{
+    if (!is_password_hash(record))
+    {
+        size_t length = strlen(password);
+        return length == strlen(record) && constant_time_equal(password, record, length);
+    }
+
+    char *cursor;
+    long iterations = strtol(record + strlen(PASSWORD_SCHEME), &cursor, 10);
+    uint8_t salt[PASSWORD_SALT_SIZE], expected[SHA256_SIZE], key[SHA256_SIZE];
+    if (iterations < 1 || *cursor != '$' || strlen(cursor) != 1 + PASSWORD_SALT_SIZE * 2 + 1 + SHA256_SIZE * 2 ||
+        !hex_decode(cursor + 1, PASSWORD_SALT_SIZE, salt) || cursor[1 + PASSWORD_SALT_SIZE * 2] != '$' ||
+        !hex_decode(cursor + 2 + PASSWORD_SALT_SIZE * 2, SHA256_SIZE, expected))
+        return false;
+
+    pbkdf2_sha256(password, salt, sizeof(salt), iterations, key);
+    return constant_time_equal(key, expected, SHA256_SIZE);
+}
+
+inline bool new_session_token(char *token)
+{
+    uint8_t bytes[SESSION_TOKEN_BYTES];
+    if (!random_bytes(bytes, sizeof(bytes)))
+        return false;
+    hex_encode(bytes, sizeof(bytes), token);
+    return true;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include "reversi.h"
+
+#define POSITIONS 4096
+#define DEFAULT_PERFT_DEPTH 9
+
+static long allocation_count;
+static volatile uint64_t sink;
+
+void *operator new(size_t size)
+{
+    allocation_count++;
+    void *memory = malloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+// The int[8][8] rules the server used before the bitboard engine, kept as the baseline to compare against.
+bool reference_is_valid_move(int board[8][8], int row, int col, int player)
+{
+    if (board[row][col] != 0)
+        return false;
+
+    int opponent = (player == 1) ? 2 : 1;
+    bool valid = false;
+
+    int dirs[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+    for (int dir = 0; dir < 8; dir++)
+    {
+        int curr_row = row + dirs[dir][0];
+        int curr_col = col + dirs[dir][1];
+        bool found_opponent = false;
+
+        while (curr_row >= 0 && curr_row < 8 && curr_col >= 0 && curr_col < 8)
+        {
+            if (board[curr_row][curr_col] == opponent)
+            {
+                found_opponent = true;
+            }
+            else if (board[curr_row][curr_col] == player && found_opponent)
+            {
+                valid = true;
+                break;
+            }
+            else
+            {
+                break;
+            }
+            curr_row += dirs[dir][0];
+            curr_col += dirs[dir][1];
+        }
+        if (valid)
+            break;
+    }
+    return valid;
+}
+
+void reference_make_move(int board[8][8], int row, int col, int player)
+{
+    board[row][col] = player;
+    int opponent = (player == 1) ? 2 : 1;
+
+    int dirs[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+    for (int dir = 0; dir < 8; dir++)
+    {
+        int curr_row = row + dirs[dir][0];
+        int curr_col = col + dirs[dir][1];
+        std::vector<std::pair<int, int>> to_flip;
+
+        while (curr_row >= 0 && curr_row < 8 && curr_col >= 0 && curr_col < 8)
+        {
+            if (board[curr_row][curr_col] == opponent)
+            {
+                to_flip.push_back({curr_row, curr_col});
+            }
+            else if (board[curr_row][curr_col] == player && !to_flip.empty())
+            {
+                for (auto &pos : to_flip)
+                {
+                    board[pos.first][pos.second] = player;
+                }
+                break;
+            }
+            else
+            {
+                break;
+            }
+            curr_row += dirs[dir][0];
+            curr_col += dirs[dir][1];
+        }
+    }
+}
+
+void reference_init_board(int board[8][8])
+{
+    memset(board, 0, sizeof(int) * 64);
+    board[3][3] = 2;
+    board[3][4] = 1;
+    board[4][3] = 1;
+    board[4][4] = 2;
+}
+
+bool reference_has_valid_moves(int board[8][8], int player)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            if (reference_is_valid_move(board, i, j, player))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::string reference_get_board_string(int board[8][8])
+{
+    std::string result = "Tabla curenta:\n";
+    result += "  0 1 2 3 4 5 6 7\n";
+
+    for (int i = 0; i < 8; i++)
+    {
+        result += std::to_string(i) + " ";
+        for (int j = 0; j < 8; j++)
+        {
+            if (board[i][j] == 0)
+                result += ". ";
+            else if (board[i][j] == 1)
+                result += "B ";
+            else
+                result += "W ";
+        }
+        result += "\n";
+    }
+    return result;
+}
+
+typedef struct
+{
+    Board board;
+    int cells[8][8];
+    int player;
+    int row;
+    int col;
+} Position;
+
+void to_cells(const Board &board, int cells[8][8])
+{
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            uint64_t mask = square_mask(i, j);
+            cells[i][j] = (board.discs[0] & mask) ? 1 : ((board.discs[1] & mask) ? 2 : 0);
+        }
+    }
+}
+
+int random_square(uint64_t moves, unsigned *seed)
+{
+    int pick = rand_r(seed) % __builtin_popcountll(moves);
+    while (pick-- > 0)
+        moves &= moves - 1;
+    return __builtin_ctzll(moves);
+}
+
+std::vector<Position> random_positions(unsigned seed)
+{
+    std::vector<Position> positions;
+    while (positions.size() < POSITIONS)
+    {
+        Board board;
+        init_board(board);
+        int player = 1;
+        int plies = 10 + rand_r(&seed) % 40;
+        for (int ply = 0; ply < plies; ply++)
+        {
+            uint64_t moves = get_valid_moves(board, player);
+            if (!moves)
+            {
+                player = 3 - player;
+                moves = get_valid_moves(board, player);
+                if (!moves)
+                    break;
+            }
+            int square = random_square(moves, &seed);
+            make_move(board, square / 8, square % 8, player);
+            player = 3 - player;
+        }
+
+        uint64_t moves = get_valid_moves(board, player);
+        if (!moves)
+            continue;
+
+        Position position;
+        position.board = board;
+        to_cells(board, position.cells);
+        position.player = player;
+        int square = random_square(moves, &seed);
+        position.row = square / 8;
+        position.col = square % 8;
+        positions.push_back(position);
+    }
+    return positions;
+}
+
+template <typename Body>
+void run_benchmark(const char *name, long iterations, Body body)
+{
+    long allocations = allocation_count;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+        body(i);
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-36s %12.1f ns/op %10.2f alloc/op\n", name, elapsed / iterations, (double)(allocation_count - allocations) / iterations);
+}
+
+uint64_t perft(const Board &board, int player, int depth, bool passed)
+{
+    if (depth == 0)
+        return 1;
+
+    uint64_t moves = get_valid_moves(board, player);
+    if (!moves)
+        return passed ? 1 : perft(board, 3 - player, depth - 1, true);
+
+    uint64_t nodes = 0;
+    for (; moves; moves &= moves - 1)
+    {
+        int square = __builtin_ctzll(moves);
+        Board child = board;
+        make_move(child, square / 8, square % 8, player);
+        nodes += perft(child, 3 - player, depth - 1, false);
+    }
+    return nodes;
+}
+
+uint64_t reference_perft(int board[8][8], int player, int depth, bool passed)
+{
+    if (depth == 0)
+        return 1;
+
+    uint64_t nodes = 0;
+    bool any = false;
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            if (!reference_is_valid_move(board, i, j, player))
+                continue;
+            any = true;
+            int child[8][8];
+            memcpy(child, board, sizeof(child));
+            reference_make_move(child, i, j, player);
+            nodes += reference_perft(child, 3 - player, depth - 1, false);
+        }
+    }
+    if (!any)
+        return passed ? 1 : reference_perft(board, 3 - player, depth - 1, true);
+    return nodes;
+}
+
+long self_play(unsigned *seed)
+{
+    Board board;
+    init_board(board);
+    int player = 1;
+    long moves_played = 0;
+    while (1)
+    {
+        if (!has_valid_moves(board, player))
+        {
+            player = 3 - player;
+            if (!has_valid_moves(board, player))
+                break;
+        }
+        int square = random_square(get_valid_moves(board, player), seed);
+        make_move(board, square / 8, square % 8, player);
+        player = 3 - player;
+        moves_played++;
+    }
+    return moves_played;
+}
+
+long reference_self_play(unsigned *seed)
+{
+    int board[8][8];
+    reference_init_board(board);
+    int player = 1;
+    long moves_played = 0;
+    while (1)
+    {
+        if (!reference_has_valid_moves(board, player))
+        {
+            player = 3 - player;
+            if (!reference_has_valid_moves(board, player))
+                break;
+        }
+
+        int candidates[64], count = 0;
+        for (int i = 0; i < 64; i++)
+        {
+            if (reference_is_valid_move(board, i / 8, i % 8, player))
+                candidates[count++] = i;
+        }
+        int square = candidates[rand_r(seed) % count];
+        reference_make_move(board, square / 8, square % 8, player);
+        player = 3 - player;
+        moves_played++;
+    }
+    return moves_played;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint64_t known_perft[] = {1, 4, 12, 56, 244, 1396, 8200, 55092, 390216, 3005288, 24571284};
+    int perft_depth = argc > 1 ? atoi(argv[1]) : DEFAULT_PERFT_DEPTH;
+    if (perft_depth < 1 || perft_depth > 10)
+    {
+        printf("Utilizare: %s [adancime perft 1-10]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Position> positions = random_positions(12345);
+    const long iterations = 4000000;
+    const long games = 20000;
+    long mask = POSITIONS - 1;
+
+    printf("Bitboard (reversi.h):\n");
+    run_benchmark("init_board", iterations, [&](long i)
+                  { Board board; init_board(board); sink += board.discs[i & 1]; });
+    run_benchmark("is_valid_move", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; sink += is_valid_move(p.board, (i >> 3) & 7, i & 7, p.player); });
+    run_benchmark("make_move", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; Board board = p.board; make_move(board, p.row, p.col, p.player); sink += board.discs[0]; });
+    run_benchmark("has_valid_moves", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; sink += has_valid_moves(p.board, p.player); });
+    run_benchmark("board_hash", iterations, [&](long i)
+                  { sink += board_hash(positions[i & mask].board); });
+    run_benchmark("get_board_string", iterations / 10, [&](long i)
+                  { sink += get_board_string(positions[i & mask].board).size(); });
+    run_benchmark("render_board", iterations / 10, [&](long i)
+                  { char text[BOARD_STRING_SIZE]; render_board(positions[i & mask].board, text); sink += text[BOARD_FIRST_CELL]; });
+    unsigned seed = 1;
+    run_benchmark("self-play game", games, [&](long)
+                  { sink += self_play(&seed); });
+
+    printf("\nReferinta (int[8][8]):\n");
+    run_benchmark("init_board", iterations, [&](long i)
+                  { int board[8][8]; reference_init_board(board); sink += board[3][i & 7]; });
+    run_benchmark("is_valid_move", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; sink += reference_is_valid_move(p.cells, (i >> 3) & 7, i & 7, p.player); });
+    run_benchmark("make_move", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; int board[8][8]; memcpy(board, p.cells, sizeof(board)); reference_make_move(board, p.row, p.col, p.player); sink += board[p.row][p.col]; });
+    run_benchmark("has_valid_moves", iterations, [&](long i)
+                  { Position &p = positions[i & mask]; sink += reference_has_valid_moves(p.cells, p.player); });
+    run_benchmark("get_board_string", iterations / 10, [&](long i)
+                  { sink += reference_get_board_string(positions[i & mask].cells).size(); });
+    seed = 1;
+    run_benchmark("self-play game", games, [&](long)
+                  { sink += reference_self_play(&seed); });
+
+    printf("\nPerft din pozitia initiala:\n");
+    Board board;
+    int cells[8][8];
+    init_board(board);
+    reference_init_board(cells);
+    bool ok = true;
+    for (int depth = 1; depth <= perft_depth; depth++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t nodes = perft(board, 1, depth, false);
+        double fast = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        uint64_t reference_nodes = reference_perft(cells, 1, depth, false);
+        double slow = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        bool match = nodes == reference_nodes && nodes == known_perft[depth];
+        ok = ok && match;
+        printf("adancime %2d: %10llu noduri  bitboard %8.3fs  referinta %8.3fs  %s\n",
+               depth, (unsigned long long)nodes, fast, slow, match ? "OK" : "DIFERENTA");
+    }
+
+    // Every sampled position was reached through make_move, so its hash must equal one computed from scratch.
+    bool hashes_match = true;
+    for (const Position &position : positions)
+        hashes_match = hashes_match && position.board.hash == board_hash(position.board);
+    printf("\nHash Zobrist incremental: %s\n", hashes_match ? "OK" : "DIFERENTA");
+    ok = ok && hashes_match;
+
+    return ok ? 0 : 1;
+}
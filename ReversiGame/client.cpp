@@ -2,23 +2,780 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "reversi.h"
+#include "protocol.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 1024
+#define LOAD_BUFFER_SIZE 16384
+#define LOAD_MAX_EVENTS 256
+#define LOAD_MARKER_TAIL 64
+#define CHAOS_DROP_PERCENT 2
+#define CHAOS_SURRENDER_PERCENT 2
+#define CHAOS_SPAM_PERCENT 20
+#define TOKEN_MARKER "Token de sesiune: "
+#define BOARD_HEADER "  0 1 2 3 4 5 6 7\n"
 
 int client_socket;
 char buffer[BUFFER_SIZE];
+bool binary_protocol;
+
+typedef struct
+{
+    Board board;
+    uint32_t seq;
+    int color;
+    bool active;
+} Local_Game;
+
+Local_Game local_game;
+
+enum Bot_State
+{
+    BOT_REGISTERING,
+    BOT_LOGGING_IN,
+    BOT_WAITING,
+    BOT_PLAYING,
+    BOT_CLOSED
+};
+
+typedef struct
+{
+    int socket;
+    Bot_State state;
+    char username[50];
+    int color;
+    Board board;
+    uint32_t seq;
+    bool binary;
+    bool drop;         // chaos: close the connection once the input at hand is handled
+    bool reconnecting; // dropped on purpose in a chaos run, coming back with resume
+    char token[40];
+    bool move_pending;
+    std::chrono::steady_clock::time_point move_sent;
+    size_t input_length;
+    char input[LOAD_BUFFER_SIZE];
+} Bot;
+
+typedef struct
+{
+    const char *host;
+    int port;
+    int connections;
+    int threads;
+    int duration;
+    int ai_level;
+    bool binary;
+    bool chaos;
+} Load_Options;
+
+std::atomic<long> load_commands;
+std::atomic<long> load_moves;
+std::atomic<long> load_games;
+std::atomic<long> load_errors;
+std::atomic<long> load_drops;
+std::atomic<int> load_connected;
+std::atomic<bool> load_running;
+std::vector<uint32_t> load_latencies;
+std::mutex load_latencies_mutex;
+
+typedef struct
+{
+    const char *name;
+    int opcode;
+} Simple_Command;
+
+const Simple_Command simple_commands[] = {{"logout", OP_LOGOUT}, {"play", OP_PLAY}, {"play ai", OP_PLAY_AI}, {"stop", OP_STOP},
+                                          {"surrender", OP_SURRENDER}, {"scoreboard", OP_SCOREBOARD}, {"help", OP_HELP},
+                                          {"sync", OP_SYNC}};
+
+const char *board_markers[] = {"Jocul a inceput", "Mutare corecta", " a mutat ", "Game Over", "Sync "};
+const char *plain_markers[] = {"Inregistrare reusita", "deja exista", "Login reusit", "Login esuat", "Esti deja conectat",
+                               "a abandonat jocul", "Asteptati un adversar", "Comanda necunoscuta", "Nu esti intr-un joc activ",
+                               "Serverul nu mai poate", "Miscare invalida", "Nu este randul tau", "Sesiune invalida",
+                               TOKEN_MARKER};
+
+// Commands without a dedicated opcode travel as OP_TEXT, so the binary client can still use all of them.
+size_t encode_command(const char *line, uint8_t *frame)
+{
+    uint8_t *payload = frame + CLIENT_HEADER_SIZE;
+    int opcode = 0;
+    size_t length = 0;
+    char name[32], first[64], second[64];
+    int row, col, level;
+
+    for (const Simple_Command &command : simple_commands)
+    {
+        if (strcmp(line, command.name) == 0)
+            opcode = command.opcode;
+    }
+
+    if (!opcode && sscanf(line, "%31s %63s %63s", name, first, second) == 3 && (!strcmp(name, "register") || !strcmp(name, "login")))
+    {
+        opcode = strcmp(name, "register") == 0 ? OP_REGISTER : OP_LOGIN;
+        length = sprintf((char *)payload, "%s", first) + 1;
+        length += sprintf((char *)payload + length, "%s", second);
+    }
+    else if (!opcode && sscanf(line, "move %d %d", &row, &col) == 2 && row >= 0 && row < 8 && col >= 0 && col < 8)
+    {
+        opcode = OP_MOVE;
+        payload[0] = row * 8 + col;
+        length = 1;
+    }
+    else if (!opcode && sscanf(line, "play ai %d", &level) == 1 && level > 0 && level < 256)
+    {
+        opcode = OP_PLAY_AI;
+        payload[0] = level;
+        length = 1;
+    }
+    else if (!opcode)
+    {
+        opcode = OP_TEXT;
+        length = std::min(strlen(line), (size_t)MAX_CLIENT_PAYLOAD);
+        memcpy(payload, line, length);
+    }
+
+    frame[0] = opcode;
+    frame[1] = length;
+    return CLIENT_HEADER_SIZE + length;
+}
+
+bool send_hello(int sock)
+{
+    uint8_t hello[2] = {PROTOCOL_MAGIC, PROTOCOL_VERSION};
+    return send(sock, hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello);
+}
+
+int connect_to_server(const char *host, int port)
+{
+    struct sockaddr_in server_address;
+    int optval = 1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("Eroare la crearea socket-ului client");
+        return -1;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = inet_addr(host);
+
+    if (connect(sock, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        perror("Eroare la conectarea la server");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool bot_send(Bot *bot, const char *command)
+{
+    uint8_t frame[CLIENT_HEADER_SIZE + MAX_CLIENT_PAYLOAD];
+    const void *data = command;
+    size_t length = strlen(command);
+    if (bot->binary)
+    {
+        char line[BUFFER_SIZE];
+        snprintf(line, sizeof(line), "%.*s", (int)length - 1, command);
+        length = encode_command(line, frame);
+        data = frame;
+    }
+    if (send(bot->socket, data, length, MSG_NOSIGNAL) != (ssize_t)length)
+    {
+        load_errors++;
+        bot->state = BOT_CLOSED;
+        close(bot->socket);
+        return false;
+    }
+    load_commands++;
+    return true;
+}
+
+void bot_play(Bot *bot, int ai_level)
+{
+    char command[64];
+    if (!load_running)
+        return;
+    if (ai_level)
+        snprintf(command, sizeof(command), "play ai %d\n", ai_level);
+    else
+        snprintf(command, sizeof(command), "play\n");
+    bot->state = BOT_WAITING;
+    bot_send(bot, command);
+}
+
+void bot_move(Bot *bot, const Board &board, unsigned *seed)
+{
+    uint64_t moves = get_valid_moves(board, bot->color);
+    if (!moves)
+        return;
+
+    int pick = rand_r(seed) % __builtin_popcountll(moves);
+    while (pick-- > 0)
+        moves &= moves - 1;
+    int square = __builtin_ctzll(moves);
+
+    char command[32];
+    snprintf(command, sizeof(command), "move %d %d\n", square / 8, square % 8);
+    bot->move_pending = true;
+    bot->move_sent = std::chrono::steady_clock::now();
+    bot_send(bot, command);
+}
+
+void bot_record_latency(Bot *bot, std::vector<uint32_t> &latencies)
+{
+    if (!bot->move_pending)
+        return;
+    bot->move_pending = false;
+    load_moves++;
+    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bot->move_sent).count());
+}
+
+const char *parse_board(const char *text, const char *end, Board &board)
+{
+    const char *header = strstr(text, BOARD_HEADER);
+    if (!header)
+        return NULL;
+
+    const char *row = header + strlen(BOARD_HEADER);
+    if (end - row < 8 * BOARD_ROW_STRIDE)
+        return NULL;
+
+    board.discs[0] = board.discs[1] = 0;
+    for (int i = 0; i < 8; i++, row += BOARD_ROW_STRIDE)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            char cell = row[2 + 2 * j];
+            if (cell == 'B')
+                board.discs[0] |= square_mask(i, j);
+            else if (cell == 'W')
+                board.discs[1] |= square_mask(i, j);
+        }
+    }
+    board.hash = board_hash(board);
+    return row;
+}
+
+const char *find_marker(const char *text, const char **markers, size_t count, const char **which)
+{
+    const char *best = NULL;
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *found = strstr(text, markers[i]);
+        if (found && (!best || found < best))
+        {
+            best = found;
+            *which = markers[i];
+        }
+    }
+    return best;
+}
+
+bool is_my_turn(Bot *bot, const char *message, const char *limit)
+{
+    const char *turn = strstr(message, "Muta ");
+    if (!turn || turn > limit)
+        return false;
+    turn += 5;
+    size_t length = strlen(bot->username);
+    return strncmp(turn, bot->username, length) == 0 && turn[length] == '\n';
+}
+
+void bot_resume(Bot *bot)
+{
+    char command[64];
+    snprintf(command, sizeof(command), "resume %s\n", bot->token);
+    bot->state = BOT_LOGGING_IN;
+    bot_send(bot, command);
+}
+
+// after is the text that follows the marker; only the session token needs it.
+void bot_handle_message(Bot *bot, const char *marker, const char *after, const Load_Options *options)
+{
+    if (!strcmp(marker, "Inregistrare reusita") || !strcmp(marker, "deja exista"))
+    {
+        char command[128];
+        snprintf(command, sizeof(command), "login %s bot\n", bot->username);
+        bot->state = BOT_LOGGING_IN;
+        bot_send(bot, command);
+    }
+    else if (!strcmp(marker, TOKEN_MARKER))
+    {
+        snprintf(bot->token, sizeof(bot->token), "%.*s", (int)strspn(after, "0123456789abcdef"), after);
+    }
+    else if (!strcmp(marker, "Login reusit") && bot->reconnecting)
+    {
+        // The server puts a player back in a game whose seat it still holds; "sync" tells whether it did.
+        bot->state = BOT_PLAYING;
+        bot_send(bot, "sync\n");
+    }
+    else if (!strcmp(marker, "Login reusit"))
+    {
+        bot_play(bot, options->ai_level);
+    }
+    else if (bot->reconnecting && !strcmp(marker, "Esti deja conectat"))
+    {
+        // The server has not seen the old connection close yet.
+        bot_resume(bot);
+    }
+    else if (bot->reconnecting && !strcmp(marker, "Nu esti intr-un joc activ"))
+    {
+        bot->reconnecting = false;
+        bot_play(bot, options->ai_level);
+    }
+    else if (!strcmp(marker, "a abandonat jocul"))
+    {
+        bot->move_pending = false;
+        bot->reconnecting = false;
+        bot_play(bot, options->ai_level);
+    }
+    else if (options->chaos && (!strcmp(marker, "Miscare invalida") || !strcmp(marker, "Nu este randul tau") ||
+                                !strcmp(marker, "Nu esti intr-un joc activ")))
+    {
+        // Answers to the moves and surrenders a chaos run sends on purpose at the wrong time.
+    }
+    else if (!strcmp(marker, "Miscare invalida") || !strcmp(marker, "Nu este randul tau"))
+    {
+        bot->move_pending = false;
+        load_errors++;
+    }
+    else if (strcmp(marker, "Asteptati un adversar") != 0)
+    {
+        load_errors++;
+        if (bot->state == BOT_LOGGING_IN)
+        {
+            bot->state = BOT_CLOSED;
+            close(bot->socket);
+        }
+    }
+}
+
+// A gap in the sequence numbers means the local board is stale: ask for a snapshot and wait for it.
+bool bot_apply_delta(Bot *bot, const Delta_Update &update)
+{
+    if (update.seq != bot->seq + 1)
+    {
+        load_errors++;
+        bot->move_pending = false;
+        bot_send(bot, "sync\n");
+        return false;
+    }
+    apply_delta(bot->board, update);
+    bot->seq = update.seq;
+    return true;
+}
+
+// A chaos run mixes in what real clients do to a game: moves at the wrong time, surrenders and connections
+// dropped mid-game, so the server's per-game locking is exercised from every direction at once.
+void bot_chaos(Bot *bot, unsigned *seed)
+{
+    int roll = rand_r(seed) % 100;
+    if (roll < CHAOS_DROP_PERCENT)
+    {
+        bot->drop = true;
+    }
+    else if (roll < CHAOS_DROP_PERCENT + CHAOS_SURRENDER_PERCENT)
+    {
+        bot_send(bot, "surrender\n");
+    }
+    else if (roll < CHAOS_DROP_PERCENT + CHAOS_SURRENDER_PERCENT + CHAOS_SPAM_PERCENT)
+    {
+        char command[32];
+        int square = rand_r(seed) % 64;
+        snprintf(command, sizeof(command), "move %d %d\n", square / 8, square % 8);
+        bot_send(bot, command);
+    }
+}
+
+void bot_handle_board(Bot *bot, int event, bool my_turn, const Load_Options *options,
+                      std::vector<uint32_t> &latencies, unsigned *seed)
+{
+    if (event == EVENT_SNAPSHOT)
+        bot->reconnecting = false;
+
+    if (event == EVENT_START)
+    {
+        bot->state = BOT_PLAYING;
+        if (bot->color == 1)
+            bot_move(bot, bot->board, seed);
+    }
+    else if (event == EVENT_GAME_OVER)
+    {
+        bot_record_latency(bot, latencies);
+        if (bot->color == 1)
+            load_games++;
+        bot_play(bot, options->ai_level);
+    }
+    else if (event == EVENT_SNAPSHOT)
+    {
+        if (my_turn && !bot->move_pending)
+            bot_move(bot, bot->board, seed);
+    }
+    else
+    {
+        bot_record_latency(bot, latencies);
+        if (my_turn)
+            bot_move(bot, bot->board, seed);
+    }
+
+    if (options->chaos && bot->state == BOT_PLAYING && event != EVENT_GAME_OVER)
+        bot_chaos(bot, seed);
+}
+
+int board_event(const char *marker)
+{
+    if (!strcmp(marker, "Jocul a inceput"))
+        return EVENT_START;
+    if (!strcmp(marker, "Sync "))
+        return EVENT_SNAPSHOT;
+    if (!strcmp(marker, "Game Over"))
+        return EVENT_GAME_OVER;
+    return EVENT_MOVE;
+}
+
+void bot_handle_input(Bot *bot, const Load_Options *options, std::vector<uint32_t> &latencies, unsigned *seed)
+{
+    char *text = bot->input;
+    char *end = bot->input + bot->input_length;
+    *end = 0;
 
+    while (text < end && bot->state != BOT_CLOSED)
+    {
+        const char *board_marker = NULL, *plain_marker = NULL;
+        const char *board_at = find_marker(text, board_markers, sizeof(board_markers) / sizeof(board_markers[0]), &board_marker);
+        const char *plain_at = find_marker(text, plain_markers, sizeof(plain_markers) / sizeof(plain_markers[0]), &plain_marker);
+
+        if (plain_at && (!board_at || plain_at < board_at))
+        {
+            const char *after = plain_at + strlen(plain_marker);
+            if (!strcmp(plain_marker, TOKEN_MARKER) && !strchr(after, '\n'))
+                break;
+            bot_handle_message(bot, plain_marker, after, options);
+            text = (char *)after;
+            continue;
+        }
+
+        if (!board_at)
+        {
+            if (end - text > LOAD_MARKER_TAIL)
+                text = end - LOAD_MARKER_TAIL;
+            break;
+        }
+
+        int event = board_event(board_marker);
+        if (event == EVENT_START || event == EVENT_SNAPSHOT)
+        {
+            const char *sync = strstr(board_at, "Sync ");
+            const char *board_end = sync ? parse_board(sync, end, bot->board) : NULL;
+            if (!board_end)
+                break;
+
+            bot->seq = strtoul(sync + 5, NULL, 10);
+            if (event == EVENT_START)
+                bot->color = strstr(board_at, "negre") && strstr(board_at, "negre") < sync ? 1 : 2;
+            bot_handle_board(bot, event, is_my_turn(bot, sync, board_end), options, latencies, seed);
+            text = (char *)board_end;
+            continue;
+        }
+
+        const char *delta = strstr(board_at, "Delta ");
+        const char *delta_end = delta ? strchr(delta, '\n') : NULL;
+        if (!delta_end)
+            break;
+
+        Delta_Update update;
+        if (parse_delta_line(delta, update) && bot_apply_delta(bot, update))
+            bot_handle_board(bot, event, is_my_turn(bot, board_at, delta), options, latencies, seed);
+        text = (char *)delta_end + 1;
+    }
+
+    bot->input_length = end - text;
+    memmove(bot->input, text, bot->input_length);
+}
+
+void bot_handle_frames(Bot *bot, const Load_Options *options, std::vector<uint32_t> &latencies, unsigned *seed)
+{
+    size_t offset = 0;
+    while (bot->input_length - offset >= SERVER_HEADER_SIZE && bot->state != BOT_CLOSED)
+    {
+        const uint8_t *frame = (const uint8_t *)bot->input + offset;
+        size_t payload_length = read_u16(frame + 1);
+        if (bot->input_length - offset < SERVER_HEADER_SIZE + payload_length)
+            break;
+        offset += SERVER_HEADER_SIZE + payload_length;
+
+        const uint8_t *payload = frame + SERVER_HEADER_SIZE;
+        if (frame[0] == OP_MESSAGE)
+        {
+            char text[BUFFER_SIZE];
+            const char *marker = NULL;
+            snprintf(text, sizeof(text), "%.*s", (int)payload_length, (const char *)payload);
+            const char *found = find_marker(text, plain_markers, sizeof(plain_markers) / sizeof(plain_markers[0]), &marker);
+            if (found)
+                bot_handle_message(bot, marker, found + strlen(marker), options);
+        }
+        else if (frame[0] == OP_BOARD && payload_length == BOARD_PAYLOAD_SIZE)
+        {
+            Board_Update update;
+            decode_board_payload(payload, update);
+            bot->board = update.board;
+            bot->seq = update.seq;
+            if (update.event == EVENT_START)
+                bot->color = update.color;
+            bot_handle_board(bot, update.event, update.turn == bot->color, options, latencies, seed);
+        }
+        else if (frame[0] == OP_DELTA && payload_length == DELTA_PAYLOAD_SIZE)
+        {
+            Delta_Update update;
+            decode_delta_payload(payload, update);
+            if (bot_apply_delta(bot, update))
+                bot_handle_board(bot, update.event, update.turn == bot->color, options, latencies, seed);
+        }
+    }
+
+    bot->input_length -= offset;
+    memmove(bot->input, bot->input + offset, bot->input_length);
+}
+
+// Comes back on a new connection with the session token, the way a client on a flaky network would.
+void bot_reconnect(Bot *bot, const Load_Options *options, int epoll_fd)
+{
+    bot->drop = false;
+    bot->move_pending = false;
+    bot->input_length = 0;
+    load_drops++;
+    close(bot->socket);
+    bot->socket = connect_to_server(options->host, options->port);
+    if (bot->socket < 0 || (bot->binary && !send_hello(bot->socket)))
+    {
+        load_errors++;
+        load_connected--;
+        bot->state = BOT_CLOSED;
+        if (bot->socket >= 0)
+            close(bot->socket);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = bot;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->socket, &event);
+    bot->reconnecting = true;
+    bot_resume(bot);
+}
+
+void load_worker(const Load_Options *options, int first, int count)
+{
+    std::vector<Bot> bots(count);
+    std::vector<uint32_t> latencies;
+    unsigned seed = (unsigned)getpid() ^ (unsigned)first;
+    int epoll_fd = epoll_create1(0);
+
+    for (int i = 0; i < count; i++)
+    {
+        Bot *bot = &bots[i];
+        bot->state = BOT_CLOSED;
+        bot->drop = false;
+        bot->reconnecting = false;
+        bot->token[0] = 0;
+        bot->socket = connect_to_server(options->host, options->port);
+        if (bot->socket < 0)
+        {
+            load_errors++;
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = bot;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->socket, &event);
+
+        bot->binary = options->binary;
+        if (bot->binary && !send_hello(bot->socket))
+        {
+            load_errors++;
+            close(bot->socket);
+            continue;
+        }
+
+        char command[128];
+        snprintf(bot->username, sizeof(bot->username), "bot%d_%d", getpid(), first + i);
+        snprintf(command, sizeof(command), "register %s bot\n", bot->username);
+        bot->state = BOT_REGISTERING;
+        load_connected++;
+        bot_send(bot, command);
+    }
+
+    struct epoll_event events[LOAD_MAX_EVENTS];
+    while (load_running)
+    {
+        int ready = epoll_wait(epoll_fd, events, LOAD_MAX_EVENTS, 100);
+        for (int i = 0; i < ready; i++)
+        {
+            Bot *bot = (Bot *)events[i].data.ptr;
+            if (bot->state == BOT_CLOSED)
+                continue;
+
+            ssize_t bytes_received = recv(bot->socket, bot->input + bot->input_length, LOAD_BUFFER_SIZE - 1 - bot->input_length, 0);
+            if (bytes_received <= 0)
+            {
+                load_errors++;
+                load_connected--;
+                bot->state = BOT_CLOSED;
+                close(bot->socket);
+                continue;
+            }
+            bot->input_length += bytes_received;
+            if (bot->binary)
+                bot_handle_frames(bot, options, latencies, &seed);
+            else
+                bot_handle_input(bot, options, latencies, &seed);
+            if (bot->input_length >= LOAD_BUFFER_SIZE - 1)
+                bot->input_length = 0;
+            if (bot->drop && bot->state != BOT_CLOSED)
+                bot_reconnect(bot, options, epoll_fd);
+        }
+    }
+
+    for (Bot &bot : bots)
+    {
+        if (bot.state != BOT_CLOSED)
+            close(bot.socket);
+    }
+    close(epoll_fd);
+
+    std::lock_guard<std::mutex> lock(load_latencies_mutex);
+    load_latencies.insert(load_latencies.end(), latencies.begin(), latencies.end());
+}
+
+double latency_percentile(const std::vector<uint32_t> &sorted, double percentile)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(percentile * (sorted.size() - 1));
+    return sorted[index] / 1000.0;
+}
+
+int run_load_test(const Load_Options *options)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("Test de incarcare%s: %d conexiuni, %d thread-uri, %d secunde catre %s:%d\n", options->chaos ? " (chaos)" : "",
+           options->connections, options->threads, options->duration, options->host, options->port);
+
+    load_running = true;
+    std::vector<std::thread> workers;
+    int per_thread = options->connections / options->threads;
+    int extra = options->connections % options->threads;
+    for (int i = 0, first = 0; i < options->threads; i++)
+    {
+        int count = per_thread + (i < extra ? 1 : 0);
+        workers.emplace_back(load_worker, options, first, count);
+        first += count;
+    }
+
+    long last_commands = 0, last_moves = 0;
+    for (int second = 1; second <= options->duration; second++)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        long commands = load_commands, moves = load_moves;
+        printf("[%3ds] conectati: %d  comenzi/s: %ld  mutari/s: %ld  partide: %ld  erori: %ld\n",
+               second, load_connected.load(), commands - last_commands, moves - last_moves, load_games.load(), load_errors.load());
+        last_commands = commands;
+        last_moves = moves;
+    }
+
+    load_running = false;
+    for (std::thread &worker : workers)
+        worker.join();
+
+    std::sort(load_latencies.begin(), load_latencies.end());
+    long commands = load_commands, errors = load_errors;
+    printf("\nRezultate:\n");
+    printf("  comenzi trimise: %ld (%.1f comenzi/s)\n", commands, (double)commands / options->duration);
+    printf("  mutari confirmate: %ld (%.1f mutari/s)\n", load_moves.load(), (double)load_moves / options->duration);
+    printf("  partide terminate: %ld\n", load_games.load());
+    if (options->chaos)
+        printf("  deconectari provocate: %ld\n", load_drops.load());
+    printf("  erori: %ld (%.3f%%)\n", errors, commands ? 100.0 * errors / commands : 0.0);
+    printf("  latenta mutare (ms): p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+           latency_percentile(load_latencies, 0.50), latency_percentile(load_latencies, 0.99),
+           latency_percentile(load_latencies, 0.999), latency_percentile(load_latencies, 1.0));
+    return 0;
+}
+
+void request_sync()
+{
+    uint8_t frame[CLIENT_HEADER_SIZE + MAX_CLIENT_PAYLOAD];
+    size_t length = encode_command("sync", frame);
+    if (binary_protocol)
+        send(client_socket, frame, length, MSG_NOSIGNAL);
+    else
+        send(client_socket, "sync\n", 5, MSG_NOSIGNAL);
+}
+
+bool apply_local_delta(const Delta_Update &update)
+{
+    if (!local_game.active || update.seq != local_game.seq + 1)
+    {
+        request_sync();
+        return false;
+    }
+    apply_delta(local_game.board, update);
+    local_game.seq = update.seq;
+    return true;
+}
+
+void show_screen(const std::string &output, bool game_over)
+{
+    printf("\033[H\033[J");
+    printf("%s\n", output.c_str());
+    if (local_game.active)
+        printf("%s", get_board_string(local_game.board).c_str());
+    fflush(stdout);
+    if (game_over)
+        local_game.active = false;
+}
+
+bool is_partial_marker(const char *text, const char *marker)
+{
+    size_t length = strlen(text);
+    return strncmp(text, marker, std::min(length, strlen(marker))) == 0;
+}
+
+// The server sends the whole board only when a game starts and on "sync"; after that every move
+// arrives as a "Delta" line that is applied to the local copy, which is redrawn under each reply.
 void *receive_messages(void *arg)
 {
-    bzero(buffer, BUFFER_SIZE);
+    std::string pending;
     while (1)
     {
-        bzero(buffer, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
         if (bytes_received < 0)
         {
             perror("Eroare la primirea răspunsului de la server");
@@ -29,43 +786,203 @@ void *receive_messages(void *arg)
             printf("Serverul s-a deconectat.\n");
             break;
         }
+        pending.append(buffer, bytes_received);
+
+        std::string output;
+        bool game_over = false;
+        size_t start = 0;
+        while (start < pending.size())
+        {
+            const char *line = pending.c_str() + start;
+            const char *end = pending.c_str() + pending.size();
+            const char *newline = strchr(line, '\n');
+
+            if (strncmp(line, "Sync ", 5) == 0)
+            {
+                Board board;
+                const char *board_end = parse_board(line, end, board);
+                if (!board_end)
+                    break;
+                local_game.board = board;
+                local_game.seq = strtoul(line + 5, NULL, 10);
+                local_game.active = true;
+                const char *turn = strchr(line, ':');
+                if (turn && turn < newline)
+                    output.append(turn + 2, newline + 1);
+                start = board_end - pending.c_str();
+                continue;
+            }
+
+            if (!newline)
+            {
+                if (is_partial_marker(line, "Delta ") || is_partial_marker(line, "Sync "))
+                    break;
+                output += line;
+                start = pending.size();
+                break;
+            }
+
+            Delta_Update update;
+            if (parse_delta_line(line, update))
+                apply_local_delta(update);
+            else
+                output.append(line, newline + 1);
+            start = newline + 1 - pending.c_str();
+        }
+        pending.erase(0, start);
 
-        printf("\033[H\033[J");
-        printf("%s\n", buffer);
+        if (output.find("Game Over") != std::string::npos || output.find("a abandonat jocul") != std::string::npos)
+            game_over = true;
+        if (!output.empty() || game_over)
+            show_screen(output, game_over);
     }
     return NULL;
 }
 
-int main()
+void describe_delta(const Delta_Update &update, std::string &output)
+{
+    char text[BUFFER_SIZE];
+    if (update.event == EVENT_GAME_OVER)
+        snprintf(text, sizeof(text), "Game Over!\nNegru: %d\nAlb: %d\n", count_discs(local_game.board, 1), count_discs(local_game.board, 2));
+    else
+        snprintf(text, sizeof(text), "S-a mutat %d %d. %s\n", update.square / 8, update.square % 8,
+                 update.turn == local_game.color ? "Este randul tau!" : "Asteapta mutarea adversarului.");
+    output += text;
+}
+
+void *receive_frames(void *arg)
+{
+    static uint8_t frames[LOAD_BUFFER_SIZE];
+    const char *colors[] = {"", "negre(black)(B)", "albe(white)(W)"};
+    size_t length = 0;
+    while (1)
+    {
+        int bytes_received = recv(client_socket, frames + length, sizeof(frames) - length, 0);
+        if (bytes_received < 0)
+        {
+            perror("Eroare la primirea răspunsului de la server");
+            break;
+        }
+        else if (bytes_received == 0)
+        {
+            printf("Serverul s-a deconectat.\n");
+            break;
+        }
+        length += bytes_received;
+
+        std::string output;
+        bool game_over = false;
+        size_t offset = 0;
+        while (length - offset >= SERVER_HEADER_SIZE)
+        {
+            size_t payload_length = read_u16(frames + offset + 1);
+            if (length - offset < SERVER_HEADER_SIZE + payload_length)
+                break;
+
+            const uint8_t *payload = frames + offset + SERVER_HEADER_SIZE;
+            if (frames[offset] == OP_MESSAGE)
+            {
+                output.append((const char *)payload, payload_length);
+                output += "\n";
+                if (output.find("a abandonat jocul") != std::string::npos)
+                    game_over = true;
+            }
+            else if (frames[offset] == OP_BOARD && payload_length == BOARD_PAYLOAD_SIZE)
+            {
+                Board_Update update;
+                decode_board_payload(payload, update);
+                local_game.board = update.board;
+                local_game.seq = update.seq;
+                local_game.color = update.color <= 2 ? update.color : 0;
+                local_game.active = true;
+                if (update.event == EVENT_START)
+                    output += std::string("Jocul a inceput! Tu esti cu piesele ") + colors[local_game.color] + ".\n";
+            }
+            else if (frames[offset] == OP_DELTA && payload_length == DELTA_PAYLOAD_SIZE)
+            {
+                Delta_Update update;
+                decode_delta_payload(payload, update);
+                if (apply_local_delta(update))
+                {
+                    describe_delta(update, output);
+                    game_over = game_over || update.event == EVENT_GAME_OVER;
+                }
+            }
+            offset += SERVER_HEADER_SIZE + payload_length;
+        }
+        if (offset > 0)
+            show_screen(output, game_over);
+
+        length -= offset;
+        memmove(frames, frames + offset, length);
+        if (length == sizeof(frames))
+            length = 0;
+    }
+    return NULL;
+}
+
+void print_usage(const char *program)
+{
+    printf("Utilizare: %s [--binary] [--host ip] [--port port]\n", program);
+    printf("           %s --load <conexiuni> [--threads n] [--duration secunde] [--ai nivel] [--chaos] [--binary] [--host ip] [--port port]\n", program);
+}
+
+int main(int argc, char *argv[])
 {
-    struct sockaddr_in server_address;
     char command[BUFFER_SIZE];
-    int optval = 1;
+    Load_Options options = {SERVER_IP, SERVER_PORT, 0, 4, 30, 0, false, false};
 
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0)
+    for (int i = 1; i < argc; i++)
     {
-        perror("Eroare la crearea socket-ului client");
-        exit(EXIT_FAILURE);
+        if (i + 1 < argc && strcmp(argv[i], "--host") == 0)
+            options.host = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "--port") == 0)
+            options.port = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--load") == 0)
+            options.connections = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--threads") == 0)
+            options.threads = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--duration") == 0)
+            options.duration = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "--ai") == 0)
+            options.ai_level = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--binary") == 0)
+            options.binary = true;
+        else if (strcmp(argv[i], "--chaos") == 0)
+            options.chaos = true;
+        else
+        {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    setsockopt(client_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (options.connections > 0)
+    {
+        if (options.threads < 1)
+            options.threads = 1;
+        if (options.threads > options.connections)
+            options.threads = options.connections;
+        if (options.duration < 1)
+            options.duration = 1;
+        return run_load_test(&options);
+    }
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(SERVER_PORT);
-    server_address.sin_addr.s_addr = inet_addr(SERVER_IP);
+    client_socket = connect_to_server(options.host, options.port);
+    if (client_socket < 0)
+        exit(EXIT_FAILURE);
 
-    if (connect(client_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    binary_protocol = options.binary;
+    if (binary_protocol && !send_hello(client_socket))
     {
-        perror("Eroare la conectarea la server");
-        close(client_socket);
+        perror("Eroare la negocierea protocolului binar");
         exit(EXIT_FAILURE);
     }
 
-    printf("Conectat la serverul %s:%d\n", SERVER_IP, SERVER_PORT);
+    printf("Conectat la serverul %s:%d\n", options.host, options.port);
     bzero(buffer, BUFFER_SIZE);
     pthread_t receive_thread;
-    pthread_create(&receive_thread, NULL, receive_messages, NULL);
+    pthread_create(&receive_thread, NULL, binary_protocol ? receive_frames : receive_messages, NULL);
 
     while (1)
     {
@@ -81,7 +998,20 @@ int main()
             break;
         }
 
-        if (send(client_socket, command, strlen(command), 0) < 0)
+        uint8_t frame[CLIENT_HEADER_SIZE + MAX_CLIENT_PAYLOAD];
+        const void *data = frame;
+        size_t length;
+        if (binary_protocol)
+        {
+            length = encode_command(command, frame);
+        }
+        else
+        {
+            strcat(command, "\n");
+            data = command;
+            length = strlen(command);
+        }
+        if (send(client_socket, data, length, 0) < 0)
         {
             perror("Eroare la trimiterea comenzii către server");
             break;
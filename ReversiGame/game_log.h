@@ -0,0 +1,170 @@
+#ifndef GAME_LOG_H
+#define GAME_LOG_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// games.log starts with GAME_LOG_MAGIC, followed by records of the form [type u8][length u8][match id u32][payload].
+// Records are only ever appended; a record cut short by a crash is dropped on the next startup.
+#define GAME_LOG_MAGIC "RVGLOG1\n"
+#define GAME_LOG_HEADER_SIZE 8
+#define GAME_RECORD_HEADER_SIZE 6
+#define MAX_GAME_RECORD_SIZE (GAME_RECORD_HEADER_SIZE + 255)
+#define MAX_LOG_NAME 49
+#define MAX_GAME_MOVES 64
+
+enum Game_Record_Type
+{
+    RECORD_START = 1,
+    RECORD_MOVE,
+    RECORD_END
+};
+
+enum Game_End_Reason
+{
+    END_FINISHED,
+    END_SURRENDER,
+    END_DISCONNECT,
+    END_TIMEOUT
+};
+
+// START: [ai level][black name][white name], names as [length u8][bytes].
+// MOVE:  [square][player]
+// END:   [reason][loser][ai level][black name][white name][move count][squares...], enough to replay the game alone.
+typedef struct
+{
+    uint8_t type;
+    uint32_t match_id;
+    uint8_t ai_level;
+    char names[2][MAX_LOG_NAME + 1];
+    uint8_t square;
+    uint8_t player;
+    uint8_t reason;
+    uint8_t loser;
+    uint8_t move_count;
+    uint8_t moves[MAX_GAME_MOVES];
+} Game_Record;
+
+inline size_t write_log_name(uint8_t *out, const char *name)
+{
+    size_t length = strnlen(name, MAX_LOG_NAME);
+    out[0] = length;
+    memcpy(out + 1, name, length);
+    return length + 1;
+}
+
+inline size_t finish_game_record(uint8_t *out, uint8_t type, uint32_t match_id, size_t payload_length)
+{
+    out[0] = type;
+    out[1] = payload_length;
+    write_u32(out + 2, match_id);
+    return GAME_RECORD_HEADER_SIZE + payload_length;
+}
+
+inline size_t encode_start_record(uint8_t *out, uint32_t match_id, int ai_level, const char *black, const char *white)
+{
+    uint8_t *payload = out + GAME_RECORD_HEADER_SIZE;
+    size_t length = 0;
+    payload[length++] = ai_level;
+    length += write_log_name(payload + length, black);
+    length += write_log_name(payload + length, white);
+    return finish_game_record(out, RECORD_START, match_id, length);
+}
+
+inline size_t encode_move_record(uint8_t *out, uint32_t match_id, int square, int player)
+{
+    uint8_t *payload = out + GAME_RECORD_HEADER_SIZE;
+    payload[0] = square;
+    payload[1] = player;
+    return finish_game_record(out, RECORD_MOVE, match_id, 2);
+}
+
+inline size_t encode_end_record(uint8_t *out, uint32_t match_id, int reason, int loser, int ai_level,
+                                const char *black, const char *white, const uint8_t *moves, int move_count)
+{
+    uint8_t *payload = out + GAME_RECORD_HEADER_SIZE;
+    size_t length = 0;
+    payload[length++] = reason;
+    payload[length++] = loser;
+    payload[length++] = ai_level;
+    length += write_log_name(payload + length, black);
+    length += write_log_name(payload + length, white);
+    payload[length++] = move_count;
+    memcpy(payload + length, moves, move_count);
+    length += move_count;
+    return finish_game_record(out, RECORD_END, match_id, length);
+}
+
+inline bool read_log_name(const uint8_t *payload, size_t length, size_t *offset, char *name)
+{
+    if (*offset >= length || *offset + 1 + payload[*offset] > length || payload[*offset] > MAX_LOG_NAME)
+        return false;
+    size_t name_length = payload[*offset];
+    memcpy(name, payload + *offset + 1, name_length);
+    name[name_length] = 0;
+    *offset += 1 + name_length;
+    return true;
+}
+
+// Returns the size of the record at data, or 0 if the bytes there are not a complete, well-formed record.
+inline size_t decode_game_record(const uint8_t *data, size_t available, Game_Record &record)
+{
+    if (available < GAME_RECORD_HEADER_SIZE)
+        return 0;
+    size_t length = data[1];
+    if (available < GAME_RECORD_HEADER_SIZE + length)
+        return 0;
+
+    const uint8_t *payload = data + GAME_RECORD_HEADER_SIZE;
+    record.type = data[0];
+    record.match_id = read_u32(data + 2);
+    size_t offset = 0;
+    switch (record.type)
+    {
+    case RECORD_START:
+        if (length < 1)
+            return 0;
+        record.ai_level = payload[offset++];
+        if (!read_log_name(payload, length, &offset, record.names[0]) || !read_log_name(payload, length, &offset, record.names[1]))
+            return 0;
+        break;
+    case RECORD_MOVE:
+        if (length != 2 || payload[0] >= 64 || (payload[1] != 1 && payload[1] != 2))
+            return 0;
+        record.square = payload[0];
+        record.player = payload[1];
+        break;
+    case RECORD_END:
+        if (length < 3)
+            return 0;
+        record.reason = payload[offset++];
+        record.loser = payload[offset++];
+        record.ai_level = payload[offset++];
+        if (!read_log_name(payload, length, &offset, record.names[0]) || !read_log_name(payload, length, &offset, record.names[1]))
+            return 0;
+        if (offset >= length || payload[offset] > MAX_GAME_MOVES || offset + 1 + payload[offset] != length)
+            return 0;
+        record.move_count = payload[offset++];
+        memcpy(record.moves, payload + offset, record.move_count);
+        break;
+    default:
+        return 0;
+    }
+    return GAME_RECORD_HEADER_SIZE + length;
+}
+
+// Plays one logged move and passes the turn the way the server does; returns false if the move is illegal.
+inline bool replay_move(Board &board, int *turn, int square)
+{
+    if (!is_valid_move(board, square / 8, square % 8, *turn))
+        return false;
+    make_move(board, square / 8, square % 8, *turn);
+    *turn = 3 - *turn;
+    if (!has_valid_moves(board, *turn))
+        *turn = 3 - *turn;
+    return true;
+}
+
+#endif
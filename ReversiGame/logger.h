@@ -0,0 +1,205 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define LOG_RING_SIZE 4096
+#define LOG_EVENT_SIZE 32
+#define LOG_TEXT_SIZE 216
+#define LOG_FLUSH_INTERVAL_MS 10
+#define LOG_OUTPUT_SIZE (64 * 1024)
+
+enum Log_Level
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+// A slot is free for the producer at position p when sequence == p, and ready for the consumer when sequence == p + 1.
+typedef struct
+{
+    std::atomic<uint64_t> sequence;
+    uint64_t timestamp;
+    int level;
+    int thread;
+    char event[LOG_EVENT_SIZE];
+    char text[LOG_TEXT_SIZE];
+} Log_Record;
+
+inline Log_Record log_ring[LOG_RING_SIZE];
+inline std::atomic<uint64_t> log_head;
+inline uint64_t log_tail;
+inline std::atomic<uint64_t> log_dropped;
+inline std::atomic<int> log_min_level(LOG_LEVEL_INFO);
+inline std::atomic<int> log_thread_count;
+inline int log_shard = -1; // set in shard processes, which all write to the same stdout
+
+inline int log_thread_id()
+{
+    thread_local int id = ++log_thread_count;
+    return id;
+}
+
+// Never blocks: when the flush thread falls behind the record is dropped and counted instead.
+__attribute__((format(printf, 3, 4))) inline void log_write(int level, const char *event, const char *format, ...)
+{
+    if (level < log_min_level.load(std::memory_order_relaxed))
+        return;
+
+    uint64_t position = log_head.load(std::memory_order_relaxed);
+    Log_Record *record;
+    while (1)
+    {
+        record = &log_ring[position & (LOG_RING_SIZE - 1)];
+        int64_t distance = (int64_t)(record->sequence.load(std::memory_order_acquire) - position);
+        if (distance == 0)
+        {
+            if (log_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (distance < 0)
+        {
+            log_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = log_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    record->level = level;
+    record->thread = log_thread_id();
+    snprintf(record->event, LOG_EVENT_SIZE, "%s", event);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, LOG_TEXT_SIZE, format, args);
+    va_end(args);
+    record->sequence.store(position + 1, std::memory_order_release);
+}
+
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Debug records cost nothing unless the server is built with -DDEBUG_LOG.
+#ifdef DEBUG_LOG
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+
+inline size_t log_escape(char *out, size_t size, const char *text)
+{
+    size_t length = 0;
+    for (; *text && length + 7 < size; text++)
+    {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+        {
+            out[length++] = '\\';
+            out[length++] = c;
+        }
+        else if (c < 0x20)
+        {
+            length += snprintf(out + length, size - length, "\\u%04x", c);
+        }
+        else
+        {
+            out[length++] = c;
+        }
+    }
+    out[length] = 0;
+    return length;
+}
+
+// One JSON object per line: {"ts":...,"level":...,["shard":...,]"thread":...,"event":...,"msg":...}
+inline size_t log_format(char *out, size_t size, uint64_t timestamp, int level, int thread, const char *event, const char *text)
+{
+    static const char *level_names[] = {"debug", "info", "warn", "error"};
+    char escaped_event[LOG_EVENT_SIZE * 6];
+    char escaped_text[LOG_TEXT_SIZE * 6];
+    log_escape(escaped_event, sizeof(escaped_event), event);
+    log_escape(escaped_text, sizeof(escaped_text), text);
+
+    time_t seconds = timestamp / 1000000000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+
+    char shard[24] = "";
+    if (log_shard >= 0)
+        snprintf(shard, sizeof(shard), "\"shard\":%d,", log_shard);
+
+    return snprintf(out, size, "{\"ts\":\"%s.%03dZ\",\"level\":\"%s\",%s\"thread\":%d,\"event\":\"%s\",\"msg\":\"%s\"}\n",
+                    date, (int)(timestamp / 1000000 % 1000), level_names[level], shard, thread, escaped_event, escaped_text);
+}
+
+inline void log_flush_thread(FILE *stream)
+{
+    static char output[LOG_OUTPUT_SIZE];
+    uint64_t reported_drops = 0;
+    while (1)
+    {
+        size_t length = 0;
+        while (length + LOG_TEXT_SIZE * 8 < LOG_OUTPUT_SIZE)
+        {
+            Log_Record &record = log_ring[log_tail & (LOG_RING_SIZE - 1)];
+            if (record.sequence.load(std::memory_order_acquire) != log_tail + 1)
+                break;
+            length += log_format(output + length, LOG_OUTPUT_SIZE - length, record.timestamp, record.level, record.thread, record.event, record.text);
+            record.sequence.store(log_tail + LOG_RING_SIZE, std::memory_order_release);
+            log_tail++;
+        }
+
+        uint64_t drops = log_dropped.load(std::memory_order_relaxed);
+        if (drops != reported_drops)
+        {
+            char text[64];
+            snprintf(text, sizeof(text), "%llu mesaje pierdute", (unsigned long long)(drops - reported_drops));
+            uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            length += log_format(output + length, LOG_OUTPUT_SIZE - length, now, LOG_LEVEL_WARN, 0, "log_dropped", text);
+            reported_drops = drops;
+        }
+
+        if (length == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+            continue;
+        }
+        fwrite(output, 1, length, stream);
+        fflush(stream);
+    }
+}
+
+inline int log_parse_level(const char *name, int fallback)
+{
+    static const char *level_names[] = {"debug", "info", "warn", "error"};
+    for (int level = LOG_LEVEL_DEBUG; name && level <= LOG_LEVEL_ERROR; level++)
+    {
+        if (strcmp(name, level_names[level]) == 0)
+            return level;
+    }
+    return fallback;
+}
+
+inline void log_start(FILE *stream, int min_level)
+{
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        log_ring[i].sequence.store(i, std::memory_order_relaxed);
+    log_min_level = min_level;
+    std::thread(log_flush_thread, stream).detach();
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#define MAX_HISTOGRAM_BUCKETS 16
+
+// Each counter sits on its own cache line so worker threads bumping different counters never share one.
+typedef struct alignas(64)
+{
+    std::atomic<uint64_t> value;
+} Metric_Counter;
+
+typedef struct alignas(64)
+{
+    std::atomic<int64_t> value;
+} Metric_Gauge;
+
+// Bucket bounds are upper limits in nanoseconds; the last bucket is +Inf.
+typedef struct alignas(64)
+{
+    const uint64_t *bounds;
+    int bucket_count;
+    std::atomic<uint64_t> buckets[MAX_HISTOGRAM_BUCKETS + 1];
+    std::atomic<uint64_t> sum;
+} Metric_Histogram;
+
+inline void metric_add(Metric_Counter &counter, uint64_t amount = 1)
+{
+    counter.value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline void metric_add(Metric_Gauge &gauge, int64_t amount)
+{
+    gauge.value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline void metric_set(Metric_Gauge &gauge, int64_t value)
+{
+    gauge.value.store(value, std::memory_order_relaxed);
+}
+
+inline void metric_observe(Metric_Histogram &histogram, uint64_t nanoseconds)
+{
+    int bucket = 0;
+    while (bucket < histogram.bucket_count && nanoseconds > histogram.bounds[bucket])
+        bucket++;
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+inline uint64_t metric_elapsed(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Prometheus text exposition format, version 0.0.4.
+inline void metric_header(std::string &out, const char *name, const char *type, const char *help)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    out += line;
+}
+
+inline void metric_write(std::string &out, const char *name, const char *labels, uint64_t value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %llu\n", name, labels, (unsigned long long)value);
+    out += line;
+}
+
+inline void metric_write_gauge(std::string &out, const char *name, int64_t value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%s %lld\n", name, (long long)value);
+    out += line;
+}
+
+// label is either empty or a single `key="value"` pair added to every series of the histogram.
+inline void metric_write_histogram(std::string &out, const char *name, const char *label, const Metric_Histogram &histogram)
+{
+    char line[256];
+    const char *separator = label[0] ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= histogram.bucket_count; i++)
+    {
+        cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (i < histogram.bucket_count)
+            snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, separator,
+                     histogram.bounds[i] / 1e9, (unsigned long long)cumulative);
+        else
+            snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, separator,
+                     (unsigned long long)cumulative);
+        out += line;
+    }
+    // _count repeats the +Inf bucket so the two stay equal even while other threads keep observing.
+    const char *open = label[0] ? "{" : "";
+    const char *close = label[0] ? "}" : "";
+    snprintf(line, sizeof(line), "%s_sum%s%s%s %.9f\n%s_count%s%s%s %llu\n",
+             name, open, label, close, histogram.sum.load(std::memory_order_relaxed) / 1e9,
+             name, open, label, close, (unsigned long long)cumulative);
+    out += line;
+}
+
+#endif
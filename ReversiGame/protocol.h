@@ -0,0 +1,215 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "reversi.h"
+
+// A connection whose first two bytes are PROTOCOL_MAGIC, PROTOCOL_VERSION speaks the binary protocol;
+// anything else is treated as the newline-delimited text protocol.
+#define PROTOCOL_MAGIC 0xB5
+#define PROTOCOL_VERSION 1
+
+#define CLIENT_HEADER_SIZE 2
+#define SERVER_HEADER_SIZE 3
+#define MAX_CLIENT_PAYLOAD 255
+#define BOARD_PAYLOAD_SIZE 24
+#define BOARD_FRAME_SIZE (SERVER_HEADER_SIZE + BOARD_PAYLOAD_SIZE)
+#define DELTA_PAYLOAD_SIZE 16
+#define DELTA_FRAME_SIZE (SERVER_HEADER_SIZE + DELTA_PAYLOAD_SIZE)
+#define DELTA_LINE_SIZE 128
+#define NO_SQUARE 0xFF
+
+enum Client_Opcode
+{
+    OP_REGISTER = 1,
+    OP_LOGIN,
+    OP_LOGOUT,
+    OP_PLAY,
+    OP_PLAY_AI,
+    OP_STOP,
+    OP_MOVE,
+    OP_SURRENDER,
+    OP_SCOREBOARD,
+    OP_HELP,
+    OP_TEXT,
+    OP_SYNC
+};
+
+enum Server_Opcode
+{
+    OP_MESSAGE = 1,
+    OP_BOARD,
+    OP_DELTA
+};
+
+enum Board_Event
+{
+    EVENT_SNAPSHOT,
+    EVENT_START,
+    EVENT_MOVE,
+    EVENT_GAME_OVER
+};
+
+typedef struct
+{
+    uint8_t event;
+    uint8_t color;
+    uint8_t turn;
+    uint8_t last_square;
+    uint32_t seq;
+    Board board;
+} Board_Update;
+
+// One move: the placed disc and the discs it flipped. seq counts moves since the game started,
+// so a client that sees a gap knows its copy of the board is stale and asks for a snapshot.
+typedef struct
+{
+    uint8_t event;
+    uint8_t player;
+    uint8_t square;
+    uint8_t turn;
+    uint32_t seq;
+    uint64_t flips;
+} Delta_Update;
+
+inline void write_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+}
+
+inline uint16_t read_u16(const uint8_t *in)
+{
+    return in[0] | (in[1] << 8);
+}
+
+inline void write_u32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (8 * i)) & 0xFF;
+}
+
+inline uint32_t read_u32(const uint8_t *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)in[i] << (8 * i);
+    return value;
+}
+
+inline void write_u64(uint8_t *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        out[i] = (value >> (8 * i)) & 0xFF;
+}
+
+inline uint64_t read_u64(const uint8_t *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+inline void write_server_header(uint8_t *out, uint8_t opcode, uint16_t length)
+{
+    out[0] = opcode;
+    write_u16(out + 1, length);
+}
+
+inline size_t encode_board_frame(uint8_t *out, const Board_Update &update)
+{
+    write_server_header(out, OP_BOARD, BOARD_PAYLOAD_SIZE);
+    uint8_t *payload = out + SERVER_HEADER_SIZE;
+    payload[0] = update.event;
+    payload[1] = update.color;
+    payload[2] = update.turn;
+    payload[3] = update.last_square;
+    write_u32(payload + 4, update.seq);
+    write_u64(payload + 8, update.board.discs[0]);
+    write_u64(payload + 16, update.board.discs[1]);
+    return BOARD_FRAME_SIZE;
+}
+
+inline void decode_board_payload(const uint8_t *payload, Board_Update &update)
+{
+    update.event = payload[0];
+    update.color = payload[1];
+    update.turn = payload[2];
+    update.last_square = payload[3];
+    update.seq = read_u32(payload + 4);
+    update.board.discs[0] = read_u64(payload + 8);
+    update.board.discs[1] = read_u64(payload + 16);
+    update.board.hash = board_hash(update.board);
+}
+
+inline size_t encode_delta_frame(uint8_t *out, const Delta_Update &update)
+{
+    write_server_header(out, OP_DELTA, DELTA_PAYLOAD_SIZE);
+    uint8_t *payload = out + SERVER_HEADER_SIZE;
+    payload[0] = update.event;
+    payload[1] = update.player;
+    payload[2] = update.square;
+    payload[3] = update.turn;
+    write_u32(payload + 4, update.seq);
+    write_u64(payload + 8, update.flips);
+    return DELTA_FRAME_SIZE;
+}
+
+inline void decode_delta_payload(const uint8_t *payload, Delta_Update &update)
+{
+    update.event = payload[0];
+    update.player = payload[1];
+    update.square = payload[2];
+    update.turn = payload[3];
+    update.seq = read_u32(payload + 4);
+    update.flips = read_u64(payload + 8);
+}
+
+// Text form of a delta: "Delta <seq>: <B|W> <rc> <rc>...", the placed disc first, then the flipped ones.
+inline size_t format_delta_line(char *out, uint32_t seq, int player, int square, uint64_t flips)
+{
+    size_t length = snprintf(out, DELTA_LINE_SIZE, "Delta %u: %c %d%d", seq, player == 1 ? 'B' : 'W', square / 8, square % 8);
+    for (; flips; flips &= flips - 1)
+    {
+        int flipped = __builtin_ctzll(flips);
+        length += snprintf(out + length, DELTA_LINE_SIZE - length, " %d%d", flipped / 8, flipped % 8);
+    }
+    length += snprintf(out + length, DELTA_LINE_SIZE - length, "\n");
+    return length;
+}
+
+inline bool parse_delta_line(const char *line, Delta_Update &update)
+{
+    char color;
+    int offset;
+    if (sscanf(line, "Delta %u: %c %n", &update.seq, &color, &offset) != 2)
+        return false;
+
+    update.player = (color == 'B') ? 1 : 2;
+    update.flips = 0;
+    int square = -1;
+    for (line += offset; line[0] >= '0' && line[0] <= '7' && line[1] >= '0' && line[1] <= '7';)
+    {
+        int parsed = (line[0] - '0') * 8 + (line[1] - '0');
+        if (square < 0)
+            square = parsed;
+        else
+            update.flips |= 1ULL << parsed;
+        line += 2;
+        while (*line == ' ')
+            line++;
+    }
+    update.square = square;
+    return square >= 0;
+}
+
+inline void apply_delta(Board &board, const Delta_Update &update)
+{
+    place_disc(board, update.square, update.flips, update.player);
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef REVERSI_H
+#define REVERSI_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// hash is the Zobrist hash of the discs, kept up to date by init_board and make_move; code that sets discs
+// directly recomputes it with board_hash.
+typedef struct
+{
+    uint64_t discs[2];
+    uint64_t hash;
+} Board;
+
+#define NOT_FILE_A 0xfefefefefefefefeULL
+#define NOT_FILE_H 0x7f7f7f7f7f7f7f7fULL
+
+#define BOARD_TEMPLATE "Tabla curenta:\n"     \
+                       "  0 1 2 3 4 5 6 7\n"   \
+                       "0 . . . . . . . . \n" \
+                       "1 . . . . . . . . \n" \
+                       "2 . . . . . . . . \n" \
+                       "3 . . . . . . . . \n" \
+                       "4 . . . . . . . . \n" \
+                       "5 . . . . . . . . \n" \
+                       "6 . . . . . . . . \n" \
+                       "7 . . . . . . . . \n"
+#define BOARD_STRING_SIZE sizeof(BOARD_TEMPLATE)
+#define BOARD_FIRST_CELL 35
+#define BOARD_ROW_STRIDE 19
+
+// One random key per (color, square): a position hashes to the XOR of the keys of its discs, so a move
+// only XORs in the keys of the squares it changed. flips[s] turns a disc on s over from one color to the other.
+typedef struct
+{
+    uint64_t discs[2][64];
+    uint64_t flips[64];
+    uint64_t white_to_move;
+} Zobrist_Keys;
+
+constexpr uint64_t zobrist_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+constexpr Zobrist_Keys build_zobrist_keys()
+{
+    Zobrist_Keys keys = {};
+    uint64_t state = 0;
+    for (int color = 0; color < 2; color++)
+    {
+        for (int square = 0; square < 64; square++)
+            keys.discs[color][square] = zobrist_mix(state += 0x9e3779b97f4a7c15ULL);
+    }
+    for (int square = 0; square < 64; square++)
+        keys.flips[square] = keys.discs[0][square] ^ keys.discs[1][square];
+    keys.white_to_move = zobrist_mix(state += 0x9e3779b97f4a7c15ULL);
+    return keys;
+}
+
+inline constexpr Zobrist_Keys zobrist_keys = build_zobrist_keys();
+
+static inline uint64_t shift_bits(uint64_t bits, int shift, uint64_t mask)
+{
+    return (shift > 0 ? bits << shift : bits >> -shift) & mask;
+}
+
+static inline uint64_t square_mask(int row, int col)
+{
+    return 1ULL << (row * 8 + col);
+}
+
+static inline uint64_t moves_in_direction(uint64_t own, uint64_t opp, uint64_t empty, int shift, uint64_t mask)
+{
+    uint64_t line = shift_bits(own, shift, mask) & opp;
+    line |= shift_bits(line, shift, mask) & opp;
+    line |= shift_bits(line, shift, mask) & opp;
+    line |= shift_bits(line, shift, mask) & opp;
+    line |= shift_bits(line, shift, mask) & opp;
+    line |= shift_bits(line, shift, mask) & opp;
+    return shift_bits(line, shift, mask) & empty;
+}
+
+static inline uint64_t flips_in_direction(uint64_t own, uint64_t opp, uint64_t move, int shift, uint64_t mask)
+{
+    uint64_t line = 0;
+    uint64_t cursor = shift_bits(move, shift, mask);
+    while (cursor & opp)
+    {
+        line |= cursor;
+        cursor = shift_bits(cursor, shift, mask);
+    }
+    return (cursor & own) ? line : 0;
+}
+
+inline uint64_t get_valid_moves(const Board &board, int player)
+{
+    uint64_t own = board.discs[player - 1];
+    uint64_t opp = board.discs[2 - player];
+    uint64_t empty = ~(own | opp);
+
+    return moves_in_direction(own, opp, empty, -9, NOT_FILE_H) |
+           moves_in_direction(own, opp, empty, -8, ~0ULL) |
+           moves_in_direction(own, opp, empty, -7, NOT_FILE_A) |
+           moves_in_direction(own, opp, empty, -1, NOT_FILE_H) |
+           moves_in_direction(own, opp, empty, 1, NOT_FILE_A) |
+           moves_in_direction(own, opp, empty, 7, NOT_FILE_H) |
+           moves_in_direction(own, opp, empty, 8, ~0ULL) |
+           moves_in_direction(own, opp, empty, 9, NOT_FILE_A);
+}
+
+inline uint64_t get_flips(const Board &board, int row, int col, int player)
+{
+    uint64_t own = board.discs[player - 1];
+    uint64_t opp = board.discs[2 - player];
+    uint64_t move = square_mask(row, col);
+
+    if ((own | opp) & move)
+        return 0;
+
+    return flips_in_direction(own, opp, move, -9, NOT_FILE_H) |
+           flips_in_direction(own, opp, move, -8, ~0ULL) |
+           flips_in_direction(own, opp, move, -7, NOT_FILE_A) |
+           flips_in_direction(own, opp, move, -1, NOT_FILE_H) |
+           flips_in_direction(own, opp, move, 1, NOT_FILE_A) |
+           flips_in_direction(own, opp, move, 7, NOT_FILE_H) |
+           flips_in_direction(own, opp, move, 8, ~0ULL) |
+           flips_in_direction(own, opp, move, 9, NOT_FILE_A);
+}
+
+inline bool is_valid_move(const Board &board, int row, int col, int player)
+{
+    return get_flips(board, row, col, player) != 0;
+}
+
+inline uint64_t board_hash(const Board &board)
+{
+    uint64_t hash = 0;
+    for (int color = 0; color < 2; color++)
+    {
+        for (uint64_t discs = board.discs[color]; discs; discs &= discs - 1)
+            hash ^= zobrist_keys.discs[color][__builtin_ctzll(discs)];
+    }
+    return hash;
+}
+
+// The same position with the other side to move is a different position for a search.
+inline uint64_t position_key(const Board &board, int player)
+{
+    return player == 2 ? board.hash ^ zobrist_keys.white_to_move : board.hash;
+}
+
+// Puts a disc of player on square and turns over flips, keeping the hash in step.
+inline void place_disc(Board &board, int square, uint64_t flips, int player)
+{
+    board.discs[player - 1] |= flips | (1ULL << square);
+    board.discs[2 - player] &= ~flips;
+    board.hash ^= zobrist_keys.discs[player - 1][square];
+    for (; flips; flips &= flips - 1)
+        board.hash ^= zobrist_keys.flips[__builtin_ctzll(flips)];
+}
+
+inline uint64_t make_move(Board &board, int row, int col, int player)
+{
+    uint64_t flips = get_flips(board, row, col, player);
+    place_disc(board, row * 8 + col, flips, player);
+    return flips;
+}
+
+inline void init_board(Board &board)
+{
+    board.discs[0] = square_mask(3, 4) | square_mask(4, 3);
+    board.discs[1] = square_mask(3, 3) | square_mask(4, 4);
+    board.hash = board_hash(board);
+}
+
+inline bool has_valid_moves(const Board &board, int player)
+{
+    return get_valid_moves(board, player) != 0;
+}
+
+inline int count_discs(const Board &board, int player)
+{
+    return __builtin_popcountll(board.discs[player - 1]);
+}
+
+// Writes BOARD_STRING_SIZE bytes (including the terminator) into out; only the 64 cells differ from the template.
+inline void render_board(const Board &board, char *out)
+{
+    memcpy(out, BOARD_TEMPLATE, BOARD_STRING_SIZE);
+    for (int row = 0; row < 8; row++)
+    {
+        char *cells = out + BOARD_FIRST_CELL + row * BOARD_ROW_STRIDE;
+        unsigned black = (board.discs[0] >> (row * 8)) & 0xFF;
+        unsigned white = (board.discs[1] >> (row * 8)) & 0xFF;
+        for (int col = 0; col < 8; col++)
+            cells[col * 2] = ".BW?"[((black >> col) & 1) | (((white >> col) & 1) << 1)];
+    }
+}
+
+inline std::string get_board_string(const Board &board)
+{
+    char text[BOARD_STRING_SIZE];
+    render_board(board, text);
+    return std::string(text, BOARD_STRING_SIZE - 1);
+}
+
+#endif
@@ -1,17 +1,197 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <thread>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sqlite3.h>
 #include <vector>
-#include <queue>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+
+#include "reversi.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "logger.h"
+#include "game_log.h"
+#include "auth.h"
+#include "shard.h"
+#include "timer_wheel.h"
 
 #define PORT 8080
+#define METRICS_PORT 9100
 #define BUFFER_SIZE 1024
+#define WORKER_THREADS 4
+#define MAX_EVENTS 256
+#define INPUT_BUFFER_SIZE 4096
+#define OUTPUT_LIMIT (256 * 1024)
+#define MAX_IOVECS 64
+#define OUTPUT_CHUNK_SIZE 2048
+#define OUTPUT_POOL_LIMIT 256
+#define SHARED_MESSAGE_SIZE 512
+#define LIST_GAMES_LIMIT 20
+#define DB_FLUSH_INTERVAL_MS 20
+#define GAME_LOG_PATH "games.log"
+#define GAME_LOG_FLUSH_INTERVAL_MS 20
+#define REPLAY_TEXT_SIZE 4096
+#define LEADERBOARD_TOP 10
+#define LEADERBOARD_TEXT_SIZE 1024
+#define GAME_SLOT_BITS 16
+#define MAX_GAMES (1 << GAME_SLOT_BITS)
+#define GAME_CHUNK 256
+#define MATCH_INTERVAL_MS 100
+#define MATCH_BASE_WINDOW 3
+#define MATCH_WINDOW_PER_SECOND 2
+#define AI_NAME "Calculatorul"
+#define AI_THREADS 2
+#define AI_DEFAULT_LEVEL 3
+#define AI_MAX_LEVEL 5
+#define AI_TT_BITS 20
+#define AI_HINT_LEVEL 4
+#define ANALYSIS_DEPTH 8
+#define ANALYSIS_BUDGET_MS 50
+#define ANALYSIS_MISTAKE 50
+#define ANALYSIS_QUEUE_LIMIT 64
+#define ANALYSIS_NICE 10
+#define ANALYSIS_TEXT_SIZE 8192
+#define AUTH_THREADS 2
+#define AUTH_QUEUE_LIMIT 1024
+#define AUTH_NICE 19
+#define USER_SHARDS 16
+#define SESSION_TTL std::chrono::hours(24)
+#define DB_BUSY_TIMEOUT_MS 5000
+#define CLIENT_IDLE_TIMEOUT std::chrono::minutes(10)
+#define RECONNECT_GRACE std::chrono::seconds(60)
+#define MATCH_DEADLINE std::chrono::minutes(2)
+#define BLITZ_DEFAULT_MINUTES 3
+#define BLITZ_DEFAULT_INCREMENT 2
+#define BLITZ_MAX_MINUTES 60
+#define BLITZ_MAX_INCREMENT 60
+
+#ifdef DEBUG_LOG
+#define COMMAND_LOG_SAMPLE 1
+#else
+#define COMMAND_LOG_SAMPLE 64
+#endif
+
+// FIFO over a vector that only grows, so steady-state push/pop never touches the heap.
+template <typename T>
+struct Ring_Queue
+{
+    std::vector<T> items;
+    size_t head;
+    size_t count;
+};
+
+template <typename T>
+void ring_push(Ring_Queue<T> &queue, T item)
+{
+    if (queue.count == queue.items.size())
+    {
+        std::vector<T> grown(std::max<size_t>(64, queue.items.size() * 2));
+        for (size_t i = 0; i < queue.count; i++)
+            grown[i] = queue.items[(queue.head + i) % queue.items.size()];
+        queue.items.swap(grown);
+        queue.head = 0;
+    }
+    queue.items[(queue.head + queue.count) % queue.items.size()] = item;
+    queue.count++;
+}
+
+template <typename T>
+T ring_pop(Ring_Queue<T> &queue)
+{
+    T item = queue.items[queue.head];
+    queue.head = (queue.head + 1) % queue.items.size();
+    queue.count--;
+    return item;
+}
+
+// Recycles single-object allocations (the leaderboard tree nodes) instead of returning them to the heap.
+// Only used by containers guarded by leaderboard_mutex.
+template <typename T>
+struct Pool_Allocator
+{
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef Pool_Allocator<U> other;
+    };
+
+    static void *free_list;
+
+    Pool_Allocator() {}
+    template <typename U>
+    Pool_Allocator(const Pool_Allocator<U> &) {}
+
+    T *allocate(size_t count)
+    {
+        if (count == 1 && free_list)
+        {
+            void *memory = free_list;
+            free_list = *(void **)memory;
+            return (T *)memory;
+        }
+        return (T *)::operator new(std::max(sizeof(T), sizeof(void *)) * count);
+    }
+
+    void deallocate(T *memory, size_t count)
+    {
+        if (count != 1)
+        {
+            ::operator delete(memory);
+            return;
+        }
+        *(void **)memory = free_list;
+        free_list = memory;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *memory, Args &&...args) { new (memory) U(std::forward<Args>(args)...); }
+    template <typename U>
+    void destroy(U *memory) { memory->~U(); }
+
+    bool operator==(const Pool_Allocator &) const { return true; }
+    bool operator!=(const Pool_Allocator &) const { return false; }
+};
+
+template <typename T>
+void *Pool_Allocator<T>::free_list = NULL;
+
+enum Input_Result
+{
+    INPUT_NONE,
+    INPUT_COMMAND,
+    INPUT_TOO_LONG,
+    INPUT_INVALID
+};
 
 enum States
 {
@@ -20,809 +200,5301 @@ enum States
     FREE
 };
 
+// A login, an analysis or a match being paired runs for a parked client on another thread, which holds a reference
+// until it is done.
+// The worker that parked it and the job may finish in either order; whichever is second hands the client on.
+enum Park_State
+{
+    PARK_NONE,
+    PARK_JOB,     // job running, the worker may still be in handle_client
+    PARK_WAITING, // job running, the worker has left
+    PARK_DONE     // job finished before the worker left, so the worker carries on itself
+};
+
+// Why a search is being ended. A ticket that is being paired cannot be cancelled, so the reason is kept while
+// the client is parked and the search is ended again once the pairing is settled (see cancel_matchmaking).
+enum Cancel_Reason
+{
+    CANCEL_NONE,
+    CANCEL_STOP,
+    CANCEL_DEADLINE,
+    CANCEL_DISCONNECT
+};
+
+// Client timers fire on the main thread, which only sets the matching bit in timers_fired; the worker
+// that next handles the client does the rest.
+enum Timer_Kind
+{
+    TIMER_IDLE,
+    TIMER_MATCH_DEADLINE,
+    TIMER_CLOCK,
+    TIMER_CALL,  // a parked client's coordinator call; answered on the main thread itself
+    TIMER_GRACE, // the seat of a player whose connection dropped; like TIMER_CLOCK, owned by the game
+    TIMER_KINDS
+};
+
+typedef struct
+{
+    int kind;
+    void *owner;
+    int id;
+} Timer_Event;
+
+typedef struct
+{
+    char data[INPUT_BUFFER_SIZE];
+    size_t head;
+    size_t length;
+    size_t scanned;
+    bool discarding;
+} Input_Buffer;
+
+// One encoded update queued on many sockets at once; whoever drops the last reference frees it.
+typedef struct Shared_Message
+{
+    std::atomic<int> refs;
+    struct Shared_Message *next_free;
+    size_t capacity;
+    size_t length;
+    char data[];
+} Shared_Message;
+
+// A chunk either owns its bytes or, with capacity 0, points at a Shared_Message.
+typedef struct Output_Chunk
+{
+    struct Output_Chunk *next;
+    Shared_Message *shared;
+    size_t capacity;
+    size_t length;
+    size_t offset;
+    char data[];
+} Output_Chunk;
+
+// A call to the coordinator waiting for the link thread. The auth thread blocks in coordinator_call until done is
+// set; a worker parks its client instead (coordinator_call_parked) and handler gets the reply, or NULL when none
+// came in time.
+typedef void (*Call_Handler)(struct Client_Info *client_info, Shard_Reader *reader);
+
 typedef struct
+{
+    bool done;
+    uint8_t *reply;
+    size_t size;
+    size_t length;
+    struct Client_Info *client;
+    Call_Handler handler;
+} Pending_Call;
+
+typedef struct Client_Info
 {
     int socket;
     int logged_in;
     char username[50];
-    int game_id;
-    States status;
+    std::atomic<int> game_id;
+    std::atomic<States> status;
+    std::atomic<int> pending_events;
+    std::atomic<int> refs;
+    bool closed;
+    bool negotiated;
+    std::atomic<bool> binary;
+    std::atomic<int> watching;
+    std::atomic<int> parked;
+    std::atomic<int> handoff_target;
+    int handoff_action;
+    uint32_t handoff_arg;
+    char handoff_command[64];
+    Input_Buffer input;
+    std::mutex output_mutex;
+    Output_Chunk *output_head;
+    Output_Chunk *output_tail;
+    size_t output_bytes;
+    bool output_overflow;
+    struct Match_Ticket *match_ticket;
+    std::chrono::steady_clock::time_point last_input;
+    Timer idle_timer;
+    Timer match_timer;
+    Timer call_timer;
+    Pending_Call call;
+    std::atomic<int> timers_fired;
+    int cancel_pending;
+    struct Client_Info *next_free;
 } Client_Info;
 
+enum Ticket_State
+{
+    TICKET_WAITING,
+    TICKET_MATCHING, // claimed by the matchmaker or the coordinator link while it pairs the ticket
+    TICKET_MATCHED,
+    TICKET_CANCELLED,
+    TICKET_PARKED = 0x10 // added to TICKET_MATCHING by a worker that parked the client until the claimer lets go
+};
+
+// On a shard, id names the ticket to the coordinator; the coordinator's own copies have no client
+// and remember which shard the player waits on.
+typedef struct Match_Ticket
+{
+    Client_Info *client;
+    uint32_t id;
+    int shard;
+    int score;
+    uint32_t clock_ms; // time control, 0 for an untimed game; only equal ones are paired
+    uint32_t increment_ms;
+    std::chrono::steady_clock::time_point enqueued;
+    std::atomic<int> state;
+    std::atomic<int> refs;
+    struct Match_Ticket *next;
+} Match_Ticket;
+
+enum Db_Write_Type
+{
+    DB_SET_PASSWORD,
+    DB_UPDATE_SCORE
+};
+
+typedef struct
+{
+    int id;
+    int score;
+} Leaderboard_Entry;
+
+typedef std::pair<int, int> Leaderboard_Key;
+typedef __gnu_pbds::tree<Leaderboard_Key, const std::string *, std::less<Leaderboard_Key>,
+                         __gnu_pbds::rb_tree_tag, __gnu_pbds::tree_order_statistics_node_update,
+                         Pool_Allocator<char>>
+    Leaderboard_Tree;
+
+typedef struct
+{
+    Db_Write_Type type;
+    char username[50];
+    int points;
+    char password[PASSWORD_RECORD_SIZE];
+} Db_Write;
+
+// Users live in memory, split across shards so logins for different names rarely share a lock.
+// SQLite only sees registrations, password upgrades and scores; who is logged in is never persisted.
+typedef struct
+{
+    int id;
+    bool logged_in;
+    char password[PASSWORD_RECORD_SIZE];
+    char session[SESSION_TOKEN_SIZE];
+} User_Entry;
+
+typedef struct alignas(64)
+{
+    std::mutex lock;
+    std::unordered_map<std::string, User_Entry> users;
+} User_Shard;
+
+typedef struct
+{
+    char username[50];
+    std::chrono::steady_clock::time_point expires;
+} Session;
+
+enum Auth_Job_Type
+{
+    AUTH_REGISTER,
+    AUTH_LOGIN,
+    AUTH_UPGRADE
+};
+
+// Password hashing is deliberately slow, so it runs on auth_thread instead of the worker that read the command.
+typedef struct
+{
+    Auth_Job_Type type;
+    Client_Info *client;
+    char username[50];
+    char password[MAX_PASSWORD_LENGTH + 1];
+} Auth_Job;
+
+enum Ai_Job_Type
+{
+    AI_MOVE,
+    AI_HINT
+};
+
+typedef struct
+{
+    Ai_Job_Type type;
+    int game_id;
+} Ai_Job;
+
+// A whole match takes far longer than one move, so analyses get their own thread and never hold up a game.
+typedef struct
+{
+    Client_Info *client; // parked until the analysis is sent, holding a reference
+    uint32_t match_id;
+    uint64_t offset;
+} Analysis_Job;
+
+// "list games" on a sharded server: the coordinator collects one part per shard before answering.
+typedef struct
+{
+    int origin;
+    uint32_t call;
+    uint32_t waiting;
+    uint32_t total;
+    uint32_t listed;
+    std::string lines;
+} List_Gather;
+
 typedef struct
 {
     Client_Info *player1;
     Client_Info *player2;
-    int board[8][8];
+    Board board;
+    char board_text[BOARD_STRING_SIZE];
+    bool board_text_valid;
+    uint32_t seq;
+    uint32_t match_id;
+    char names[2][50];
+    uint8_t moves[MAX_GAME_MOVES];
+    int move_count;
+    bool recovered;
+    bool timed;
+    uint32_t base_ms;
+    uint32_t increment_ms;
+    uint32_t clock_ms[2]; // what each color has left, not counting the turn in progress
+    std::chrono::steady_clock::time_point turn_started;
+    Timer clock_timer;
+    int absent; // color whose player dropped and may still come back until grace_timer fires, 0 if none
+    Timer grace_timer;
+    std::vector<Client_Info *> spectators;
     int turn;
+    int ai_level;
+    bool hint_pending;
+    int generation;
+    bool active;
+    int next_free;
+    std::mutex lock;
 } Game_Info;
 
 sqlite3 *db;
-std::vector<Game_Info> active_games;
-std::queue<Client_Info *> waiting_queue;
-std::mutex waiting_mutex;
+std::mutex db_mutex;
+sqlite3_stmt *register_stmt;
+sqlite3_stmt *set_password_stmt;
+sqlite3_stmt *update_score_stmt;
+sqlite3_stmt *load_users_stmt;
+sqlite3_stmt *begin_stmt;
+sqlite3_stmt *commit_stmt;
+sqlite3_stmt *rollback_stmt;
+std::vector<Db_Write> db_writes;
+std::mutex db_writes_mutex;
+std::condition_variable db_writes_cond;
+Leaderboard_Tree leaderboard;
+std::unordered_map<std::string, Leaderboard_Entry> leaderboard_users;
+char leaderboard_top[LEADERBOARD_TEXT_SIZE];
+bool leaderboard_top_dirty = true;
+std::mutex leaderboard_mutex;
+User_Shard user_shards[USER_SHARDS];
+char dummy_password[PASSWORD_RECORD_SIZE];
+std::unordered_map<std::string, Session> sessions;
+std::mutex sessions_mutex;
+Ring_Queue<Auth_Job> auth_jobs;
+std::mutex auth_mutex;
+std::condition_variable auth_cond;
+std::atomic<Game_Info *> game_chunks[MAX_GAMES / GAME_CHUNK];
+int game_slots_used;
+int free_game_slot = -1;
+std::atomic<Match_Ticket *> match_inbox;
+int game_log_fd = -1;
+std::vector<uint8_t> game_log_pending;
+std::vector<std::pair<uint32_t, uint64_t>> game_log_pending_ends;
+uint64_t game_log_size;
+std::mutex game_log_mutex;
+std::condition_variable game_log_cond;
+std::atomic<uint32_t> next_match_id(1);
+uint32_t match_id_step = 1;
+std::unordered_map<uint32_t, uint64_t> finished_matches;
+std::mutex finished_matches_mutex;
+std::unordered_map<std::string, int> suspended_players;
+std::mutex suspended_mutex;
+Ring_Queue<Ai_Job> ai_jobs;
+std::mutex ai_mutex;
+std::condition_variable ai_cond;
+Ring_Queue<Analysis_Job> analysis_jobs;
+std::mutex analysis_mutex;
+std::condition_variable analysis_cond;
 std::mutex games_mutex;
 
-void send_message_to_client(int socket, char *message)
+int shard_count;
+int shard_index;
+int coordinator_link = -1;
+char game_log_path[32] = GAME_LOG_PATH;
+std::unordered_map<uint32_t, Match_Ticket *> shard_tickets;
+std::mutex shard_tickets_mutex;
+std::atomic<uint32_t> next_ticket_id;
+std::unordered_map<uint32_t, Pending_Call *> pending_calls;
+std::mutex calls_mutex;
+std::condition_variable calls_cond;
+std::atomic<uint32_t> next_call_id;
+
+int shard_links[MAX_SHARDS];
+bool shard_alive[MAX_SHARDS];
+std::unordered_map<std::string, int> online_users;
+std::unordered_map<std::string, std::string> user_tokens;
+std::unordered_map<std::string, int> suspended_homes;
+std::unordered_map<uint64_t, Match_Ticket *> remote_tickets;
+std::unordered_map<uint64_t, List_Gather> list_gathers;
+
+int epoll_fd;
+int wake_fd;
+Ring_Queue<Client_Info *> ready_clients;
+std::mutex ready_mutex;
+std::condition_variable ready_cond;
+std::vector<Client_Info *> closed_clients;
+std::mutex closed_mutex;
+
+thread_local std::vector<Client_Info *> dirty_clients;
+thread_local Output_Chunk *free_chunks;
+thread_local int free_chunk_count;
+thread_local Output_Chunk *free_shared_chunks;
+thread_local int free_shared_chunk_count;
+thread_local Shared_Message *free_shared_messages;
+thread_local int free_shared_message_count;
+Client_Info *free_clients;
+std::mutex free_clients_mutex;
+Timer_Wheel timers;
+std::mutex timers_mutex;
+uint64_t timers_wake_tick = UINT64_MAX; // when the main loop next turns the wheel unless woken
+std::chrono::steady_clock::time_point timers_start;
+Match_Ticket *free_tickets;
+std::mutex free_tickets_mutex;
+
+enum Sql_Statement
+{
+    SQL_REGISTER,
+    SQL_SET_PASSWORD,
+    SQL_UPDATE_SCORE,
+    SQL_BEGIN,
+    SQL_COMMIT,
+    SQL_STATEMENTS
+};
+
+const char *sql_statement_names[SQL_STATEMENTS] = {"register", "set_password", "update_score", "begin", "commit"};
+
+const uint64_t latency_bounds[] = {10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+                                   5000000, 10000000, 25000000, 100000000};
+const uint64_t wait_bounds[] = {100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000,
+                                10000000000, 30000000000, 60000000000, 120000000000};
+
+// Updated with relaxed atomics only, so recording a metric never takes a lock.
+typedef struct
+{
+    Metric_Gauge connections;
+    Metric_Counter connections_total;
+    Metric_Gauge games;
+    Metric_Counter games_total;
+    Metric_Gauge queue_depth;
+    Metric_Histogram queue_wait;
+    Metric_Histogram move_latency;
+    Metric_Histogram auth_latency;
+    Metric_Histogram sql_latency[SQL_STATEMENTS];
+    Metric_Counter bytes_in;
+    Metric_Counter bytes_out;
+    Metric_Counter timeouts[TIMER_KINDS];
+    Metric_Counter tt_probes;
+    Metric_Counter tt_hits;
+} Server_Metrics;
+
+Server_Metrics metrics;
+
+#ifdef COUNT_ALLOCATIONS
+// Built with -DCOUNT_ALLOCATIONS, the server logs every command that reached the global heap.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *memory, size_t size);
+thread_local long heap_allocations;
+
+extern "C" void *malloc(size_t size)
 {
-    send(socket, message, strlen(message), 0);
+    heap_allocations++;
+    return __libc_malloc(size);
 }
 
-void init_database()
+extern "C" void *calloc(size_t count, size_t size)
 {
-    if (sqlite3_open("users.db", &db) != SQLITE_OK)
+    heap_allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *memory, size_t size)
+{
+    heap_allocations++;
+    return __libc_realloc(memory, size);
+}
+#endif
+
+// Chunks of the common size are recycled through a small per-thread free list; oversized ones go back to the heap.
+// Shared messages and the chunks pointing at them have lists of their own, capped the same way: they end up on
+// whichever thread drops the last reference, which is often not one that allocates them.
+Output_Chunk *chunk_alloc(size_t length)
+{
+    Output_Chunk *chunk;
+    if (length <= OUTPUT_CHUNK_SIZE && free_chunks)
     {
-        fprintf(stderr, "Nu am putut deschide baza de date: %s\n", sqlite3_errmsg(db));
-        exit(EXIT_FAILURE);
+        chunk = free_chunks;
+        free_chunks = chunk->next;
+        free_chunk_count--;
+    }
+    else
+    {
+        size_t capacity = std::max<size_t>(length, OUTPUT_CHUNK_SIZE);
+        chunk = (Output_Chunk *)malloc(sizeof(Output_Chunk) + capacity);
+        chunk->capacity = capacity;
     }
+    chunk->next = NULL;
+    chunk->shared = NULL;
+    chunk->length = 0;
+    chunk->offset = 0;
+    return chunk;
+}
 
-    const char *create_table = "CREATE TABLE IF NOT EXISTS users("
-                               "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-                               "username TEXT UNIQUE NOT NULL,"
-                               "password TEXT NOT NULL,"
-                               "logged_in INTEGER DEFAULT 0,"
-                               "score INTEGER DEFAULT 0);";
-    char *err_msg = NULL;
-    if (sqlite3_exec(db, create_table, NULL, NULL, &err_msg) != SQLITE_OK)
+Shared_Message *shared_alloc(const char *header, size_t header_length, const char *data, size_t data_length)
+{
+    size_t length = header_length + data_length;
+    Shared_Message *message;
+    if (length <= SHARED_MESSAGE_SIZE && free_shared_messages)
     {
-        fprintf(stderr, "Eroare la crearea tabelei: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        exit(EXIT_FAILURE);
+        message = free_shared_messages;
+        free_shared_messages = message->next_free;
+        free_shared_message_count--;
+    }
+    else
+    {
+        size_t capacity = std::max<size_t>(length, SHARED_MESSAGE_SIZE);
+        message = (Shared_Message *)malloc(sizeof(Shared_Message) + capacity);
+        new (&message->refs) std::atomic<int>();
+        message->capacity = capacity;
+    }
+    message->refs.store(1, std::memory_order_relaxed);
+    message->length = length;
+    if (header_length)
+        memcpy(message->data, header, header_length);
+    memcpy(message->data + header_length, data, data_length);
+    return message;
+}
+
+void shared_release(Shared_Message *message)
+{
+    if (message->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if (message->capacity != SHARED_MESSAGE_SIZE || free_shared_message_count >= OUTPUT_POOL_LIMIT)
+    {
+        free(message);
+        return;
+    }
+    message->next_free = free_shared_messages;
+    free_shared_messages = message;
+    free_shared_message_count++;
+}
+
+Output_Chunk *chunk_alloc_shared(Shared_Message *message)
+{
+    Output_Chunk *chunk = free_shared_chunks;
+    if (chunk)
+    {
+        free_shared_chunks = chunk->next;
+        free_shared_chunk_count--;
+    }
+    else
+        chunk = (Output_Chunk *)malloc(sizeof(Output_Chunk));
+    message->refs.fetch_add(1, std::memory_order_relaxed);
+    chunk->next = NULL;
+    chunk->shared = message;
+    chunk->capacity = 0;
+    chunk->length = message->length;
+    chunk->offset = 0;
+    return chunk;
+}
+
+char *chunk_data(Output_Chunk *chunk)
+{
+    return chunk->shared ? chunk->shared->data : chunk->data;
+}
+
+void chunk_free(Output_Chunk *chunk)
+{
+    if (chunk->shared)
+    {
+        shared_release(chunk->shared);
+        if (free_shared_chunk_count >= OUTPUT_POOL_LIMIT)
+        {
+            free(chunk);
+            return;
+        }
+        chunk->next = free_shared_chunks;
+        free_shared_chunks = chunk;
+        free_shared_chunk_count++;
+        return;
+    }
+    if (chunk->capacity != OUTPUT_CHUNK_SIZE || free_chunk_count >= OUTPUT_POOL_LIMIT)
+    {
+        free(chunk);
+        return;
+    }
+    chunk->next = free_chunks;
+    free_chunks = chunk;
+    free_chunk_count++;
+}
+
+void flush_client_locked(Client_Info *client_info)
+{
+    while (client_info->output_head)
+    {
+        struct iovec iov[MAX_IOVECS];
+        int count = 0;
+        for (Output_Chunk *chunk = client_info->output_head; chunk && count < MAX_IOVECS; chunk = chunk->next)
+        {
+            iov[count].iov_base = chunk_data(chunk) + chunk->offset;
+            iov[count].iov_len = chunk->length - chunk->offset;
+            count++;
+        }
+
+        ssize_t bytes_sent = writev(client_info->socket, iov, count);
+        if (bytes_sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                shutdown(client_info->socket, SHUT_RDWR);
+            return;
+        }
+
+        client_info->output_bytes -= bytes_sent;
+        metric_add(metrics.bytes_out, bytes_sent);
+        while (bytes_sent > 0)
+        {
+            Output_Chunk *chunk = client_info->output_head;
+            size_t left = chunk->length - chunk->offset;
+            if ((size_t)bytes_sent < left)
+            {
+                chunk->offset += bytes_sent;
+                break;
+            }
+            bytes_sent -= left;
+            client_info->output_head = chunk->next;
+            chunk_free(chunk);
+        }
+        if (!client_info->output_head)
+            client_info->output_tail = NULL;
+    }
+}
+
+void flush_client(Client_Info *client_info)
+{
+    std::lock_guard<std::mutex> lock(client_info->output_mutex);
+    flush_client_locked(client_info);
+}
+
+void free_output(Client_Info *client_info)
+{
+    while (client_info->output_head)
+    {
+        Output_Chunk *chunk = client_info->output_head;
+        client_info->output_head = chunk->next;
+        chunk_free(chunk);
+    }
+    client_info->output_tail = NULL;
+    client_info->output_bytes = 0;
+}
+
+bool reserve_output_locked(Client_Info *client_info, size_t length)
+{
+    if (client_info->output_overflow)
+        return false;
+    if (client_info->output_bytes + length > OUTPUT_LIMIT)
+    {
+        log_warn("slow_client", "Clientul %d nu citeste raspunsurile, il deconectam.", client_info->socket);
+        client_info->output_overflow = true;
+        shutdown(client_info->socket, SHUT_RDWR);
+        return false;
+    }
+    client_info->output_bytes += length;
+    return true;
+}
+
+void append_chunk_locked(Client_Info *client_info, Output_Chunk *chunk)
+{
+    if (client_info->output_tail)
+        client_info->output_tail->next = chunk;
+    else
+        client_info->output_head = chunk;
+    client_info->output_tail = chunk;
+}
+
+void mark_dirty(Client_Info *client_info)
+{
+    for (Client_Info *dirty : dirty_clients)
+    {
+        if (dirty == client_info)
+            return;
+    }
+    client_info->refs.fetch_add(1);
+    dirty_clients.push_back(client_info);
+}
+
+void queue_output(Client_Info *client_info, const char *header, size_t header_length, const char *data, size_t data_length)
+{
+    size_t length = header_length + data_length;
+
+    {
+        std::lock_guard<std::mutex> lock(client_info->output_mutex);
+        if (!reserve_output_locked(client_info, length))
+            return;
+
+        Output_Chunk *chunk = client_info->output_tail;
+        if (!chunk || chunk->shared || chunk->capacity - chunk->length < length)
+        {
+            chunk = chunk_alloc(length);
+            append_chunk_locked(client_info, chunk);
+        }
+        if (header_length)
+            memcpy(chunk->data + chunk->length, header, header_length);
+        memcpy(chunk->data + chunk->length + header_length, data, data_length);
+        chunk->length += length;
+    }
+    mark_dirty(client_info);
+}
+
+void queue_shared(Client_Info *client_info, Shared_Message *message)
+{
+    {
+        std::lock_guard<std::mutex> lock(client_info->output_mutex);
+        if (!reserve_output_locked(client_info, message->length))
+            return;
+        append_chunk_locked(client_info, chunk_alloc_shared(message));
+    }
+    mark_dirty(client_info);
+}
+
+// Binary clients get every text reply wrapped in an OP_MESSAGE frame.
+void send_message_to_client(Client_Info *client_info, const char *message)
+{
+    size_t length = strlen(message);
+    if (length == 0)
+        return;
+
+    if (client_info->binary)
+    {
+        uint8_t header[SERVER_HEADER_SIZE];
+        write_server_header(header, OP_MESSAGE, length);
+        queue_output(client_info, (const char *)header, sizeof(header), message, length);
+    }
+    else
+    {
+        queue_output(client_info, NULL, 0, message, length);
+    }
+}
+
+void client_release(Client_Info *client_info);
+
+// Messages queued by this thread are written once per connection, after the current batch of work.
+void flush_dirty_clients()
+{
+    for (Client_Info *client_info : dirty_clients)
+    {
+        flush_client(client_info);
+        client_release(client_info);
     }
+    dirty_clients.clear();
 }
 
-void register_user(const char *username, const char *password, int socket)
+sqlite3_stmt *prepare_statement(const char *sql)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        fprintf(stderr, "Eroare la statement: %s\n", sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    return stmt;
+}
+
+void finish_statement(sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+int timed_step(sqlite3_stmt *stmt, Sql_Statement statement)
+{
+    auto start = std::chrono::steady_clock::now();
+    int result = sqlite3_step(stmt);
+    metric_observe(metrics.sql_latency[statement], metric_elapsed(start));
+    return result;
+}
+
+void init_database()
+{
+    if (sqlite3_open("users.db", &db) != SQLITE_OK)
+    {
+        fprintf(stderr, "Nu am putut deschide baza de date: %s\n", sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    // Shards share users.db, so a write that finds another process mid-transaction waits instead of failing.
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+
+    const char *create_table = "CREATE TABLE IF NOT EXISTS users("
+                               "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+                               "username TEXT UNIQUE NOT NULL,"
+                               "password TEXT NOT NULL,"
+                               "logged_in INTEGER DEFAULT 0,"
+                               "score INTEGER DEFAULT 0);";
+    char *err_msg = NULL;
+    if (sqlite3_exec(db, create_table, NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        fprintf(stderr, "Eroare la crearea tabelei: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        exit(EXIT_FAILURE);
+    }
+
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;", NULL, NULL, &err_msg) != SQLITE_OK)
+    {
+        log_warn("database", "Nu am putut activa WAL: %s", err_msg);
+        sqlite3_free(err_msg);
+    }
+
+    register_stmt = prepare_statement("INSERT INTO users (username,password) VALUES (?,?);");
+    set_password_stmt = prepare_statement("UPDATE users SET password = ? WHERE username = ?;");
+    update_score_stmt = prepare_statement("UPDATE users SET score = score + ? WHERE username = ?;");
+    load_users_stmt = prepare_statement("SELECT id, username, password, score FROM users;");
+    begin_stmt = prepare_statement("BEGIN;");
+    commit_stmt = prepare_statement("COMMIT;");
+    rollback_stmt = prepare_statement("ROLLBACK;");
+}
+
+// A batch that could not be committed goes back in front of anything queued since, so the writes keep their order.
+void requeue_db_writes(std::vector<Db_Write> &writes)
+{
+    std::lock_guard<std::mutex> lock(db_writes_mutex);
+    db_writes.insert(db_writes.begin(), writes.begin(), writes.end());
+}
+
+// Returns false if the batch was put back to be retried: written outside a transaction, every statement
+// would pay for its own commit.
+bool apply_db_writes_locked()
+{
+    static std::vector<Db_Write> writes;
+    writes.clear();
+    {
+        std::lock_guard<std::mutex> lock(db_writes_mutex);
+        writes.swap(db_writes);
+    }
+    if (writes.empty())
+        return true;
+
+    int result = timed_step(begin_stmt, SQL_BEGIN);
+    finish_statement(begin_stmt);
+    if (result != SQLITE_DONE)
+    {
+        log_warn("database", "Nu am putut incepe tranzactia, reincerc: %s", sqlite3_errmsg(db));
+        requeue_db_writes(writes);
+        return false;
+    }
+
+    for (Db_Write &write : writes)
+    {
+        sqlite3_stmt *stmt;
+        Sql_Statement statement;
+        if (write.type == DB_SET_PASSWORD)
+        {
+            stmt = set_password_stmt;
+            statement = SQL_SET_PASSWORD;
+            sqlite3_bind_text(stmt, 1, write.password, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, write.username, -1, SQLITE_STATIC);
+        }
+        else
+        {
+            stmt = update_score_stmt;
+            statement = SQL_UPDATE_SCORE;
+            sqlite3_bind_int(stmt, 1, write.points);
+            sqlite3_bind_text(stmt, 2, write.username, -1, SQLITE_STATIC);
+        }
+
+        if (timed_step(stmt, statement) != SQLITE_DONE)
+        {
+            log_error("database", "Eroare la actualizarea bazei de date: %s", sqlite3_errmsg(db));
+        }
+        finish_statement(stmt);
+    }
+
+    result = timed_step(commit_stmt, SQL_COMMIT);
+    finish_statement(commit_stmt);
+    if (result != SQLITE_DONE)
+    {
+        log_error("database", "Eroare la commit, reincerc: %s", sqlite3_errmsg(db));
+        // A failed COMMIT may leave the transaction open; nothing in it was written either way.
+        if (!sqlite3_get_autocommit(db))
+        {
+            sqlite3_step(rollback_stmt);
+            finish_statement(rollback_stmt);
+        }
+        requeue_db_writes(writes);
+        return false;
+    }
+    return true;
+}
+
+void queue_db_write(Db_Write_Type type, const char *username, int points, const char *password = "")
+{
+    Db_Write write;
+    write.type = type;
+    strncpy(write.username, username, sizeof(write.username) - 1);
+    write.username[sizeof(write.username) - 1] = 0;
+    write.points = points;
+    snprintf(write.password, sizeof(write.password), "%s", password);
+    {
+        std::lock_guard<std::mutex> lock(db_writes_mutex);
+        db_writes.push_back(write);
+    }
+    db_writes_cond.notify_one();
+}
+
+void db_writer_thread()
+{
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(db_writes_mutex);
+            db_writes_cond.wait(lock, []
+                                { return !db_writes.empty(); });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(DB_FLUSH_INTERVAL_MS));
+
+        std::lock_guard<std::mutex> lock(db_mutex);
+        apply_db_writes_locked();
+    }
+}
+
+// finished_match is set for END records, so the writer can index where each finished match lives in the file.
+void game_log_append(const uint8_t *record, size_t length, uint32_t finished_match)
+{
+    {
+        std::lock_guard<std::mutex> lock(game_log_mutex);
+        if (finished_match)
+            game_log_pending_ends.push_back(std::make_pair(finished_match, game_log_size));
+        game_log_pending.insert(game_log_pending.end(), record, record + length);
+        game_log_size += length;
+    }
+    game_log_cond.notify_one();
+}
+
+// Moves are appended in batches, one write and one fdatasync per flush interval instead of one per move.
+void game_log_writer_thread()
+{
+    std::vector<uint8_t> batch;
+    std::vector<std::pair<uint32_t, uint64_t>> ends;
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(game_log_mutex);
+            game_log_cond.wait(lock, []
+                               { return !game_log_pending.empty(); });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(GAME_LOG_FLUSH_INTERVAL_MS));
+
+        batch.clear();
+        ends.clear();
+        {
+            std::lock_guard<std::mutex> lock(game_log_mutex);
+            batch.swap(game_log_pending);
+            ends.swap(game_log_pending_ends);
+        }
+
+        size_t written = 0;
+        while (written < batch.size())
+        {
+            ssize_t result = write(game_log_fd, batch.data() + written, batch.size() - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result < 0)
+            {
+                log_error("game_log", "Eroare la scrierea jurnalului de jocuri: %s", strerror(errno));
+                break;
+            }
+            written += result;
+        }
+        fdatasync(game_log_fd);
+
+        std::lock_guard<std::mutex> lock(finished_matches_mutex);
+        for (auto &end : ends)
+            finished_matches[end.first] = end.second;
+    }
+}
+
+// Reuses one string per thread so looking a user up by name does not allocate.
+std::unordered_map<std::string, Leaderboard_Entry>::iterator leaderboard_find_locked(const char *username)
+{
+    thread_local std::string key;
+    key.assign(username);
+    return leaderboard_users.find(key);
+}
+
+void leaderboard_set_locked(const char *username, int id, int score)
+{
+    auto found = leaderboard_find_locked(username);
+    if (found == leaderboard_users.end())
+    {
+        found = leaderboard_users.emplace(username, Leaderboard_Entry{id, score}).first;
+    }
+    else
+    {
+        Leaderboard_Key old_key(-found->second.score, found->second.id);
+        if (leaderboard.order_of_key(old_key) < LEADERBOARD_TOP)
+            leaderboard_top_dirty = true;
+        leaderboard.erase(old_key);
+        found->second.score = score;
+    }
+
+    Leaderboard_Key key(-score, found->second.id);
+    leaderboard.insert(std::make_pair(key, &found->first));
+    if (leaderboard.order_of_key(key) < LEADERBOARD_TOP)
+        leaderboard_top_dirty = true;
+}
+
+// Shard side of the coordinator link. Any thread may send: each sendmsg on a SOCK_SEQPACKET socket is one message.
+void notify_name(Shard_Message_Type type, const char *username)
+{
+    if (coordinator_link < 0)
+        return;
+    uint8_t message[64];
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), type);
+    shard_put_text(writer, username);
+    shard_send(coordinator_link, writer);
+}
+
+void begin_call(Shard_Writer &writer, uint8_t *data, size_t size, Shard_Message_Type type)
+{
+    shard_writer_init(writer, data, size, type);
+    shard_put_u32(writer, ++next_call_id);
+}
+
+// Sends a request started with begin_call and blocks until the coordinator answers; the reader is left
+// just after the call id of the reply.
+bool coordinator_call(const Shard_Writer &request, uint8_t *reply, size_t size, Shard_Reader &reader)
+{
+    uint32_t call = read_u32(request.data + 1);
+    Pending_Call pending = {false, reply, size, 0, NULL, NULL};
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex);
+        pending_calls[call] = &pending;
+    }
+
+    bool answered = shard_send(coordinator_link, request);
+    std::unique_lock<std::mutex> lock(calls_mutex);
+    if (answered)
+        answered = calls_cond.wait_for(lock, std::chrono::milliseconds(SHARD_CALL_TIMEOUT_MS), [&]
+                                       { return pending.done; });
+    pending_calls.erase(call);
+    if (!answered)
+    {
+        log_error("shard", "Coordonatorul nu a raspuns la cererea %u.", call);
+        return false;
+    }
+    shard_reader_init(reader, reply, pending.length);
+    shard_get_u32(reader);
+    return true;
+}
+
+void unpark_client(Client_Info *client_info);
+void arm_timer(Timer *timer, Timer_Kind kind, void *owner, int id, std::chrono::steady_clock::time_point deadline);
+void cancel_timer(Timer *timer);
+
+// Whichever thread takes a parked call out of pending_calls answers it and hands the client on.
+void answer_parked_call(Pending_Call *pending, Shard_Reader *reader)
+{
+    Client_Info *client_info = pending->client;
+    cancel_timer(&client_info->call_timer);
+    pending->handler(client_info, reader);
+    unpark_client(client_info);
+}
+
+void expire_call(Client_Info *client_info, uint32_t call)
+{
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex);
+        auto found = pending_calls.find(call);
+        if (found == pending_calls.end() || found->second != &client_info->call)
+            return;
+        pending_calls.erase(found);
+    }
+    log_error("shard", "Coordonatorul nu a raspuns la cererea %u.", call);
+    metric_add(metrics.timeouts[TIMER_CALL]);
+    answer_parked_call(&client_info->call, NULL);
+}
+
+// Like coordinator_call, for a command run by a worker: the client is parked instead of the worker blocked.
+// handler runs on the link thread with the reply, or on the main thread with NULL after SHARD_CALL_TIMEOUT_MS.
+void coordinator_call_parked(Client_Info *client_info, const Shard_Writer &request, Call_Handler handler)
+{
+    uint32_t call = read_u32(request.data + 1);
+    client_info->call.client = client_info;
+    client_info->call.handler = handler;
+    client_info->refs.fetch_add(1);
+    client_info->parked = PARK_JOB;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex);
+        pending_calls[call] = &client_info->call;
+    }
+    arm_timer(&client_info->call_timer, TIMER_CALL, client_info, call,
+              std::chrono::steady_clock::now() + std::chrono::milliseconds(SHARD_CALL_TIMEOUT_MS));
+    if (!shard_send(coordinator_link, request))
+        expire_call(client_info, call);
+}
+
+void deliver_reply(const uint8_t *message, size_t length)
+{
+    Shard_Reader reader;
+    shard_reader_init(reader, message, length);
+    uint32_t call = shard_get_u32(reader);
+    Pending_Call *pending;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex);
+        auto found = pending_calls.find(call);
+        if (reader.error || found == pending_calls.end())
+            return;
+        pending = found->second;
+        if (pending->handler)
+        {
+            pending_calls.erase(found);
+        }
+        else
+        {
+            // The waiter owns pending and may return as soon as done is set, so it is not touched after that.
+            if (length > pending->size)
+                return;
+            memcpy(pending->reply, message, length);
+            pending->length = length;
+            pending->done = true;
+            pending = NULL;
+        }
+    }
+    if (pending)
+        answer_parked_call(pending, &reader);
+    else
+        calls_cond.notify_all();
+}
+
+// The worker handling the client moves it to target once the current command returns (see hand_off_client).
+void request_handoff(Client_Info *client_info, int target, Adopt_Action action, uint32_t arg, const char *command)
+{
+    client_info->handoff_action = action;
+    client_info->handoff_arg = arg;
+    snprintf(client_info->handoff_command, sizeof(client_info->handoff_command), "%s", command);
+    client_info->handoff_target.store(target, std::memory_order_release);
+}
+
+User_Shard &user_shard(const char *username)
+{
+    uint32_t hash = 2166136261u;
+    for (; *username; username++)
+        hash = (hash ^ (uint8_t)*username) * 16777619u;
+    return user_shards[hash % USER_SHARDS];
+}
+
+std::unordered_map<std::string, User_Entry>::iterator user_find_locked(User_Shard &shard, const char *username)
+{
+    thread_local std::string key;
+    key.assign(username);
+    return shard.users.find(key);
+}
+
+void user_add_locked(User_Shard &shard, const char *username, int id, const char *password)
+{
+    User_Entry &user = shard.users[username];
+    user.id = id;
+    user.logged_in = false;
+    snprintf(user.password, sizeof(user.password), "%s", password);
+    user.session[0] = 0;
+}
+
+bool queue_auth_job(Auth_Job_Type type, Client_Info *client_info, const char *username, const char *password)
+{
+    {
+        std::lock_guard<std::mutex> lock(auth_mutex);
+        if (client_info && auth_jobs.count >= AUTH_QUEUE_LIMIT)
+            return false;
+        Auth_Job job;
+        job.type = type;
+        job.client = client_info;
+        snprintf(job.username, sizeof(job.username), "%s", username);
+        snprintf(job.password, sizeof(job.password), "%s", password);
+        ring_push(auth_jobs, job);
+    }
+    auth_cond.notify_one();
+    return true;
+}
+
+// Loads every account into memory; plaintext passwords left by older servers are rehashed in the background.
+void load_users()
+{
+    if (!hash_password("", dummy_password))
+    {
+        fprintf(stderr, "Nu am putut genera sare pentru parole.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int plaintext = 0;
+    std::lock_guard<std::mutex> lock(leaderboard_mutex);
+    while (sqlite3_step(load_users_stmt) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(load_users_stmt, 0);
+        const char *username = (const char *)sqlite3_column_text(load_users_stmt, 1);
+        const char *password = (const char *)sqlite3_column_text(load_users_stmt, 2);
+        int score = sqlite3_column_int(load_users_stmt, 3);
+        leaderboard_set_locked(username, id, score);
+
+        User_Shard &shard = user_shard(username);
+        std::lock_guard<std::mutex> shard_lock(shard.lock);
+        user_add_locked(shard, username, id, password);
+        if (!is_password_hash(password) && shard_index == 0)
+        {
+            queue_auth_job(AUTH_UPGRADE, NULL, username, "");
+            plaintext++;
+        }
+    }
+    finish_statement(load_users_stmt);
+    if (plaintext)
+        log_info("auth", "%d parole in clar vor fi inlocuite cu hash-uri.", plaintext);
+}
+
+void leaderboard_add_points(const char *username, int points)
+{
+    std::lock_guard<std::mutex> lock(leaderboard_mutex);
+    auto found = leaderboard_find_locked(username);
+    if (found != leaderboard_users.end())
+        leaderboard_set_locked(username, found->second.id, found->second.score + points);
+}
+
+const char *leaderboard_top_locked()
+{
+    if (leaderboard_top_dirty)
+    {
+        size_t length = snprintf(leaderboard_top, LEADERBOARD_TEXT_SIZE, "Top 10 Players:\n");
+        int rank = 1;
+        for (auto it = leaderboard.begin(); it != leaderboard.end() && rank <= LEADERBOARD_TOP && length < LEADERBOARD_TEXT_SIZE; ++it, rank++)
+        {
+            length += snprintf(leaderboard_top + length, LEADERBOARD_TEXT_SIZE - length, "%d. %s: %d points\n",
+                               rank, it->second->c_str(), -it->first.first);
+        }
+        leaderboard_top_dirty = false;
+    }
+    return leaderboard_top;
+}
+
+void register_user(Client_Info *client_info, const char *username, const char *password)
+{
+    char response[BUFFER_SIZE];
+    char record[PASSWORD_RECORD_SIZE];
+    if (!hash_password(password, record))
+    {
+        send_message_to_client(client_info, "Inregistrare esuata, incearca din nou.\n");
+        return;
+    }
+
+    int result, id = 0;
+    {
+        std::lock_guard<std::mutex> lock(db_mutex);
+        sqlite3_bind_text(register_stmt, 1, username, -1, SQLITE_STATIC);
+        sqlite3_bind_text(register_stmt, 2, record, -1, SQLITE_STATIC);
+        result = timed_step(register_stmt, SQL_REGISTER);
+        finish_statement(register_stmt);
+        if (result == SQLITE_DONE)
+        {
+            id = (int)sqlite3_last_insert_rowid(db);
+            {
+                std::lock_guard<std::mutex> leaderboard_lock(leaderboard_mutex);
+                leaderboard_set_locked(username, id, 0);
+            }
+            User_Shard &shard = user_shard(username);
+            std::lock_guard<std::mutex> shard_lock(shard.lock);
+            user_add_locked(shard, username, id, record);
+        }
+    }
+
+    if (result == SQLITE_DONE && coordinator_link >= 0)
+    {
+        // The other shards loaded users.db before this account existed.
+        uint8_t message[256];
+        Shard_Writer writer;
+        shard_writer_init(writer, message, sizeof(message), SHARD_USER);
+        shard_put_u32(writer, id);
+        shard_put_text(writer, username);
+        shard_put_text(writer, record);
+        shard_send(coordinator_link, writer);
+    }
+
+    if (result == SQLITE_DONE)
+    {
+        snprintf(response, BUFFER_SIZE, "Inregistrare reusita pentru utilizatorul %s.\n", username);
+        send_message_to_client(client_info, response);
+    }
+    else
+    {
+        snprintf(response, BUFFER_SIZE, "Utilizatorul %s deja exista.\n", username);
+        send_message_to_client(client_info, response);
+    }
+}
+
+void upgrade_password(const char *username)
+{
+    char plaintext[PASSWORD_RECORD_SIZE], record[PASSWORD_RECORD_SIZE];
+    User_Shard &shard = user_shard(username);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        memcpy(plaintext, user_find_locked(shard, username)->second.password, PASSWORD_RECORD_SIZE);
+    }
+    if (is_password_hash(plaintext) || !hash_password(plaintext, record))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        memcpy(user_find_locked(shard, username)->second.password, record, PASSWORD_RECORD_SIZE);
+    }
+    queue_db_write(DB_SET_PASSWORD, username, 0, record);
+    explicit_bzero(plaintext, sizeof(plaintext));
+}
+
+void logout_user(const char *username)
+{
+    if (coordinator_link >= 0)
+    {
+        notify_name(SHARD_LOGOUT, username);
+        return;
+    }
+
+    User_Shard &shard = user_shard(username);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto found = user_find_locked(shard, username);
+    if (found != shard.users.end())
+        found->second.logged_in = false;
+}
+
+void update_score(const char *username, int points)
+{
+    leaderboard_add_points(username, points);
+    queue_db_write(DB_UPDATE_SCORE, username, points);
+    if (coordinator_link >= 0)
+    {
+        uint8_t message[64];
+        Shard_Writer writer;
+        shard_writer_init(writer, message, sizeof(message), SHARD_SCORE);
+        shard_put_u32(writer, points);
+        shard_put_text(writer, username);
+        shard_send(coordinator_link, writer);
+    }
+}
+
+void scoreboard(Client_Info *client_info)
+{
+    char response[LEADERBOARD_TEXT_SIZE + 64]; // a full top 10 plus the rank line
+    std::lock_guard<std::mutex> lock(leaderboard_mutex);
+    const char *top = leaderboard_top_locked();
+
+    auto found = client_info->logged_in ? leaderboard_find_locked(client_info->username) : leaderboard_users.end();
+    if (found == leaderboard_users.end())
+    {
+        send_message_to_client(client_info, top);
+        return;
+    }
+
+    size_t rank = leaderboard.order_of_key(Leaderboard_Key(-found->second.score, found->second.id)) + 1;
+    snprintf(response, sizeof(response), "%sLocul tau: %zu din %zu (%d points)\n",
+             top, rank, leaderboard.size(), found->second.score);
+    send_message_to_client(client_info, response);
+}
+
+static const int ai_square_weights[64] = {
+    100, -20, 10, 5, 5, 10, -20, 100,
+    -20, -50, -2, -2, -2, -2, -50, -20,
+    10, -2, -1, -1, -1, -1, -2, 10,
+    5, -2, -1, -1, -1, -1, -2, 5,
+    5, -2, -1, -1, -1, -1, -2, 5,
+    10, -2, -1, -1, -1, -1, -2, 10,
+    -20, -50, -2, -2, -2, -2, -50, -20,
+    100, -20, 10, 5, 5, 10, -20, 100};
+
+static const int ai_depths[AI_MAX_LEVEL + 1] = {0, 1, 2, 4, 6, 8};
+static const int ai_budgets_ms[AI_MAX_LEVEL + 1] = {0, 20, 50, 150, 400, 1000};
+
+enum Tt_Bound
+{
+    TT_EXACT,
+    TT_LOWER,
+    TT_UPPER
+};
+
+typedef struct
+{
+    int32_t score;
+    int8_t depth;
+    int8_t bound;
+    int8_t best_square;
+} Tt_Entry;
+
+// One table for every search in the process, so AI moves, hints and analyses reuse each other's work whichever
+// game reached the position. A slot is written without a lock as check = key ^ data: when two threads race on
+// it, the torn pair fails the check and reads as a miss.
+typedef struct
+{
+    std::atomic<uint64_t> check;
+    std::atomic<uint64_t> data;
+} Tt_Slot;
+
+Tt_Slot ai_table[1 << AI_TT_BITS];
+
+typedef struct
+{
+    std::chrono::steady_clock::time_point deadline;
+    long nodes;
+    long probes;
+    long hits;
+    bool timed_out;
+} Ai_Search;
+
+bool tt_probe(uint64_t key, Tt_Entry &entry)
+{
+    Tt_Slot &slot = ai_table[key & ((1 << AI_TT_BITS) - 1)];
+    uint64_t data = slot.data.load(std::memory_order_relaxed);
+    if ((slot.check.load(std::memory_order_relaxed) ^ data) != key)
+        return false;
+    entry.score = (int32_t)(uint32_t)data;
+    entry.depth = (int8_t)(data >> 32);
+    entry.bound = (int8_t)(data >> 40);
+    entry.best_square = (int8_t)(data >> 48);
+    return true;
+}
+
+// Replaces whatever is in the slot, except a deeper result for the same position.
+void tt_store(uint64_t key, const Tt_Entry &entry)
+{
+    Tt_Entry stored;
+    if (tt_probe(key, stored) && stored.depth > entry.depth)
+        return;
+    uint64_t data = (uint32_t)entry.score | (uint64_t)(uint8_t)entry.depth << 32 | (uint64_t)(uint8_t)entry.bound << 40 |
+                    (uint64_t)(uint8_t)entry.best_square << 48;
+    Tt_Slot &slot = ai_table[key & ((1 << AI_TT_BITS) - 1)];
+    slot.check.store(key ^ data, std::memory_order_relaxed);
+    slot.data.store(data, std::memory_order_relaxed);
+}
+
+void ai_search_start(Ai_Search &search, int budget_ms)
+{
+    search.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget_ms);
+    search.nodes = 0;
+    search.probes = 0;
+    search.hits = 0;
+    search.timed_out = false;
+}
+
+void ai_search_finish(const Ai_Search &search)
+{
+    metric_add(metrics.tt_probes, search.probes);
+    metric_add(metrics.tt_hits, search.hits);
+}
+
+int ai_evaluate(const Board &board, int player)
+{
+    int score = 0;
+    for (uint64_t own = board.discs[player - 1]; own; own &= own - 1)
+        score += ai_square_weights[__builtin_ctzll(own)];
+    for (uint64_t opp = board.discs[2 - player]; opp; opp &= opp - 1)
+        score -= ai_square_weights[__builtin_ctzll(opp)];
+
+    int mobility = __builtin_popcountll(get_valid_moves(board, player)) - __builtin_popcountll(get_valid_moves(board, 3 - player));
+    return score + 5 * mobility;
+}
+
+int ai_order_moves(uint64_t moves, int tt_square, int *squares)
+{
+    int count = 0;
+    for (; moves; moves &= moves - 1)
+    {
+        int square = __builtin_ctzll(moves);
+        int key = (square == tt_square) ? 1000 : ai_square_weights[square];
+        int i = count++;
+        while (i > 0 && ((squares[i - 1] == tt_square) ? 1000 : ai_square_weights[squares[i - 1]]) < key)
+        {
+            squares[i] = squares[i - 1];
+            i--;
+        }
+        squares[i] = square;
+    }
+    return count;
+}
+
+int ai_search(Ai_Search *search, const Board &board, int player, int depth, int alpha, int beta, bool passed)
+{
+    if ((++search->nodes & 1023) == 0 && std::chrono::steady_clock::now() > search->deadline)
+        search->timed_out = true;
+    if (search->timed_out)
+        return 0;
+
+    uint64_t moves = get_valid_moves(board, player);
+    if (!moves)
+    {
+        if (passed)
+            return 10000 * (count_discs(board, player) - count_discs(board, 3 - player));
+        return -ai_search(search, board, 3 - player, depth, -beta, -alpha, true);
+    }
+    if (depth == 0)
+        return ai_evaluate(board, player);
+
+    uint64_t key = position_key(board, player);
+    Tt_Entry entry;
+    int tt_square = -1;
+    search->probes++;
+    if (tt_probe(key, entry))
+    {
+        search->hits++;
+        tt_square = entry.best_square;
+        if (entry.depth >= depth &&
+            (entry.bound == TT_EXACT || (entry.bound == TT_LOWER && entry.score >= beta) || (entry.bound == TT_UPPER && entry.score <= alpha)))
+            return entry.score;
+    }
+
+    int squares[64];
+    int count = ai_order_moves(moves, tt_square, squares);
+    int original_alpha = alpha;
+    int best_score = -1000000, best_square = squares[0];
+    for (int i = 0; i < count; i++)
+    {
+        Board child = board;
+        make_move(child, squares[i] / 8, squares[i] % 8, player);
+        int score = -ai_search(search, child, 3 - player, depth - 1, -beta, -alpha, false);
+        if (search->timed_out)
+            return 0;
+        if (score > best_score)
+        {
+            best_score = score;
+            best_square = squares[i];
+        }
+        if (score > alpha)
+            alpha = score;
+        if (alpha >= beta)
+            break;
+    }
+
+    entry.score = best_score;
+    entry.depth = depth;
+    entry.bound = best_score <= original_alpha ? TT_UPPER : (best_score >= beta ? TT_LOWER : TT_EXACT);
+    entry.best_square = best_square;
+    tt_store(key, entry);
+    return best_score;
+}
+
+int ai_choose_move(const Board &board, int player, int level)
+{
+    Ai_Search search;
+    ai_search_start(search, ai_budgets_ms[level]);
+
+    int squares[64];
+    int count = ai_order_moves(get_valid_moves(board, player), -1, squares);
+    int best_square = squares[0];
+
+    for (int depth = 1; depth <= ai_depths[level]; depth++)
+    {
+        int alpha = -1000000, depth_best = -1;
+        for (int i = 0; i < count; i++)
+        {
+            Board child = board;
+            make_move(child, squares[i] / 8, squares[i] % 8, player);
+            int score = -ai_search(&search, child, 3 - player, depth - 1, -1000000, -alpha, false);
+            if (search.timed_out)
+                break;
+            if (score > alpha)
+            {
+                alpha = score;
+                depth_best = i;
+            }
+        }
+        if (search.timed_out || depth_best < 0)
+            break;
+
+        best_square = squares[depth_best];
+        std::rotate(squares, squares + depth_best, squares + depth_best + 1);
+    }
+    ai_search_finish(search);
+    return best_square;
+}
+
+typedef struct
+{
+    int best_square;
+    int best_score;
+    int played_score;
+} Move_Review;
+
+// Scores the move that was played against the best one, deepening until ANALYSIS_DEPTH or the budget runs out.
+// The played move gets a full window so its score is exact; the others only have to beat it.
+bool review_move(const Board &board, int player, int played, Move_Review &review)
+{
+    Ai_Search search;
+    ai_search_start(search, ANALYSIS_BUDGET_MS);
+
+    int squares[64];
+    int count = ai_order_moves(get_valid_moves(board, player), -1, squares);
+    bool reviewed = false;
+    for (int depth = 1; depth <= ANALYSIS_DEPTH; depth++)
+    {
+        Board child = board;
+        make_move(child, played / 8, played % 8, player);
+        int played_score = -ai_search(&search, child, 3 - player, depth - 1, -1000000, 1000000, false);
+        int best_score = played_score, best_square = played;
+        for (int i = 0; i < count && !search.timed_out; i++)
+        {
+            if (squares[i] == played)
+                continue;
+            child = board;
+            make_move(child, squares[i] / 8, squares[i] % 8, player);
+            int score = -ai_search(&search, child, 3 - player, depth - 1, -1000000, -best_score, false);
+            if (score > best_score)
+            {
+                best_score = score;
+                best_square = squares[i];
+            }
+        }
+        if (search.timed_out)
+            break;
+
+        review.best_square = best_square;
+        review.best_score = best_score;
+        review.played_score = played_score;
+        reviewed = true;
+    }
+    ai_search_finish(search);
+    return reviewed;
+}
+
+// One wheel for every deadline in the server: game clocks, idle connections and matchmaking.
+// timers_mutex only ever guards list splicing, so it is never held while taking another lock.
+void arm_timer(Timer *timer, Timer_Kind kind, void *owner, int id, std::chrono::steady_clock::time_point deadline)
+{
+    long ms = std::max(0L, (long)std::chrono::ceil<std::chrono::milliseconds>(deadline - timers_start).count());
+    bool earlier;
+    {
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        timer->kind = kind;
+        timer->owner = owner;
+        timer->id = id;
+        // Rounded up, so a timer never fires before its deadline.
+        timer_add(timers, timer, (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+        earlier = timer->expires < timers_wake_tick;
+        if (earlier)
+            timers_wake_tick = timer->expires;
+    }
+    // The main loop sleeps until the next tick it knows has work, or without a timeout while the wheel is empty.
+    if (earlier)
+    {
+        uint64_t wake = 1;
+        write(wake_fd, &wake, sizeof(wake));
+    }
+}
+
+void cancel_timer(Timer *timer)
+{
+    std::lock_guard<std::mutex> lock(timers_mutex);
+    timer_cancel(timers, timer);
+}
+
+uint64_t current_tick()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timers_start).count() / TIMER_TICK_MS;
+}
+
+// How long epoll_wait may sleep before the wheel has to turn again: until the nearest tick with work, not the
+// next tick, so a server whose only timers are far-off idle checks does not wake every TIMER_TICK_MS.
+int timer_timeout()
+{
+    uint64_t next_tick;
+    {
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        next_tick = timer_next_tick(timers);
+        timers_wake_tick = next_tick;
+    }
+    if (next_tick == UINT64_MAX)
+        return -1;
+    long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timers_start).count();
+    return (int)std::min((long)INT_MAX, std::max(0L, (long)(next_tick * TIMER_TICK_MS) - elapsed));
+}
+
+Game_Info *game_slot(int slot)
+{
+    Game_Info *chunk = game_chunks[slot / GAME_CHUNK].load(std::memory_order_acquire);
+    return chunk ? &chunk[slot % GAME_CHUNK] : NULL;
+}
+
+Game_Info *allocate_game(int *game_id, std::unique_lock<std::mutex> &game_lock)
+{
+    int slot;
+    {
+        std::lock_guard<std::mutex> lock(games_mutex);
+        slot = free_game_slot;
+        if (slot != -1)
+        {
+            free_game_slot = game_slot(slot)->next_free;
+        }
+        else
+        {
+            if (game_slots_used == MAX_GAMES)
+                return NULL;
+            slot = game_slots_used++;
+            if (slot % GAME_CHUNK == 0)
+                game_chunks[slot / GAME_CHUNK].store(new Game_Info[GAME_CHUNK](), std::memory_order_release);
+        }
+    }
+
+    Game_Info *game = game_slot(slot);
+    game_lock = std::unique_lock<std::mutex>(game->lock);
+    game->active = true;
+    metric_add(metrics.games, 1);
+    metric_add(metrics.games_total);
+    *game_id = (game->generation << GAME_SLOT_BITS) | slot;
+    return game;
+}
+
+// Every field of a game slot is guarded by its own lock, so moves in different games never contend.
+Game_Info *lock_game(int game_id, std::unique_lock<std::mutex> &game_lock)
+{
+    if (game_id < 0)
+        return NULL;
+
+    Game_Info *game = game_slot(game_id & (MAX_GAMES - 1));
+    if (!game)
+        return NULL;
+
+    game_lock = std::unique_lock<std::mutex>(game->lock);
+    if (!game->active || game->generation != (game_id >> GAME_SLOT_BITS))
+    {
+        game_lock.unlock();
+        return NULL;
+    }
+    return game;
+}
+
+void release_game_locked(Game_Info *game, int game_id)
+{
+    metric_add(metrics.games, -1);
+    game->active = false;
+    game->generation = (game->generation + 1) & (MAX_GAMES / 2 - 1);
+    game->player1 = NULL;
+    game->player2 = NULL;
+
+    std::lock_guard<std::mutex> lock(games_mutex);
+    game->next_free = free_game_slot;
+    free_game_slot = game_id & (MAX_GAMES - 1);
+}
+
+const char *player_name(Game_Info &game, int player)
+{
+    return game.names[player - 1];
+}
+
+// Rendered once per position and reused by every snapshot until the next move.
+const char *game_board_text(Game_Info &game)
+{
+    if (!game.board_text_valid)
+    {
+        render_board(game.board, game.board_text);
+        game.board_text_valid = true;
+    }
+    return game.board_text;
+}
+
+// Full board, only at game start and on "sync"; everything else is sent as deltas.
+// Binary clients render the start of the game themselves, so they only get the frame.
+void send_board_update(Client_Info *client_info, Game_Info &game, Board_Event event, const char *text)
+{
+    if (client_info->binary)
+    {
+        Board_Update update;
+        update.event = event;
+        update.color = (client_info == game.player1) ? 1 : (client_info == game.player2) ? 2 : 0;
+        update.turn = game.turn;
+        update.last_square = NO_SQUARE;
+        update.seq = game.seq;
+        update.board = game.board;
+        uint8_t frame[BOARD_FRAME_SIZE];
+        encode_board_frame(frame, update);
+        queue_output(client_info, NULL, 0, (const char *)frame, sizeof(frame));
+        return;
+    }
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "%sSync %u: Muta %s\n%s", text, game.seq, player_name(game, game.turn), game_board_text(game));
+    send_message_to_client(client_info, response);
+}
+
+// Spectators share one encoded copy of each update, so a watched move costs one render however many watch it.
+// frame is what binary spectators get; without one they get text in an OP_MESSAGE frame.
+void send_to_spectators(Game_Info &game, const char *text, const uint8_t *frame, size_t frame_length)
+{
+    if (game.spectators.empty())
+        return;
+
+    size_t text_length = strlen(text);
+    Shared_Message *text_message = NULL, *binary_message = NULL;
+    for (Client_Info *spectator : game.spectators)
+    {
+        bool binary = spectator->binary;
+        Shared_Message *&message = binary ? binary_message : text_message;
+        if (!message)
+        {
+            if (!binary)
+            {
+                message = shared_alloc(NULL, 0, text, text_length);
+            }
+            else if (frame)
+            {
+                message = shared_alloc(NULL, 0, (const char *)frame, frame_length);
+            }
+            else
+            {
+                uint8_t header[SERVER_HEADER_SIZE];
+                write_server_header(header, OP_MESSAGE, text_length);
+                message = shared_alloc((const char *)header, sizeof(header), text, text_length);
+            }
+        }
+        queue_shared(spectator, message);
+    }
+    if (text_message)
+        shared_release(text_message);
+    if (binary_message)
+        shared_release(binary_message);
+}
+
+void send_to_players(Game_Info &game, const char *message)
+{
+    if (game.player1)
+        send_message_to_client(game.player1, message);
+    if (game.player2)
+        send_message_to_client(game.player2, message);
+    send_to_spectators(game, message, NULL, 0);
+}
+
+void send_delta_to_players(Game_Info &game, Board_Event event, int player, int square, uint64_t flips, const char *text)
+{
+    Delta_Update update;
+    update.event = event;
+    update.player = player;
+    update.square = square;
+    update.turn = (event == EVENT_GAME_OVER) ? 0 : game.turn;
+    update.seq = game.seq;
+    update.flips = flips;
+    uint8_t frame[DELTA_FRAME_SIZE];
+    encode_delta_frame(frame, update);
+
+    char response[BUFFER_SIZE];
+    size_t length = snprintf(response, BUFFER_SIZE - DELTA_LINE_SIZE, "%s", text);
+    format_delta_line(response + length, game.seq, player, square, flips);
+
+    Client_Info *players[2] = {game.player1, game.player2};
+    for (Client_Info *player_info : players)
+    {
+        if (!player_info)
+            continue;
+        if (player_info->binary)
+            queue_output(player_info, NULL, 0, (const char *)frame, sizeof(frame));
+        else
+            send_message_to_client(player_info, response);
+    }
+
+    if (game.spectators.empty())
+        return;
+    if (event == EVENT_MOVE)
+    {
+        length = snprintf(response, BUFFER_SIZE - DELTA_LINE_SIZE, "%s a mutat %d %d. Muta %s\n",
+                          player_name(game, player), square / 8, square % 8, player_name(game, game.turn));
+        format_delta_line(response + length, game.seq, player, square, flips);
+    }
+    send_to_spectators(game, response, frame, sizeof(frame));
+}
+
+void award_points(Game_Info &game, int black_points, int white_points)
+{
+    if (game.ai_level)
+        return;
+    update_score(game.names[0], black_points);
+    update_score(game.names[1], white_points);
+}
+
+// loser is the color that surrendered or disconnected, 0 for a game played to the end.
+void end_game_locked(Game_Info &game, int game_id, Game_End_Reason reason, int loser)
+{
+    uint8_t record[MAX_GAME_RECORD_SIZE];
+    size_t length = encode_end_record(record, game.match_id, reason, loser, game.ai_level, game.names[0], game.names[1], game.moves, game.move_count);
+    game_log_append(record, length, game.match_id);
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "Meciul %u a fost salvat. Il poti revedea cu: replay %u\n", game.match_id, game.match_id);
+    send_to_players(game, response);
+    if (game.timed)
+        cancel_timer(&game.clock_timer);
+    if (game.absent)
+        cancel_timer(&game.grace_timer);
+
+    if (game.recovered || game.absent)
+    {
+        std::lock_guard<std::mutex> lock(suspended_mutex);
+        for (int i = 0; i < 2; i++)
+        {
+            auto found = suspended_players.find(game.names[i]);
+            if (found != suspended_players.end() && found->second == game_id)
+            {
+                suspended_players.erase(found);
+                notify_name(SHARD_UNSUSPENDED, game.names[i]);
+            }
+        }
+    }
+
+    Client_Info *players[2] = {game.player1, game.player2};
+    for (Client_Info *player : players)
+    {
+        if (!player)
+            continue;
+        player->status = FREE;
+        player->game_id = -1;
+    }
+    for (Client_Info *spectator : game.spectators)
+        spectator->watching = -1;
+    game.spectators.clear();
+    game.absent = 0;
+    release_game_locked(&game, game_id);
+}
+
+void schedule_ai_job(Ai_Job_Type type, int game_id)
+{
+    Ai_Job job;
+    job.type = type;
+    job.game_id = game_id;
+    {
+        std::lock_guard<std::mutex> lock(ai_mutex);
+        ring_push(ai_jobs, job);
+    }
+    ai_cond.notify_one();
+}
+
+// "Ceas: Negru 2:58.4, Alb 3:00.0", with the time the player to move has used so far already taken off.
+size_t format_clocks(Game_Info &game, char *out, size_t size)
+{
+    long left[2] = {game.clock_ms[0], game.clock_ms[1]};
+    left[game.turn - 1] -= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - game.turn_started).count();
+    for (long &ms : left)
+        ms = std::max(0L, ms) / 100;
+    return snprintf(out, size, "Ceas: Negru %ld:%02ld.%ld, Alb %ld:%02ld.%ld\n", left[0] / 600, left[0] / 10 % 60, left[0] % 10,
+                    left[1] / 600, left[1] / 10 % 60, left[1] % 10);
+}
+
+// The clock of the player to move runs from here; its timer is where their flag falls.
+void start_clock(Game_Info &game, int game_id)
+{
+    game.turn_started = std::chrono::steady_clock::now();
+    arm_timer(&game.clock_timer, TIMER_CLOCK, &game, game_id, game.turn_started + std::chrono::milliseconds(game.clock_ms[game.turn - 1]));
+}
+
+void lose_on_time(Game_Info &game, int game_id)
+{
+    char response[BUFFER_SIZE];
+    int loser = game.turn;
+    game.clock_ms[loser - 1] = 0;
+    metric_add(metrics.timeouts[TIMER_CLOCK]);
+    snprintf(response, BUFFER_SIZE, "%s a ramas fara timp!\n", player_name(game, loser));
+    send_to_players(game, response);
+    if (loser == 1)
+        award_points(game, 1, 3);
+    else
+        award_points(game, 3, 1);
+    end_game_locked(game, game_id, END_TIMEOUT, loser);
+}
+
+// Charges the player to move for their turn and adds the increment; false if their time had already run out.
+bool charge_clock(Game_Info &game, int game_id)
+{
+    uint32_t &clock = game.clock_ms[game.turn - 1];
+    long used = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - game.turn_started).count();
+    if (used >= (long)clock)
+    {
+        lose_on_time(game, game_id);
+        return false;
+    }
+    clock = clock - used + game.increment_ms;
+    return true;
+}
+
+// Runs on the main thread. A move may have restarted the clock after the timer fired, so the deadline is checked again.
+void clock_expired(int game_id)
+{
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game || !game->timed)
+        return;
+    auto deadline = game->turn_started + std::chrono::milliseconds(game->clock_ms[game->turn - 1]);
+    if (std::chrono::steady_clock::now() < deadline)
+        arm_timer(&game->clock_timer, TIMER_CLOCK, game, game_id, deadline);
+    else
+        lose_on_time(*game, game_id);
+}
+
+// Keeps the seat of a player whose connection dropped: resume (or login) puts them back through resume_game,
+// the same way as after a restart. The clock of a timed game keeps running meanwhile.
+void suspend_player(Game_Info &game, int game_id, int color)
+{
+    char response[BUFFER_SIZE];
+    game.absent = color;
+    {
+        std::lock_guard<std::mutex> lock(suspended_mutex);
+        suspended_players[game.names[color - 1]] = game_id;
+    }
+    notify_name(SHARD_SUSPENDED, game.names[color - 1]);
+    arm_timer(&game.grace_timer, TIMER_GRACE, &game, game_id, std::chrono::steady_clock::now() + RECONNECT_GRACE);
+
+    snprintf(response, BUFFER_SIZE, "%s s-a deconectat. Are %ld secunde sa revina, altfel pierde meciul.\n", player_name(game, color),
+             (long)std::chrono::duration_cast<std::chrono::seconds>(RECONNECT_GRACE).count());
+    send_to_players(game, response);
+}
+
+// Runs on the main thread. A player who came back in time has already cleared absent.
+void grace_expired(int game_id)
+{
+    char response[BUFFER_SIZE];
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game || !game->absent)
+        return;
+
+    int loser = game->absent;
+    metric_add(metrics.timeouts[TIMER_GRACE]);
+    snprintf(response, BUFFER_SIZE, "%s nu a revenit la timp si a abandonat jocul!\n", player_name(*game, loser));
+    send_to_players(*game, response);
+    if (loser == 1)
+        award_points(*game, 1, 3);
+    else
+        award_points(*game, 3, 1);
+    end_game_locked(*game, game_id, END_DISCONNECT, loser);
+}
+
+void play_move(Game_Info &game, int game_id, int row, int col, const char *announcement)
+{
+    char response[BUFFER_SIZE];
+
+    if (game.timed && !charge_clock(game, game_id))
+        return;
+
+    int player = game.turn;
+    uint64_t flips = make_move(game.board, row, col, player);
+    game.board_text_valid = false;
+    game.seq++;
+
+    uint8_t record[MAX_GAME_RECORD_SIZE];
+    game.moves[game.move_count++] = row * 8 + col;
+    game_log_append(record, encode_move_record(record, game.match_id, row * 8 + col, player), 0);
+
+    game.turn = (game.turn == 1) ? 2 : 1;
+
+    if (!has_valid_moves(game.board, game.turn))
+    {
+        game.turn = (game.turn == 1) ? 2 : 1;
+        if (!has_valid_moves(game.board, game.turn))
+        {
+            int black_count = count_discs(game.board, 1);
+            int white_count = count_discs(game.board, 2);
+
+            if (black_count > white_count)
+                award_points(game, 3, 1);
+            else if (white_count > black_count)
+                award_points(game, 1, 3);
+            else
+                award_points(game, 2, 2);
+
+            snprintf(response, BUFFER_SIZE, "Game Over!\nNegru: %d\nAlb: %d\n", black_count, white_count);
+            send_delta_to_players(game, EVENT_GAME_OVER, player, row * 8 + col, flips, response);
+            end_game_locked(game, game_id, END_FINISHED, 0);
+            return;
+        }
+    }
+
+    size_t length = snprintf(response, BUFFER_SIZE, "%s Muta %s\n", announcement, player_name(game, game.turn));
+    if (game.timed)
+    {
+        start_clock(game, game_id);
+        format_clocks(game, response + length, BUFFER_SIZE - length);
+    }
+    send_delta_to_players(game, EVENT_MOVE, player, row * 8 + col, flips, response);
+
+    if (game.ai_level && game.turn == 2)
+        schedule_ai_job(AI_MOVE, game_id);
+}
+
+void handle_move(Client_Info *client_info, char *move_str)
+{
+    char response[BUFFER_SIZE];
+
+    int game_id = client_info->game_id;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *found = lock_game(game_id, game_lock);
+    if (!found)
+    {
+        snprintf(response, BUFFER_SIZE, "Nu esti intr-un joc activ!\n");
+        send_message_to_client(client_info, response);
+        return;
+    }
+    Game_Info &game = *found;
+
+    bool is_player1 = (game.player1 == client_info);
+    if ((is_player1 && game.turn != 1) || (!is_player1 && game.turn != 2))
+    {
+        snprintf(response, BUFFER_SIZE, "Nu este randul tau!\n");
+        send_message_to_client(client_info, response);
+        return;
+    }
+
+    int row, col;
+    if (sscanf(move_str, "%d %d", &row, &col) != 2 ||
+        row < 0 || row >= 8 || col < 0 || col >= 8)
+    {
+        snprintf(response, BUFFER_SIZE, "Format invalid! move <linie> <coloana>\n");
+        send_message_to_client(client_info, response);
+        return;
+    }
+
+    if (!is_valid_move(game.board, row, col, game.turn))
+    {
+        snprintf(response, BUFFER_SIZE, "Miscare invalida!Mai incearca.\n");
+        send_message_to_client(client_info, response);
+        return;
+    }
+
+    play_move(game, game_id, row, col, "Mutare corecta!");
+}
+
+// Spectators resync the game they watch, the same way players recover from a gap in the deltas.
+void handle_sync(Client_Info *client_info)
+{
+    int game_id = (client_info->status == IN_GAME) ? client_info->game_id.load() : client_info->watching.load();
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game)
+    {
+        send_message_to_client(client_info, "Nu esti intr-un joc activ!\n");
+        return;
+    }
+    char clocks[64] = "";
+    if (game->timed)
+        format_clocks(*game, clocks, sizeof(clocks));
+    send_board_update(client_info, *game, EVENT_SNAPSHOT, clocks);
+}
+
+void ai_move(int game_id)
+{
+    Board board;
+    int level;
+    {
+        std::unique_lock<std::mutex> game_lock;
+        Game_Info *game = lock_game(game_id, game_lock);
+        if (!game || game->turn != 2)
+            return;
+        board = game->board;
+        level = game->ai_level;
+    }
+
+    int square = ai_choose_move(board, 2, level);
+
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game || game->turn != 2 || game->board.discs[0] != board.discs[0] || game->board.discs[1] != board.discs[1])
+        return;
+
+    char announcement[64];
+    snprintf(announcement, sizeof(announcement), "%s a mutat %d %d.", AI_NAME, square / 8, square % 8);
+    play_move(*game, game_id, square / 8, square % 8, announcement);
+}
+
+// The move the AI would play at AI_HINT_LEVEL, for the player to move, who asked for it.
+void ai_hint(int game_id)
+{
+    Board board;
+    int player;
+    {
+        std::unique_lock<std::mutex> game_lock;
+        Game_Info *game = lock_game(game_id, game_lock);
+        if (!game)
+            return;
+        board = game->board;
+        player = game->turn;
+    }
+
+    int square = ai_choose_move(board, player, AI_HINT_LEVEL);
+
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game)
+        return;
+    game->hint_pending = false;
+    if (game->turn != player || game->board.discs[0] != board.discs[0] || game->board.discs[1] != board.discs[1])
+        return;
+
+    // The player may have disconnected while the search ran, leaving the game suspended.
+    Client_Info *client_info = player == 1 ? game->player1 : game->player2;
+    if (!client_info)
+        return;
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "Sugestie: muta %d %d\n", square / 8, square % 8);
+    send_message_to_client(client_info, response);
+}
+
+void ai_thread()
+{
+    while (1)
+    {
+        Ai_Job job;
+        {
+            std::unique_lock<std::mutex> lock(ai_mutex);
+            ai_cond.wait(lock, []
+                         { return ai_jobs.count != 0; });
+            job = ring_pop(ai_jobs);
+        }
+
+        if (job.type == AI_MOVE)
+            ai_move(job.game_id);
+        else
+            ai_hint(job.game_id);
+        flush_dirty_clients();
+    }
+}
+
+bool stop_watching(Client_Info *client_info)
+{
+    int game_id = client_info->watching.exchange(-1);
+    if (game_id < 0)
+        return false;
+
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (game)
+    {
+        auto found = std::find(game->spectators.begin(), game->spectators.end(), client_info);
+        if (found != game->spectators.end())
+        {
+            *found = game->spectators.back();
+            game->spectators.pop_back();
+        }
+    }
+    return true;
+}
+
+// Walks the game slots; used by the rare "watch" and "list games", so no index is kept on the move path.
+template <typename Visit>
+void for_each_game(Visit visit)
+{
+    int slots;
+    {
+        std::lock_guard<std::mutex> lock(games_mutex);
+        slots = game_slots_used;
+    }
+    for (int slot = 0; slot < slots; slot++)
+    {
+        Game_Info *game = game_slot(slot);
+        std::unique_lock<std::mutex> game_lock(game->lock);
+        if (game->active && !visit(*game, (game->generation << GAME_SLOT_BITS) | slot))
+            return;
+    }
+}
+
+void create_new_game(Client_Info *player1, Client_Info *player2, int ai_level = 0, uint32_t clock_ms = 0, uint32_t increment_ms = 0)
+{
+    char response[BUFFER_SIZE];
+    int game_id;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *new_game = allocate_game(&game_id, game_lock);
+    if (!new_game)
+    {
+        snprintf(response, BUFFER_SIZE, "Serverul nu mai poate gazdui jocuri noi, incercati mai tarziu!\n");
+        player1->status = FREE;
+        send_message_to_client(player1, response);
+        if (player2)
+        {
+            player2->status = FREE;
+            send_message_to_client(player2, response);
+        }
+        return;
+    }
+
+    new_game->player1 = player1;
+    new_game->player2 = player2;
+    new_game->ai_level = ai_level;
+    new_game->hint_pending = false;
+    init_board(new_game->board);
+    new_game->board_text_valid = false;
+    new_game->seq = 0;
+    new_game->turn = 1;
+    new_game->match_id = next_match_id.fetch_add(match_id_step);
+    snprintf(new_game->names[0], sizeof(new_game->names[0]), "%s", player1->username);
+    snprintf(new_game->names[1], sizeof(new_game->names[1]), "%s", player2 ? player2->username : AI_NAME);
+    new_game->move_count = 0;
+    new_game->recovered = false;
+    new_game->absent = 0;
+    new_game->timed = clock_ms != 0;
+    new_game->base_ms = clock_ms;
+    new_game->increment_ms = increment_ms;
+    new_game->clock_ms[0] = clock_ms;
+    new_game->clock_ms[1] = clock_ms;
+
+    uint8_t record[MAX_GAME_RECORD_SIZE];
+    game_log_append(record, encode_start_record(record, new_game->match_id, ai_level, new_game->names[0], new_game->names[1]), 0);
+
+    player1->game_id = game_id;
+    player1->status = IN_GAME;
+    if (player2)
+    {
+        player2->game_id = game_id;
+        player2->status = IN_GAME;
+    }
+
+    if (ai_level)
+    {
+        snprintf(response, BUFFER_SIZE, "Jocul a inceput! Joci contra calculatorului (nivel %d). Tu esti cu piesele negre(black)(B).\n", ai_level);
+        send_board_update(player1, *new_game, EVENT_START, response);
+        log_info("game_created", "%s (Black) vs %s nivel %d (White)", player1->username, AI_NAME, ai_level);
+        return;
+    }
+
+    if (!new_game->timed)
+    {
+        send_board_update(player1, *new_game, EVENT_START, "Jocul a inceput! Tu esti cu piesele negre(black)(B).\n");
+        send_board_update(player2, *new_game, EVENT_START, "Jocul a inceput! Tu esti cu piesele albe(white)(W).\n");
+        log_info("game_created", "%s (Black) vs %s (White)", player1->username, player2->username);
+        return;
+    }
+
+    start_clock(*new_game, game_id);
+    for (Client_Info *player : {player1, player2})
+    {
+        size_t length = snprintf(response, BUFFER_SIZE, "Jocul a inceput! Tu esti cu piesele %s. Blitz %u+%u: ",
+                                 player == player1 ? "negre(black)(B)" : "albe(white)(W)", clock_ms / 60000, increment_ms / 1000);
+        format_clocks(*new_game, response + length, BUFFER_SIZE - length);
+        send_board_update(player, *new_game, EVENT_START, response);
+    }
+    log_info("game_created", "%s (Black) vs %s (White), blitz %u+%u", player1->username, player2->username, clock_ms / 60000, increment_ms / 1000);
+}
+
+typedef struct
+{
+    int ai_level;
+    char names[2][MAX_LOG_NAME + 1];
+    Board board;
+    int turn;
+    uint8_t moves[MAX_GAME_MOVES];
+    int move_count;
+} Recovered_Game;
+
+void restore_game(uint32_t match_id, Recovered_Game &recovered)
+{
+    int game_id;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = allocate_game(&game_id, game_lock);
+    if (!game)
+    {
+        log_error("game_recovery", "Nu mai este loc pentru meciul %u.", match_id);
+        return;
+    }
+
+    game->player1 = NULL;
+    game->player2 = NULL;
+    game->ai_level = recovered.ai_level;
+    game->hint_pending = false;
+    game->board = recovered.board;
+    game->board_text_valid = false;
+    game->seq = recovered.move_count;
+    game->turn = recovered.turn;
+    game->match_id = match_id;
+    memcpy(game->names, recovered.names, sizeof(recovered.names));
+    memcpy(game->moves, recovered.moves, recovered.move_count);
+    game->move_count = recovered.move_count;
+    game->recovered = true;
+    game->absent = 0;
+    game->timed = false; // the log does not keep clocks, so a recovered game goes on without one
+
+    if (!has_valid_moves(game->board, 1) && !has_valid_moves(game->board, 2))
+    {
+        end_game_locked(*game, game_id, END_FINISHED, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(suspended_mutex);
+        suspended_players[game->names[0]] = game_id;
+        if (!game->ai_level)
+            suspended_players[game->names[1]] = game_id;
+    }
+    notify_name(SHARD_SUSPENDED, game->names[0]);
+    if (!game->ai_level)
+        notify_name(SHARD_SUSPENDED, game->names[1]);
+    if (game->ai_level && game->turn == 2)
+        schedule_ai_job(AI_MOVE, game_id);
+    log_info("game_recovered", "Meciul %u: %s vs %s, %d mutari", match_id, game->names[0], game->names[1], game->move_count);
+}
+
+// Replays games.log at startup: finished matches are indexed for "replay", unfinished ones are rebuilt
+// and wait for their players to log in again. A torn record at the end of the file is cut off.
+void recover_games()
+{
+    game_log_fd = open(game_log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat info;
+    if (game_log_fd < 0 || fstat(game_log_fd, &info) < 0)
+    {
+        perror("Nu am putut deschide jurnalul de jocuri");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = info.st_size;
+    if (size == 0)
+    {
+        if (write(game_log_fd, GAME_LOG_MAGIC, GAME_LOG_HEADER_SIZE) != GAME_LOG_HEADER_SIZE)
+        {
+            perror("Nu am putut initializa jurnalul de jocuri");
+            exit(EXIT_FAILURE);
+        }
+        game_log_size = GAME_LOG_HEADER_SIZE;
+        return;
+    }
+
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, game_log_fd, 0);
+    if (data == MAP_FAILED || size < GAME_LOG_HEADER_SIZE || memcmp(data, GAME_LOG_MAGIC, GAME_LOG_HEADER_SIZE) != 0)
+    {
+        fprintf(stderr, "%s nu este un jurnal de jocuri valid.\n", game_log_path);
+        exit(EXIT_FAILURE);
+    }
+
+    std::unordered_map<uint32_t, Recovered_Game> games;
+    uint32_t last_match_id = 0;
+    size_t offset = GAME_LOG_HEADER_SIZE;
+    while (offset < size)
+    {
+        Game_Record record;
+        size_t length = decode_game_record(data + offset, size - offset, record);
+        if (!length)
+            break;
+        last_match_id = std::max(last_match_id, record.match_id);
+
+        if (record.type == RECORD_START)
+        {
+            Recovered_Game &game = games[record.match_id];
+            game.ai_level = record.ai_level;
+            memcpy(game.names, record.names, sizeof(record.names));
+            init_board(game.board);
+            game.turn = 1;
+            game.move_count = 0;
+        }
+        else if (record.type == RECORD_MOVE)
+        {
+            auto found = games.find(record.match_id);
+            if (found != games.end())
+            {
+                Recovered_Game &game = found->second;
+                if (game.move_count < MAX_GAME_MOVES && record.player == game.turn && replay_move(game.board, &game.turn, record.square))
+                    game.moves[game.move_count++] = record.square;
+                else
+                    log_warn("game_recovery", "Mutare invalida in jurnal pentru meciul %u.", record.match_id);
+            }
+        }
+        else
+        {
+            games.erase(record.match_id);
+            finished_matches[record.match_id] = offset;
+        }
+        offset += length;
+    }
+    munmap((void *)data, size);
+
+    if (offset < size)
+    {
+        log_warn("game_recovery", "Am ignorat %zu octeti incompleti de la sfarsitul jurnalului.", size - offset);
+        if (ftruncate(game_log_fd, offset) < 0)
+            log_error("game_recovery", "Nu am putut trunchia jurnalul: %s", strerror(errno));
+    }
+    game_log_size = offset;
+    // Each shard hands out the ids congruent to its index, so any shard can tell who owns a match.
+    uint32_t match_id = last_match_id + 1;
+    while ((match_id - 1) % match_id_step != (uint32_t)shard_index)
+        match_id++;
+    next_match_id = match_id;
+
+    for (auto &entry : games)
+        restore_game(entry.first, entry.second);
+}
+
+// Called after a successful login: puts the player back into a game that was interrupted by a restart or by
+// their own connection dropping.
+void resume_game(Client_Info *client_info)
+{
+    int game_id;
+    {
+        std::lock_guard<std::mutex> lock(suspended_mutex);
+        auto found = suspended_players.find(client_info->username);
+        if (found == suspended_players.end())
+            return;
+        game_id = found->second;
+        suspended_players.erase(found);
+    }
+    notify_name(SHARD_UNSUSPENDED, client_info->username);
+
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game)
+        return;
+
+    char response[BUFFER_SIZE];
+    bool black = strcmp(game->names[0], client_info->username) == 0;
+    if (black)
+        game->player1 = client_info;
+    else
+        game->player2 = client_info;
+    client_info->game_id = game_id;
+    client_info->status = IN_GAME;
+
+    if (game->absent == (black ? 1 : 2))
+    {
+        game->absent = 0;
+        cancel_timer(&game->grace_timer);
+        Client_Info *opponent = black ? game->player2 : game->player1;
+        if (opponent)
+        {
+            snprintf(response, BUFFER_SIZE, "%s a revenit in joc.\n", client_info->username);
+            send_message_to_client(opponent, response);
+        }
+    }
+
+    size_t length = snprintf(response, BUFFER_SIZE, "Jocul tau a fost reluat! Tu esti cu piesele %s.\n",
+                             black ? "negre(black)(B)" : "albe(white)(W)");
+    if (game->timed)
+        format_clocks(*game, response + length, BUFFER_SIZE - length);
+    send_board_update(client_info, *game, EVENT_SNAPSHOT, response);
+}
+
+// Maps only the pages that hold the record instead of the whole log.
+bool read_game_record(uint64_t offset, Game_Record &record)
+{
+    struct stat info;
+    if (fstat(game_log_fd, &info) < 0 || offset >= (uint64_t)info.st_size)
+        return false;
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+    size_t length = std::min<uint64_t>(info.st_size - start, offset - start + MAX_GAME_RECORD_SIZE);
+    void *mapped = mmap(NULL, length, PROT_READ, MAP_SHARED, game_log_fd, start);
+    if (mapped == MAP_FAILED)
+        return false;
+    size_t decoded = decode_game_record((const uint8_t *)mapped + (offset - start), length - (offset - start), record);
+    munmap(mapped, length);
+    return decoded != 0;
+}
+
+// A session token lets a client that lost its connection log back in with "resume" instead of the password.
+void open_session(Client_Info *client_info)
+{
+    char token[SESSION_TOKEN_SIZE], old_token[SESSION_TOKEN_SIZE];
+    if (!new_session_token(token))
+        return;
+
+    if (coordinator_link >= 0)
+    {
+        // Sessions live on the coordinator, so the token works whichever shard the client reconnects to.
+        uint8_t message[128];
+        Shard_Writer writer;
+        shard_writer_init(writer, message, sizeof(message), SHARD_OPEN_SESSION);
+        shard_put_text(writer, client_info->username);
+        shard_put_text(writer, token);
+        shard_send(coordinator_link, writer);
+    }
+    else
+    {
+        User_Shard &shard = user_shard(client_info->username);
+        {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            User_Entry &user = user_find_locked(shard, client_info->username)->second;
+            memcpy(old_token, user.session, SESSION_TOKEN_SIZE);
+            memcpy(user.session, token, SESSION_TOKEN_SIZE);
+        }
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        if (old_token[0])
+            sessions.erase(old_token);
+        Session &session = sessions[token];
+        snprintf(session.username, sizeof(session.username), "%s", client_info->username);
+        session.expires = std::chrono::steady_clock::now() + SESSION_TTL;
+    }
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "Token de sesiune: %s (reconectare cu: resume %s)\n", token, token);
+    send_message_to_client(client_info, response);
+}
+
+void close_session(const char *username)
+{
+    if (coordinator_link >= 0)
+    {
+        notify_name(SHARD_CLOSE_SESSION, username);
+        return;
+    }
+
+    char token[SESSION_TOKEN_SIZE];
+    User_Shard &shard = user_shard(username);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto found = user_find_locked(shard, username);
+        if (found == shard.users.end() || !found->second.session[0])
+            return;
+        memcpy(token, found->second.session, SESSION_TOKEN_SIZE);
+        found->second.session[0] = 0;
+    }
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    sessions.erase(token);
+}
+
+// Claims the account for this connection; fails if another connection already holds it.
+bool mark_logged_in(const char *username)
+{
+    User_Shard &shard = user_shard(username);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto found = user_find_locked(shard, username);
+    if (found == shard.users.end() || found->second.logged_in)
+        return false;
+    found->second.logged_in = true;
+    return true;
+}
+
+// On a sharded server the coordinator decides who is online. home is the shard holding the player's
+// recovered game, or -1.
+bool claim_login(const char *username, int *home)
+{
+    *home = -1;
+    if (coordinator_link < 0)
+        return mark_logged_in(username);
+
+    uint8_t request[128], reply[128];
+    Shard_Writer writer;
+    begin_call(writer, request, sizeof(request), SHARD_CALL_LOGIN);
+    shard_put_text(writer, username);
+    Shard_Reader reader;
+    if (!coordinator_call(writer, reply, sizeof(reply), reader) || shard_get_u8(reader) != SHARD_OK)
+        return false;
+    int shard = shard_get_u8(reader);
+    *home = shard != NO_SHARD ? shard : -1;
+    return true;
+}
+
+// Looks the token up and claims its account; username is filled in unless the result is SHARD_INVALID.
+// On a sharded server the coordinator does this instead, see command_resume.
+Shard_Reply_Status check_session(const char *token, char *username)
+{
+    bool valid = false;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto found = sessions.find(token);
+        auto now = std::chrono::steady_clock::now();
+        if (found != sessions.end() && found->second.expires > now)
+        {
+            memcpy(username, found->second.username, sizeof(found->second.username));
+            found->second.expires = now + SESSION_TTL;
+            valid = true;
+        }
+        else if (found != sessions.end())
+        {
+            sessions.erase(found);
+        }
+    }
+    if (!valid)
+        return SHARD_INVALID;
+    return mark_logged_in(username) ? SHARD_OK : SHARD_BUSY;
+}
+
+void finish_login(Client_Info *client_info, const char *username, int home)
+{
+    client_info->logged_in = 1;
+    strncpy(client_info->username, username, sizeof(client_info->username));
+    send_message_to_client(client_info, "Login reusit!\n");
+    if (home >= 0 && home != shard_index)
+        request_handoff(client_info, home, ADOPT_RESUME, 0, "");
+    else
+        resume_game(client_info);
+}
+
+void login_user(Client_Info *client_info, const char *username, const char *password)
+{
+    char record[PASSWORD_RECORD_SIZE];
+    bool known;
+    User_Shard &shard = user_shard(username);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto found = user_find_locked(shard, username);
+        known = found != shard.users.end();
+        memcpy(record, known ? found->second.password : dummy_password, PASSWORD_RECORD_SIZE);
+    }
+
+    // Unknown names are checked against a dummy hash, so the reply takes just as long as for a real account.
+    if (!verify_password(password, record) || !known)
+    {
+        log_info("login_rejected", "Credentiale invalide pentru %s.", username);
+        send_message_to_client(client_info, "Login esuat!Verificati credentialele!\n");
+        return;
+    }
+    int home;
+    if (!claim_login(username, &home))
+    {
+        log_info("login_rejected", "Utilizatorul %s este deja logat.", username);
+        send_message_to_client(client_info, "Esti deja conectat!\n");
+        return;
+    }
+    finish_login(client_info, username, home);
+    open_session(client_info);
+}
+
+// The client stops running commands until its job finishes, so nothing it sends next sees a half-done login.
+void start_auth(Client_Info *client_info, Auth_Job_Type type, const char *username, const char *password)
+{
+    client_info->refs.fetch_add(1);
+    client_info->parked = PARK_JOB;
+    if (!queue_auth_job(type, client_info, username, password))
+    {
+        client_info->parked = PARK_NONE;
+        client_info->refs.fetch_sub(1);
+        send_message_to_client(client_info, "Serverul este ocupat, incearca din nou.\n");
+    }
+}
+
+// Called by the job when it is done. If the worker has already left, the reference taken when the client was
+// parked now belongs to the ready queue.
+void unpark_client(Client_Info *client_info)
+{
+    flush_dirty_clients();
+    int state = PARK_JOB;
+    if (client_info->parked.compare_exchange_strong(state, PARK_DONE))
+    {
+        client_release(client_info);
+        return;
+    }
+    client_info->parked = PARK_NONE;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        ring_push(ready_clients, client_info);
+    }
+    ready_cond.notify_one();
+}
+
+void auth_thread()
+{
+    // Hashing yields the CPU to the workers and game threads whenever they have something to do.
+    setpriority(PRIO_PROCESS, gettid(), AUTH_NICE);
+    while (1)
+    {
+        Auth_Job job;
+        {
+            std::unique_lock<std::mutex> lock(auth_mutex);
+            auth_cond.wait(lock, []
+                           { return auth_jobs.count != 0; });
+            job = ring_pop(auth_jobs);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (job.type == AUTH_REGISTER)
+            register_user(job.client, job.username, job.password);
+        else if (job.type == AUTH_LOGIN)
+            login_user(job.client, job.username, job.password);
+        else
+            upgrade_password(job.username);
+        metric_observe(metrics.auth_latency, metric_elapsed(start));
+        explicit_bzero(job.password, sizeof(job.password));
+
+        if (job.client)
+            unpark_client(job.client);
+    }
+}
+
+int leaderboard_score(const char *username)
+{
+    std::lock_guard<std::mutex> lock(leaderboard_mutex);
+    auto found = leaderboard_find_locked(username);
+    return found != leaderboard_users.end() ? found->second.score : 0;
+}
+
+Match_Ticket *ticket_alloc()
+{
+    {
+        std::lock_guard<std::mutex> lock(free_tickets_mutex);
+        if (free_tickets)
+        {
+            Match_Ticket *ticket = free_tickets;
+            free_tickets = ticket->next;
+            return ticket;
+        }
+    }
+    return new Match_Ticket();
+}
+
+void release_ticket(Match_Ticket *ticket)
+{
+    if (ticket->refs.fetch_sub(1) != 1)
+        return;
+
+    std::lock_guard<std::mutex> lock(free_tickets_mutex);
+    ticket->next = free_tickets;
+    free_tickets = ticket;
+}
+
+void queue_ticket(Match_Ticket *ticket)
+{
+    ticket->next = match_inbox.load(std::memory_order_relaxed);
+    while (!match_inbox.compare_exchange_weak(ticket->next, ticket, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+// On a shard, waiting tickets sit in shard_tickets (which holds one reference) and the coordinator matches them.
+void send_ticket(Match_Ticket *ticket)
+{
+    uint8_t message[32];
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), SHARD_QUEUE);
+    shard_put_u32(writer, ticket->id);
+    shard_put_u32(writer, ticket->score);
+    shard_put_u32(writer, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - ticket->enqueued).count());
+    shard_put_u32(writer, ticket->clock_ms);
+    shard_put_u32(writer, ticket->increment_ms);
+    shard_send(coordinator_link, writer);
+}
+
+void forget_shard_ticket(Match_Ticket *ticket)
+{
+    {
+        std::lock_guard<std::mutex> lock(shard_tickets_mutex);
+        auto found = shard_tickets.find(ticket->id);
+        if (found == shard_tickets.end() || found->second != ticket)
+            return;
+        shard_tickets.erase(found);
+    }
+
+    uint8_t message[8];
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), SHARD_CANCEL);
+    shard_put_u32(writer, ticket->id);
+    shard_send(coordinator_link, writer);
+    release_ticket(ticket);
+}
+
+// O(1): the matchmaker drops cancelled tickets the next time it drains the lobby. A ticket being paired is
+// left to its claimer: the client is parked with the reason, and handle_client ends the search again once
+// settle_ticket has put the ticket back or started the game. Returns false when nothing was cancelled now.
+bool cancel_matchmaking(Client_Info *client_info, int reason)
+{
+    Match_Ticket *ticket = client_info->match_ticket;
+    if (!ticket)
+        return false;
+
+    int state = ticket->state.load();
+    while (1)
+    {
+        if (state == TICKET_WAITING)
+        {
+            if (ticket->state.compare_exchange_weak(state, TICKET_CANCELLED))
+                break;
+            continue;
+        }
+        if (state == (TICKET_MATCHING | TICKET_PARKED))
+        {
+            client_info->cancel_pending = reason;
+            return false;
+        }
+        if (state != TICKET_MATCHING)
+        {
+            // Matched: either a game has started here or the client is about to move to its opponent's shard.
+            client_info->match_ticket = NULL;
+            release_ticket(ticket);
+            return false;
+        }
+
+        client_info->refs.fetch_add(1);
+        client_info->parked = PARK_JOB;
+        if (ticket->state.compare_exchange_strong(state, TICKET_MATCHING | TICKET_PARKED))
+        {
+            client_info->cancel_pending = reason;
+            return false;
+        }
+        client_info->parked = PARK_NONE;
+        client_info->refs.fetch_sub(1);
+    }
+
+    client_info->match_ticket = NULL;
+    if (coordinator_link >= 0)
+        forget_shard_ticket(ticket);
+    release_ticket(ticket);
+    return true;
+}
+
+// clock_ms 0 looks for an untimed game. The search gives up after MATCH_DEADLINE, see handle_timers.
+void handle_play(Client_Info *client_info, uint32_t clock_ms = 0, uint32_t increment_ms = 0)
+{
+    char response[BUFFER_SIZE];
+
+    if (client_info->match_ticket)
+    {
+        release_ticket(client_info->match_ticket);
+        client_info->match_ticket = NULL;
+    }
+
+    Match_Ticket *ticket = ticket_alloc();
+    ticket->client = client_info;
+    ticket->score = leaderboard_score(client_info->username);
+    ticket->clock_ms = clock_ms;
+    ticket->increment_ms = increment_ms;
+    ticket->enqueued = std::chrono::steady_clock::now();
+    ticket->state = TICKET_WAITING;
+    ticket->refs = 2;
+    client_info->match_ticket = ticket;
+    client_info->status = WAITING_FOR_PLAYER;
+    arm_timer(&client_info->match_timer, TIMER_MATCH_DEADLINE, client_info, 0, ticket->enqueued + MATCH_DEADLINE);
+    if (coordinator_link >= 0)
+    {
+        ticket->id = ++next_ticket_id;
+        {
+            std::lock_guard<std::mutex> lock(shard_tickets_mutex);
+            shard_tickets[ticket->id] = ticket;
+        }
+        send_ticket(ticket);
+    }
+    else
+    {
+        queue_ticket(ticket);
+    }
+
+    if (clock_ms)
+        snprintf(response, BUFFER_SIZE, "Asteptati un adversar! Blitz %u+%u.\n", clock_ms / 60000, increment_ms / 1000);
+    else
+        snprintf(response, BUFFER_SIZE, "Asteptati un adversar!\n");
+    send_message_to_client(client_info, response);
+}
+
+bool claim_ticket(Match_Ticket *ticket)
+{
+    int expected = TICKET_WAITING;
+    return ticket->state.compare_exchange_strong(expected, TICKET_MATCHING);
+}
+
+// Lets go of a claimed ticket, putting it back (TICKET_WAITING) or marking it paired once the game has started
+// or the move is requested, and wakes a client parked on it meanwhile.
+void settle_ticket(Match_Ticket *ticket, int state)
+{
+    if (ticket->state.exchange(state) & TICKET_PARKED)
+        unpark_client(ticket->client);
+}
+
+int match_window(Match_Ticket *ticket, std::chrono::steady_clock::time_point now)
+{
+    long waited = std::chrono::duration_cast<std::chrono::seconds>(now - ticket->enqueued).count();
+    return MATCH_BASE_WINDOW + MATCH_WINDOW_PER_SECOND * (int)waited;
+}
+
+bool coordinator_send(int shard, const Shard_Writer &writer, int pass_fd = -1);
+
+// The coordinator's tickets stand for players waiting on a shard; the pair is started there, moving the
+// younger ticket's client over when the two wait on different shards.
+void pair_remote_tickets(Match_Ticket *first, Match_Ticket *second)
+{
+    uint8_t message[16];
+    Shard_Writer writer;
+    if (first->shard == second->shard)
+    {
+        shard_writer_init(writer, message, sizeof(message), SHARD_MATCH);
+        shard_put_u32(writer, first->id);
+        shard_put_u32(writer, second->id);
+    }
+    else
+    {
+        shard_writer_init(writer, message, sizeof(message), SHARD_MIGRATE);
+        shard_put_u32(writer, second->id);
+        shard_put_u8(writer, first->shard);
+        shard_put_u32(writer, first->id);
+    }
+    coordinator_send(second->shard, writer);
+
+    for (Match_Ticket *ticket : {first, second})
+    {
+        remote_tickets.erase((uint64_t)ticket->shard << 32 | ticket->id);
+        release_ticket(ticket);
+    }
+}
+
+void start_match(Match_Ticket *first, Match_Ticket *second)
+{
+    if (first->client)
+        create_new_game(first->client, second->client, 0, first->clock_ms, first->increment_ms);
+    else
+        pair_remote_tickets(first, second);
+}
+
+bool same_time_control(Match_Ticket *a, Match_Ticket *b)
+{
+    return a->clock_ms == b->clock_ms && a->increment_ms == b->increment_ms;
+}
+
+// One matchmaking round: neighbours in score order are paired once their windows overlap.
+// Sorting by time control first keeps every control in its own run, so neighbours always agree on it.
+void match_lobby(std::vector<Match_Ticket *> &lobby, std::vector<Match_Ticket *> &unmatched)
+{
+    for (Match_Ticket *ticket = match_inbox.exchange(NULL, std::memory_order_acquire); ticket;)
+    {
+        Match_Ticket *next = ticket->next;
+        lobby.push_back(ticket);
+        ticket = next;
+    }
+
+    std::sort(lobby.begin(), lobby.end(), [](Match_Ticket *a, Match_Ticket *b)
+              {
+                  if (!same_time_control(a, b))
+                      return a->clock_ms != b->clock_ms ? a->clock_ms < b->clock_ms : a->increment_ms < b->increment_ms;
+                  return a->score != b->score ? a->score < b->score : a->enqueued < b->enqueued; });
+
+    auto now = std::chrono::steady_clock::now();
+    unmatched.clear();
+    for (size_t i = 0; i < lobby.size(); i++)
+    {
+        Match_Ticket *first = lobby[i];
+        if (first->state != TICKET_WAITING)
+        {
+            release_ticket(first);
+            continue;
+        }
+
+        size_t j = i + 1;
+        while (j < lobby.size() && lobby[j]->state != TICKET_WAITING)
+        {
+            release_ticket(lobby[j]);
+            lobby[j] = NULL;
+            j++;
+        }
+        if (j == lobby.size())
+        {
+            unmatched.push_back(first);
+            i = j - 1;
+            continue;
+        }
+
+        Match_Ticket *second = lobby[j];
+        int window = std::max(match_window(first, now), match_window(second, now));
+        if (!same_time_control(first, second) || second->score - first->score > window || !claim_ticket(first))
+        {
+            unmatched.push_back(first);
+            i = j - 1;
+            continue;
+        }
+        if (!claim_ticket(second))
+        {
+            settle_ticket(first, TICKET_WAITING);
+            unmatched.push_back(first);
+            i = j - 1;
+            continue;
+        }
+
+        metric_observe(metrics.queue_wait, std::chrono::duration_cast<std::chrono::nanoseconds>(now - first->enqueued).count());
+        metric_observe(metrics.queue_wait, std::chrono::duration_cast<std::chrono::nanoseconds>(now - second->enqueued).count());
+        if (second->enqueued < first->enqueued)
+            std::swap(first, second);
+        start_match(first, second);
+        settle_ticket(first, TICKET_MATCHED);
+        settle_ticket(second, TICKET_MATCHED);
+        release_ticket(first);
+        release_ticket(second);
+        i = j;
+    }
+    lobby.swap(unmatched);
+    metric_set(metrics.queue_depth, lobby.size());
+}
+
+void matchmaking_thread()
+{
+    std::vector<Match_Ticket *> lobby;
+    std::vector<Match_Ticket *> unmatched;
+
+    while (1)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(MATCH_INTERVAL_MS));
+        match_lobby(lobby, unmatched);
+        flush_dirty_clients();
+    }
+}
+
+void command_register(Client_Info *client_info, char *args)
+{
+    char *saveptr;
+    char *username = strtok_r(args, " ", &saveptr);
+    char *password = strtok_r(NULL, " ", &saveptr);
+    if (!username || !password)
+    {
+        send_message_to_client(client_info, "Sintaxa: register <username> <password>\n");
+        return;
+    }
+    if (strlen(password) > MAX_PASSWORD_LENGTH)
+    {
+        send_message_to_client(client_info, "Parola poate avea cel mult 64 de caractere.\n");
+        return;
+    }
+
+    bool exists;
+    {
+        User_Shard &shard = user_shard(username);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        exists = user_find_locked(shard, username) != shard.users.end();
+    }
+    if (exists)
+    {
+        char response[BUFFER_SIZE];
+        snprintf(response, BUFFER_SIZE, "Utilizatorul %s deja exista.\n", username);
+        send_message_to_client(client_info, response);
+        return;
+    }
+    start_auth(client_info, AUTH_REGISTER, username, password);
+}
+
+void command_login(Client_Info *client_info, char *args)
+{
+    char *saveptr;
+    char *username = strtok_r(args, " ", &saveptr);
+    char *password = strtok_r(NULL, " ", &saveptr);
+    if (client_info->logged_in == 1)
+    {
+        send_message_to_client(client_info, "Esti deja logat cu un alt cont!\n");
+        return;
+    }
+    if (!username || !password)
+    {
+        send_message_to_client(client_info, "Sintaxa:login <username> <password>\n");
+        return;
+    }
+
+    if (strlen(password) > MAX_PASSWORD_LENGTH)
+    {
+        send_message_to_client(client_info, "Login esuat!Verificati credentialele!\n");
+        return;
+    }
+    start_auth(client_info, AUTH_LOGIN, username, password);
+}
+
+void finish_resume(Client_Info *client_info, Shard_Reply_Status status, const char *username, int home)
+{
+    if (status == SHARD_INVALID)
+        send_message_to_client(client_info, "Sesiune invalida sau expirata!\n");
+    else if (status == SHARD_BUSY)
+        send_message_to_client(client_info, "Esti deja conectat!\n");
+    else
+        finish_login(client_info, username, home);
+}
+
+void answer_resume(Client_Info *client_info, Shard_Reader *reader)
+{
+    char username[50];
+    if (!reader)
+    {
+        finish_resume(client_info, SHARD_INVALID, NULL, -1);
+        return;
+    }
+    Shard_Reply_Status status = (Shard_Reply_Status)shard_get_u8(*reader);
+    int shard = shard_get_u8(*reader);
+    shard_get_text(*reader, username, sizeof(username));
+    finish_resume(client_info, reader->error ? SHARD_INVALID : status, username, shard != NO_SHARD ? shard : -1);
+}
+
+// Runs on the worker: a token lookup is cheap, so resuming never waits behind the password hashes. On a sharded
+// server the lookup is a call to the coordinator, and the client is parked until it answers.
+void command_resume(Client_Info *client_info, char *args)
+{
+    if (client_info->logged_in == 1)
+    {
+        send_message_to_client(client_info, "Esti deja logat cu un alt cont!\n");
+        return;
+    }
+    if (strlen(args) >= SESSION_TOKEN_SIZE)
+    {
+        finish_resume(client_info, SHARD_INVALID, NULL, -1);
+        return;
+    }
+
+    if (coordinator_link >= 0)
+    {
+        uint8_t request[128];
+        Shard_Writer writer;
+        begin_call(writer, request, sizeof(request), SHARD_CALL_RESUME);
+        shard_put_text(writer, args);
+        coordinator_call_parked(client_info, writer, answer_resume);
+        return;
+    }
+
+    char username[50];
+    finish_resume(client_info, check_session(args, username), username, -1);
+}
+
+void command_logout(Client_Info *client_info, char *)
+{
+    client_info->logged_in = 0;
+    close_session(client_info->username);
+    logout_user(client_info->username);
+    bzero(client_info->username, sizeof(client_info->username));
+    send_message_to_client(client_info, "Logout reusit!\n");
+}
+
+void command_play(Client_Info *client_info, char *args)
+{
+    char response[BUFFER_SIZE];
+    stop_watching(client_info);
+    if (args[0] == 0)
+    {
+        handle_play(client_info);
+        return;
+    }
+    if (strncmp(args, "blitz", 5) == 0 && (args[5] == 0 || args[5] == ' '))
+    {
+        // "play blitz 3+2": minutes on each clock, seconds added after every move.
+        int minutes = BLITZ_DEFAULT_MINUTES, increment = BLITZ_DEFAULT_INCREMENT;
+        char extra;
+        if (args[5] != 0 && (sscanf(args + 5, "%d+%d %c", &minutes, &increment, &extra) != 2 || minutes < 1 ||
+                             minutes > BLITZ_MAX_MINUTES || increment < 0 || increment > BLITZ_MAX_INCREMENT))
+        {
+            snprintf(response, BUFFER_SIZE, "Sintaxa: play blitz [minute+secunde], de exemplu play blitz %d+%d (cel mult %d+%d)\n",
+                     BLITZ_DEFAULT_MINUTES, BLITZ_DEFAULT_INCREMENT, BLITZ_MAX_MINUTES, BLITZ_MAX_INCREMENT);
+            send_message_to_client(client_info, response);
+            return;
+        }
+        handle_play(client_info, minutes * 60000, increment * 1000);
+        return;
+    }
+    if (strncmp(args, "ai", 2) != 0 || (args[2] != 0 && args[2] != ' '))
+    {
+        send_message_to_client(client_info, "Comanda necunoscuta");
+        return;
+    }
+
+    int level = AI_DEFAULT_LEVEL;
+    if (args[2] != 0 && (sscanf(args + 2, "%d", &level) != 1 || level < 1 || level > AI_MAX_LEVEL))
+    {
+        snprintf(response, BUFFER_SIZE, "Sintaxa: play ai [1-%d]\n", AI_MAX_LEVEL);
+        send_message_to_client(client_info, response);
+        return;
+    }
+    if (client_info->match_ticket)
+    {
+        release_ticket(client_info->match_ticket);
+        client_info->match_ticket = NULL;
+    }
+    create_new_game(client_info, NULL, level);
+}
+
+void command_move(Client_Info *client_info, char *args)
+{
+    auto start = std::chrono::steady_clock::now();
+    handle_move(client_info, args);
+    metric_observe(metrics.move_latency, metric_elapsed(start));
+}
+
+void command_surrender(Client_Info *client_info, char *)
+{
+    char response[BUFFER_SIZE];
+    int game_id = client_info->game_id;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *found = lock_game(game_id, game_lock);
+    if (!found)
+    {
+        send_message_to_client(client_info, "Nu esti intr-un joc activ!\n");
+        return;
+    }
+    Game_Info &game = *found;
+    snprintf(response, BUFFER_SIZE, "%s a abandonat jocul!\n", client_info->username);
+    send_to_players(game, response);
+    if (client_info == game.player1)
+        award_points(game, 1, 3);
+    else
+        award_points(game, 3, 1);
+    end_game_locked(game, game_id, END_SURRENDER, client_info == game.player1 ? 1 : 2);
+}
+
+// Only in games against the computer: in a game between players it would be playing for one of them.
+void command_hint(Client_Info *client_info, char *)
+{
+    int game_id = client_info->game_id;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game)
+    {
+        send_message_to_client(client_info, "Nu esti intr-un joc activ!\n");
+        return;
+    }
+    if (!game->ai_level)
+    {
+        send_message_to_client(client_info, "Sugestiile sunt disponibile doar in jocurile contra calculatorului.\n");
+        return;
+    }
+    if (game->turn != (game->player1 == client_info ? 1 : 2))
+    {
+        send_message_to_client(client_info, "Nu este randul tau!\n");
+        return;
+    }
+    if (game->hint_pending)
+    {
+        send_message_to_client(client_info, "Sugestia este deja in lucru.\n");
+        return;
+    }
+    game->hint_pending = true;
+    schedule_ai_job(AI_HINT, game_id);
+}
+
+void command_stop(Client_Info *client_info, char *)
+{
+    if (!cancel_matchmaking(client_info, CANCEL_STOP))
+    {
+        if (!client_info->cancel_pending)
+            send_message_to_client(client_info, "Poti folosi comanda doar daca cauti un meci!\n");
+        return;
+    }
+    client_info->status = FREE;
+    send_message_to_client(client_info, "Am oprit cautarea!\n");
+}
+
+void command_scoreboard(Client_Info *client_info, char *)
+{
+    scoreboard(client_info);
+}
+
+void command_help(Client_Info *client_info, char *)
+{
+    send_message_to_client(client_info,
+                           "Comenzi valabile:\n"
+                           "register <username> <password> - Creaza un nou cont\n"
+                           "login <username> <password> - Autentificate\n"
+                           "resume <token> - Reia sesiunea (si meciul neterminat) dupa o reconectare\n"
+                           "logout - Log-out din contul curent\n"
+                           "play - Pregateste un joc Reversi\n"
+                           "play ai [nivel] - Joaca imediat contra calculatorului (nivel 1-5)\n"
+                           "play blitz [M+S] - Cauta un meci cu ceas: M minute de joc, S secunde in plus dupa fiecare mutare (implicit 3+2)\n"
+                           "stop - Opreste cautarea unui meci\n"
+                           "move <linie> <coloana> - Executa o mutare in joc\n"
+                           "surrender - Abandoneaza jocul curent\n"
+                           "hint - Sugereaza o mutare (doar contra calculatorului)\n"
+                           "sync - Retrimite tabla curenta\n"
+                           "replay <id_meci> - Arata mutarile unui meci terminat\n"
+                           "analyze <id_meci> - Evalueaza fiecare mutare a unui meci terminat si arata greselile\n"
+                           "list games - Arata meciurile in desfasurare\n"
+                           "watch <id_meci> - Urmareste un meci ca spectator\n"
+                           "unwatch - Nu mai urmari meciul\n"
+                           "scoreboard - Top 10 jucatori\n"
+                           "help - Arata acest mesaj\n"
+                           "quit - Deconeteaza clientul de la server\n");
+}
+
+// A match lives on the shard that created it; replay and watch for another shard's match move the client there.
+bool forward_to_owner(Client_Info *client_info, const char *command, unsigned match_id)
+{
+    if (coordinator_link < 0 || match_id == 0)
+        return false;
+    int owner = (match_id - 1) % shard_count;
+    if (owner == shard_index)
+        return false;
+
+    char text[64];
+    snprintf(text, sizeof(text), "%s %u", command, match_id);
+    request_handoff(client_info, owner, ADOPT_COMMAND, 0, text);
+    return true;
+}
+
+void command_replay(Client_Info *client_info, char *args)
+{
+    char text[REPLAY_TEXT_SIZE];
+    unsigned match_id;
+    if (sscanf(args, "%u", &match_id) != 1)
+    {
+        send_message_to_client(client_info, "Sintaxa: replay <id_meci>\n");
+        return;
+    }
+    if (forward_to_owner(client_info, "replay", match_id))
+        return;
+
+    uint64_t offset;
+    {
+        std::lock_guard<std::mutex> lock(finished_matches_mutex);
+        auto found = finished_matches.find(match_id);
+        if (found == finished_matches.end())
+        {
+            snprintf(text, sizeof(text), "Meciul %u nu exista sau nu s-a terminat inca.\n", match_id);
+            send_message_to_client(client_info, text);
+            return;
+        }
+        offset = found->second;
+    }
+
+    Game_Record record;
+    if (!read_game_record(offset, record) || record.type != RECORD_END || record.match_id != match_id)
+    {
+        snprintf(text, sizeof(text), "Nu am putut citi meciul %u din jurnal.\n", match_id);
+        send_message_to_client(client_info, text);
+        return;
+    }
+
+    size_t length = snprintf(text, sizeof(text), "Meciul %u: %s (B) vs %s (W)\n", match_id, record.names[0], record.names[1]);
+    Board board;
+    init_board(board);
+    int turn = 1;
+    for (int i = 0; i < record.move_count; i++)
+    {
+        int player = turn;
+        if (!replay_move(board, &turn, record.moves[i]))
+        {
+            snprintf(text, sizeof(text), "Jurnalul meciului %u este corupt.\n", match_id);
+            send_message_to_client(client_info, text);
+            return;
+        }
+        length += snprintf(text + length, sizeof(text) - length, "%d. %c %d %d\n", i + 1, player == 1 ? 'B' : 'W',
+                           record.moves[i] / 8, record.moves[i] % 8);
+    }
+
+    render_board(board, text + length);
+    length += BOARD_STRING_SIZE - 1;
+    const char *colors[] = {"", "Negru", "Alb"};
+    int loser = record.loser == 2 ? 2 : 1;
+    if (record.reason == END_SURRENDER)
+        length += snprintf(text + length, sizeof(text) - length, "%s (%s) a abandonat. ", record.names[loser - 1], colors[loser]);
+    else if (record.reason == END_DISCONNECT)
+        length += snprintf(text + length, sizeof(text) - length, "%s (%s) s-a deconectat. ", record.names[loser - 1], colors[loser]);
+    else if (record.reason == END_TIMEOUT)
+        length += snprintf(text + length, sizeof(text) - length, "%s (%s) a ramas fara timp. ", record.names[loser - 1], colors[loser]);
+    snprintf(text + length, sizeof(text) - length, "Rezultat: Negru %d - Alb %d\n", count_discs(board, 1), count_discs(board, 2));
+    send_message_to_client(client_info, text);
+}
+
+// Positions searched to the end score 10000 per disc of difference; those are shown as discs.
+size_t format_score(char *out, size_t size, int score)
+{
+    if (abs(score) >= 10000)
+        return snprintf(out, size, "%+d piese", score / 10000);
+    return snprintf(out, size, "%+d", score);
+}
+
+// Runs on analysis_thread while the client that asked is parked. Evaluations land in the shared table, so
+// analysing a match again, or one that went through the same positions, is mostly lookups.
+void analyze_match(const Analysis_Job &job)
+{
+    char text[ANALYSIS_TEXT_SIZE];
+    Game_Record record;
+    if (!read_game_record(job.offset, record) || record.type != RECORD_END || record.match_id != job.match_id)
+    {
+        snprintf(text, sizeof(text), "Nu am putut citi meciul %u din jurnal.\n", job.match_id);
+        send_message_to_client(job.client, text);
+        unpark_client(job.client);
+        return;
+    }
+
+    size_t length = snprintf(text, sizeof(text), "Analiza meciului %u: %s (B) vs %s (W)\n", job.match_id, record.names[0], record.names[1]);
+    int mistakes[3] = {0, 0, 0};
+    Board board;
+    init_board(board);
+    int turn = 1;
+    for (int i = 0; i < record.move_count; i++)
+    {
+        int player = turn, square = record.moves[i];
+        if (!is_valid_move(board, square / 8, square % 8, player))
+        {
+            snprintf(text, sizeof(text), "Jurnalul meciului %u este corupt.\n", job.match_id);
+            send_message_to_client(job.client, text);
+            unpark_client(job.client);
+            return;
+        }
+
+        Move_Review review;
+        bool reviewed = review_move(board, player, square, review);
+        replay_move(board, &turn, square);
+        length += snprintf(text + length, sizeof(text) - length, "%d. %c %d %d", i + 1, player == 1 ? 'B' : 'W', square / 8, square % 8);
+        if (reviewed)
+        {
+            length += snprintf(text + length, sizeof(text) - length, " (");
+            length += format_score(text + length, sizeof(text) - length, review.played_score);
+            length += snprintf(text + length, sizeof(text) - length, ")");
+        }
+        if (reviewed && review.best_score - review.played_score >= ANALYSIS_MISTAKE)
+        {
+            mistakes[player]++;
+            length += snprintf(text + length, sizeof(text) - length, " greseala, mai buna era %d %d (",
+                               review.best_square / 8, review.best_square % 8);
+            length += format_score(text + length, sizeof(text) - length, review.best_score);
+            length += snprintf(text + length, sizeof(text) - length, ")");
+        }
+        text[length++] = '\n';
+    }
+    snprintf(text + length, sizeof(text) - length, "Greseli (cel putin %d puncte pierdute): Negru %d, Alb %d\n",
+             ANALYSIS_MISTAKE, mistakes[1], mistakes[2]);
+    send_message_to_client(job.client, text);
+    unpark_client(job.client);
+}
+
+void analysis_thread()
+{
+    setpriority(PRIO_PROCESS, gettid(), ANALYSIS_NICE);
+    while (1)
+    {
+        Analysis_Job job;
+        {
+            std::unique_lock<std::mutex> lock(analysis_mutex);
+            analysis_cond.wait(lock, []
+                               { return analysis_jobs.count != 0; });
+            job = ring_pop(analysis_jobs);
+        }
+        analyze_match(job);
+    }
+}
+
+// Like a login, the client runs no other command until the analysis is sent.
+void command_analyze(Client_Info *client_info, char *args)
+{
+    char response[BUFFER_SIZE];
+    unsigned match_id;
+    if (sscanf(args, "%u", &match_id) != 1)
+    {
+        send_message_to_client(client_info, "Sintaxa: analyze <id_meci>\n");
+        return;
+    }
+    if (forward_to_owner(client_info, "analyze", match_id))
+        return;
+
+    Analysis_Job job;
+    {
+        std::lock_guard<std::mutex> lock(finished_matches_mutex);
+        auto found = finished_matches.find(match_id);
+        if (found == finished_matches.end())
+        {
+            snprintf(response, BUFFER_SIZE, "Meciul %u nu exista sau nu s-a terminat inca.\n", match_id);
+            send_message_to_client(client_info, response);
+            return;
+        }
+        job.offset = found->second;
+    }
+    job.client = client_info;
+    job.match_id = match_id;
+
+    {
+        std::lock_guard<std::mutex> lock(analysis_mutex);
+        if (analysis_jobs.count >= ANALYSIS_QUEUE_LIMIT)
+        {
+            send_message_to_client(client_info, "Serverul este ocupat, incearca din nou.\n");
+            return;
+        }
+        client_info->refs.fetch_add(1);
+        client_info->parked = PARK_JOB;
+        ring_push(analysis_jobs, job);
+    }
+    analysis_cond.notify_one();
+}
+
+void command_watch(Client_Info *client_info, char *args)
+{
+    char response[BUFFER_SIZE];
+    unsigned match_id;
+    if (sscanf(args, "%u", &match_id) != 1)
+    {
+        send_message_to_client(client_info, "Sintaxa: watch <id_meci>\n");
+        return;
+    }
+    if (forward_to_owner(client_info, "watch", match_id))
+        return;
+
+    stop_watching(client_info);
+    int game_id = -1;
+    for_each_game([&](Game_Info &game, int id)
+                  {
+                      if (game.match_id != match_id)
+                          return true;
+                      game_id = id;
+                      return false; });
+
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(game_id, game_lock);
+    if (!game || game->match_id != match_id)
+    {
+        snprintf(response, BUFFER_SIZE, "Meciul %u nu este in desfasurare.\n", match_id);
+        send_message_to_client(client_info, response);
+        return;
+    }
+
+    game->spectators.push_back(client_info);
+    client_info->watching = game_id;
+    snprintf(response, BUFFER_SIZE, "Urmaresti meciul %u: %s (B) vs %s (W). Scrie unwatch ca sa te opresti.\n",
+             match_id, game->names[0], game->names[1]);
+    send_board_update(client_info, *game, EVENT_SNAPSHOT, response);
+}
+
+void command_unwatch(Client_Info *client_info, char *)
+{
+    if (stop_watching(client_info))
+        send_message_to_client(client_info, "Nu mai urmaresti meciul.\n");
+    else
+        send_message_to_client(client_info, "Nu urmaresti niciun meci!\n");
+}
+
+// Writes up to limit lines into text and returns how many games this server is running.
+int list_local_games(char *text, size_t size, int limit, int *listed)
+{
+    size_t length = 0;
+    int total = 0;
+    *listed = 0;
+    text[0] = 0;
+    for_each_game([&](Game_Info &game, int)
+                  {
+                      if (++total > limit || length >= size)
+                          return true;
+                      (*listed)++;
+                      char control[32] = "";
+                      if (game.timed)
+                          snprintf(control, sizeof(control), ", blitz %u+%u", game.base_ms / 60000, game.increment_ms / 1000);
+                      length += snprintf(text + length, size - length, "%u: %s vs %s, %d mutari, %zu spectatori%s\n",
+                                         game.match_id, game.names[0], game.names[1], game.move_count, game.spectators.size(), control);
+                      return true; });
+    return total;
+}
+
+void send_game_list(Client_Info *client_info, const char *lines, int total, int listed)
+{
+    char text[REPLAY_TEXT_SIZE + 128];
+    size_t length = snprintf(text, sizeof(text), "Meciuri in desfasurare:\n%s", lines);
+    if (total == 0)
+        snprintf(text + length, sizeof(text) - length, "Niciun meci momentan.\n");
+    else if (total > listed)
+        snprintf(text + length, sizeof(text) - length, "... si inca %d. Foloseste watch <id_meci>.\n", total - listed);
+    else
+        snprintf(text + length, sizeof(text) - length, "Foloseste watch <id_meci>.\n");
+    send_message_to_client(client_info, text);
+}
+
+// Every shard answers for its own games; the coordinator keeps the first LIST_GAMES_LIMIT lines.
+void answer_list(Client_Info *client_info, Shard_Reader *reader)
+{
+    char lines[SHARD_TEXT_SIZE] = "";
+    int total = 0, listed = 0;
+    if (reader)
+    {
+        total = shard_get_u32(*reader);
+        listed = shard_get_u32(*reader);
+        shard_get_text(*reader, lines, sizeof(lines));
+        if (reader->error)
+            total = listed = 0;
+    }
+    send_game_list(client_info, lines, total, listed);
+}
+
+void command_list(Client_Info *client_info, char *args)
+{
+    if (strcmp(args, "games") != 0)
+    {
+        send_message_to_client(client_info, "Sintaxa: list games\n");
+        return;
+    }
+
+    if (coordinator_link >= 0)
+    {
+        uint8_t request[16];
+        Shard_Writer writer;
+        begin_call(writer, request, sizeof(request), SHARD_CALL_LIST);
+        coordinator_call_parked(client_info, writer, answer_list);
+        return;
+    }
+
+    char lines[SHARD_TEXT_SIZE];
+    int listed;
+    int total = list_local_games(lines, sizeof(lines), LIST_GAMES_LIMIT, &listed);
+    send_game_list(client_info, lines, total, listed);
+}
+
+void command_sync(Client_Info *client_info, char *)
+{
+    handle_sync(client_info);
+}
+
+// What a client must satisfy before a command's handler runs; handle_command sends the rejection.
+enum Command_Flag
+{
+    REQUIRES_LOGIN = 1,
+    REQUIRES_FREE = 2,
+    REQUIRES_GAME = 4,
+    REQUIRES_SEARCH = 8,
+    TAKES_ARGS = 16
+};
+
+typedef void (*Command_Handler)(Client_Info *client_info, char *args);
+
+typedef struct
+{
+    const char *name;
+    int flags;
+    const char *login_error;
+    Command_Handler handler;
+} Command;
+
+constexpr Command commands[] = {
+    {"register", REQUIRES_FREE | TAKES_ARGS, NULL, command_register},
+    {"login", REQUIRES_FREE | TAKES_ARGS, NULL, command_login},
+    {"resume", REQUIRES_FREE | TAKES_ARGS, NULL, command_resume},
+    {"logout", REQUIRES_LOGIN | REQUIRES_FREE, "Nu esti logat!\n", command_logout},
+    {"play", REQUIRES_LOGIN | REQUIRES_FREE | TAKES_ARGS, "Trebuie sa fii logat pentru a te juca!\n", command_play},
+    {"move", REQUIRES_LOGIN | REQUIRES_GAME | TAKES_ARGS, "Trebuie sa fii logat pentru a executa o mutare!\n", command_move},
+    {"surrender", REQUIRES_GAME, NULL, command_surrender},
+    {"hint", REQUIRES_GAME, NULL, command_hint},
+    {"stop", REQUIRES_SEARCH, NULL, command_stop},
+    {"scoreboard", REQUIRES_FREE, NULL, command_scoreboard},
+    {"help", REQUIRES_FREE, NULL, command_help},
+    {"sync", 0, NULL, command_sync},
+    {"replay", REQUIRES_FREE | TAKES_ARGS, NULL, command_replay},
+    {"analyze", REQUIRES_FREE | TAKES_ARGS, NULL, command_analyze},
+    {"list", REQUIRES_FREE | TAKES_ARGS, NULL, command_list},
+    {"watch", REQUIRES_FREE | TAKES_ARGS, NULL, command_watch},
+    {"unwatch", 0, NULL, command_unwatch},
+};
+
+#define COMMAND_COUNT (int)(sizeof(commands) / sizeof(commands[0]))
+#define COMMAND_SLOTS 64
+#define COMMAND_SEED_TRIES 1024
+
+constexpr uint32_t command_hash(const char *name, size_t length, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+constexpr size_t command_length(const char *name)
+{
+    size_t length = 0;
+    while (name[length])
+        length++;
+    return length;
+}
+
+typedef struct
+{
+    int8_t index[COMMAND_SLOTS];
+    uint32_t seed;
+    bool perfect;
+} Command_Slots;
+
+// Tries hash seeds at compile time until every command lands in its own slot.
+constexpr Command_Slots build_command_slots()
 {
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    const char *sql = "INSERT INTO users (username,password) VALUES (?,?);";
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    Command_Slots slots = {};
+    for (uint32_t seed = 0; seed < COMMAND_SEED_TRIES; seed++)
     {
-        fprintf(stderr, "Eroare la statement: %s\n", sqlite3_errmsg(db));
-        return;
+        for (int i = 0; i < COMMAND_SLOTS; i++)
+            slots.index[i] = -1;
+        slots.seed = seed;
+        slots.perfect = true;
+        for (int i = 0; i < COMMAND_COUNT && slots.perfect; i++)
+        {
+            uint32_t slot = command_hash(commands[i].name, command_length(commands[i].name), seed) & (COMMAND_SLOTS - 1);
+            if (slots.index[slot] != -1)
+                slots.perfect = false;
+            slots.index[slot] = i;
+        }
+        if (slots.perfect)
+            break;
     }
+    return slots;
+}
 
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
+// One counter per table entry; the last one counts unknown commands.
+Metric_Counter command_counts[COMMAND_COUNT + 1];
 
-    int result = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+// Every command owns its own slot, so a lookup is one hash and one strcmp.
+constexpr Command_Slots command_slots = build_command_slots();
+static_assert(command_slots.perfect, "no hash seed separates all commands, grow COMMAND_SLOTS");
 
-    if (result == SQLITE_DONE)
+const Command *find_command(const char *name, size_t length)
+{
+    int index = command_slots.index[command_hash(name, length, command_slots.seed) & (COMMAND_SLOTS - 1)];
+    if (index < 0 || strcmp(commands[index].name, name) != 0)
+        return NULL;
+    return &commands[index];
+}
+
+bool check_command_state(Client_Info *client_info, const Command *command)
+{
+    int status = client_info->status;
+    if ((command->flags & REQUIRES_LOGIN) && !client_info->logged_in)
     {
-        snprintf(response, BUFFER_SIZE, "Inregistrare reusita pentru utilizatorul %s.\n", username);
-        send_message_to_client(socket, response);
+        send_message_to_client(client_info, command->login_error);
+        return false;
     }
-    else
+    if ((command->flags & REQUIRES_FREE) && status == WAITING_FOR_PLAYER)
     {
-        snprintf(response, BUFFER_SIZE, "Utilizatorul %s deja exista.\n", username);
-        send_message_to_client(socket, response);
+        send_message_to_client(client_info, "Cauti deja un meci!\n");
+        return false;
+    }
+    if ((command->flags & REQUIRES_FREE) && status == IN_GAME)
+    {
+        send_message_to_client(client_info, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
+        return false;
+    }
+    if ((command->flags & REQUIRES_GAME) && status != IN_GAME)
+    {
+        send_message_to_client(client_info, "Nu esti intr-un joc activ!\n");
+        return false;
+    }
+    if ((command->flags & REQUIRES_SEARCH) && status != WAITING_FOR_PLAYER)
+    {
+        send_message_to_client(client_info, "Poti folosi comanda doar daca cauti un meci!\n");
+        return false;
     }
+    return true;
 }
 
-int login_user(const char *username, const char *password)
+void handle_command(Client_Info *client_info, char *command)
 {
-    const char *check_sql = "SELECT logged_in FROM users WHERE username=? AND password=?;";
-    const char *update_sql = "UPDATE users SET logged_in=1 WHERE username=?;";
-
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, check_sql, -1, &stmt, NULL) != SQLITE_OK)
+    size_t length = strcspn(command, " ");
+    char *args = command + length;
+    if (*args)
     {
-        fprintf(stderr, "Eroare la statement:%s\n", sqlite3_errmsg(db));
-        return 0;
+        *args++ = 0;
+        while (*args == ' ')
+            args++;
     }
 
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
-
-    int result = sqlite3_step(stmt);
-    if (result == SQLITE_ROW)
+    const Command *found = find_command(command, length);
+    if (!found || (*args && !(found->flags & TAKES_ARGS)))
     {
-        int is_logged_in = sqlite3_column_int(stmt, 0);
-        sqlite3_finalize(stmt);
+        metric_add(command_counts[COMMAND_COUNT]);
+        send_message_to_client(client_info, "Comanda necunoscuta");
+        return;
+    }
+    metric_add(command_counts[found - commands]);
+    if (check_command_state(client_info, found))
+        found->handler(client_info, args);
+}
 
-        if (is_logged_in)
+Client_Info *client_alloc(int socket)
+{
+    Client_Info *client_info = NULL;
+    {
+        std::lock_guard<std::mutex> lock(free_clients_mutex);
+        if (free_clients)
         {
-            fprintf(stderr, "Utilizatorul %s este deja logat.\n", username);
-            return 2;
+            client_info = free_clients;
+            free_clients = client_info->next_free;
         }
     }
-    else
-    {
-        sqlite3_finalize(stmt);
-        fprintf(stderr, "Credentiale invalide.\n");
-        return 0;
-    }
+    if (!client_info)
+        client_info = new Client_Info();
 
-    if (sqlite3_prepare_v2(db, update_sql, -1, &stmt, NULL) != SQLITE_OK)
-    {
-        fprintf(stderr, "Eroare la statement:%s\n", sqlite3_errmsg(db));
-        return 0;
-    }
+    client_info->socket = socket;
+    client_info->logged_in = 0;
+    bzero(client_info->username, sizeof(client_info->username));
+    client_info->game_id = -1;
+    client_info->status = FREE;
+    client_info->pending_events = 0;
+    client_info->refs = 1;
+    client_info->closed = false;
+    client_info->negotiated = false;
+    client_info->binary = false;
+    client_info->watching = -1;
+    client_info->parked = PARK_NONE;
+    client_info->handoff_target = -1;
+    client_info->input.head = 0;
+    client_info->input.length = 0;
+    client_info->input.scanned = 0;
+    client_info->input.discarding = false;
+    client_info->output_head = NULL;
+    client_info->output_tail = NULL;
+    client_info->output_bytes = 0;
+    client_info->output_overflow = false;
+    client_info->match_ticket = NULL;
+    client_info->timers_fired = 0;
+    client_info->cancel_pending = CANCEL_NONE;
+    client_info->last_input = std::chrono::steady_clock::now();
+    client_info->next_free = NULL;
+    arm_timer(&client_info->idle_timer, TIMER_IDLE, client_info, 0, client_info->last_input + CLIENT_IDLE_TIMEOUT);
+    metric_add(metrics.connections, 1);
+    metric_add(metrics.connections_total);
+    return client_info;
+}
 
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+// For a timer that fired: a client already down to no references is being recycled, and its timers with it.
+bool client_try_ref(Client_Info *client_info)
+{
+    int refs = client_info->refs.load();
+    while (refs > 0 && !client_info->refs.compare_exchange_weak(refs, refs + 1))
+        ;
+    return refs > 0;
+}
 
-    result = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+void client_release(Client_Info *client_info)
+{
+    if (client_info->refs.fetch_sub(1) == 1)
+    {
+        cancel_timer(&client_info->idle_timer);
+        cancel_timer(&client_info->match_timer);
+        cancel_timer(&client_info->call_timer);
+        close(client_info->socket);
+        free_output(client_info);
+        metric_add(metrics.connections, -1);
 
-    return result == SQLITE_DONE;
+        std::lock_guard<std::mutex> lock(free_clients_mutex);
+        client_info->next_free = free_clients;
+        free_clients = client_info;
+    }
 }
 
-void logout_user(const char *username)
+void schedule_client(Client_Info *client_info)
 {
-    const char *sql = "UPDATE users SET logged_in = 0 WHERE username=?;";
-    sqlite3_stmt *stmt;
+    if (client_info->pending_events.fetch_add(1) != 0)
+        return;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    client_info->refs.fetch_add(1);
     {
-        fprintf(stderr, "Eroare la statement: %s\n", sqlite3_errmsg(db));
-        return;
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        ring_push(ready_clients, client_info);
     }
-
-    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    ready_cond.notify_one();
 }
 
-void scoreboard(Client_Info *client_info)
+// The main loop drops the last reference once no worker can still be holding the client.
+void retire_client(Client_Info *client_info)
 {
-    const char *sql = "SELECT username, score FROM users ORDER BY score DESC LIMIT 10;";
-    sqlite3_stmt *stmt;
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK)
+    client_info->closed = true;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_info->socket, NULL);
     {
-        std::string scoreboard = "Top 10 Players:\n";
-        int rank = 1;
-
-        while (sqlite3_step(stmt) == SQLITE_ROW)
-        {
-            const char *username = (const char *)sqlite3_column_text(stmt, 0);
-            int score = sqlite3_column_int(stmt, 1);
-            scoreboard += std::to_string(rank) + ". " + username + ": " + std::to_string(score) + " points\n";
-            rank++;
-        }
-
-        sqlite3_finalize(stmt);
-        send_message_to_client(client_info->socket, (char *)scoreboard.c_str());
+        std::lock_guard<std::mutex> lock(closed_mutex);
+        closed_clients.push_back(client_info);
     }
+    uint64_t wake = 1;
+    write(wake_fd, &wake, sizeof(wake));
 }
 
-bool is_valid_move(int board[8][8], int row, int col, int player)
+// forfeit is for a player the server drops for stalling their own game, who gets no time to come back.
+void disconnect_client(Client_Info *client_info, bool forfeit = false)
 {
-    if (board[row][col] != 0)
-        return false;
+    char response[BUFFER_SIZE];
 
-    int opponent = (player == 1) ? 2 : 1;
-    bool valid = false;
+    // A search being paired is settled first; handle_client comes back here once the client is unparked.
+    if (client_info->status == WAITING_FOR_PLAYER && !cancel_matchmaking(client_info, CANCEL_DISCONNECT) &&
+        client_info->cancel_pending)
+        return;
 
-    int dirs[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+    log_info("disconnect", "Clientul %d s-a deconectat.", client_info->socket);
+    stop_watching(client_info);
 
-    for (int dir = 0; dir < 8; dir++)
+    if (client_info->logged_in)
     {
-        int curr_row = row + dirs[dir][0];
-        int curr_col = col + dirs[dir][1];
-        bool found_opponent = false;
-
-        while (curr_row >= 0 && curr_row < 8 && curr_col >= 0 && curr_col < 8)
+        int game_id = client_info->game_id;
+        std::unique_lock<std::mutex> game_lock;
+        Game_Info *found = NULL;
+        if (client_info->status == IN_GAME && (found = lock_game(game_id, game_lock)) != NULL)
         {
-            if (board[curr_row][curr_col] == opponent)
-            {
-                found_opponent = true;
-            }
-            else if (board[curr_row][curr_col] == player && found_opponent)
+            Game_Info &game = *found;
+            int loser = (client_info == game.player1) ? 1 : 2;
+            Client_Info *opponent = (loser == 1) ? game.player2 : game.player1;
+            if (loser == 1)
+                game.player1 = NULL;
+            else
+                game.player2 = NULL;
+            client_info->game_id = -1;
+
+            // Nobody is left at the table of a game whose other player is away too, so it ends here.
+            if (!forfeit && (opponent || game.ai_level))
             {
-                valid = true;
-                break;
+                suspend_player(game, game_id, loser);
             }
             else
             {
-                break;
+                snprintf(response, BUFFER_SIZE, "%s a abandonat jocul!\n", client_info->username);
+                if (loser == 1)
+                    award_points(game, 1, 3);
+                else
+                    award_points(game, 3, 1);
+                send_to_players(game, response);
+                end_game_locked(game, game_id, END_DISCONNECT, loser);
             }
-            curr_row += dirs[dir][0];
-            curr_col += dirs[dir][1];
+            logout_user(client_info->username);
         }
-        if (valid)
-            break;
+        else
+        {
+            logout_user(client_info->username);
+        }
+    }
+
+    // A player matched with someone on another shard left before moving there: the peer goes back in the queue.
+    int target = client_info->handoff_target.exchange(-1);
+    if (target >= 0 && client_info->handoff_action == ADOPT_JOIN)
+    {
+        uint8_t message[8];
+        Shard_Writer writer;
+        shard_writer_init(writer, message, sizeof(message), SHARD_MIGRATE_FAILED);
+        shard_put_u8(writer, target);
+        shard_put_u32(writer, client_info->handoff_arg);
+        shard_send(coordinator_link, writer);
+    }
+
+    if (client_info->match_ticket)
+    {
+        release_ticket(client_info->match_ticket);
+        client_info->match_ticket = NULL;
     }
-    return valid;
+
+    shutdown(client_info->socket, SHUT_RDWR);
+    retire_client(client_info);
 }
 
-void make_move(int board[8][8], int row, int col, int player)
-{
-    board[row][col] = player;
-    int opponent = (player == 1) ? 2 : 1;
+void input_copy(Input_Buffer *input, size_t offset, char *out, size_t count);
 
-    int dirs[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+// Sends the client to the shard named by handoff_target: socket, login, unread input and unsent replies
+// travel in one HANDOFF message. This shard then drops the connection without logging the player out.
+void hand_off_client(Client_Info *client_info)
+{
+    uint8_t message[SHARD_MESSAGE_SIZE];
+    char input[INPUT_BUFFER_SIZE];
+    int target = client_info->handoff_target;
+    stop_watching(client_info);
+    if (client_info->match_ticket)
+    {
+        release_ticket(client_info->match_ticket);
+        client_info->match_ticket = NULL;
+    }
 
-    for (int dir = 0; dir < 8; dir++)
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), SHARD_HANDOFF);
+    shard_put_u8(writer, target);
+    shard_put_u8(writer, client_info->handoff_action);
+    shard_put_u32(writer, client_info->handoff_arg);
+    shard_put_text(writer, client_info->username);
+    shard_put_u8(writer, client_info->logged_in);
+    shard_put_u8(writer, client_info->binary);
+    shard_put_u8(writer, client_info->negotiated);
+    shard_put_u8(writer, client_info->input.discarding);
+    input_copy(&client_info->input, 0, input, client_info->input.length);
+    shard_put_blob(writer, input, client_info->input.length);
     {
-        int curr_row = row + dirs[dir][0];
-        int curr_col = col + dirs[dir][1];
-        std::vector<std::pair<int, int>> to_flip;
+        std::lock_guard<std::mutex> lock(client_info->output_mutex);
+        flush_client_locked(client_info);
+        uint8_t header[2];
+        write_u16(header, client_info->output_bytes);
+        if (client_info->output_bytes > SHARD_OUTPUT_LIMIT)
+            writer.overflow = true;
+        shard_put_bytes(writer, header, 2);
+        for (Output_Chunk *chunk = client_info->output_head; chunk; chunk = chunk->next)
+            shard_put_bytes(writer, chunk_data(chunk) + chunk->offset, chunk->length - chunk->offset);
+        free_output(client_info);
+    }
+    shard_put_text(writer, client_info->handoff_command);
 
-        while (curr_row >= 0 && curr_row < 8 && curr_col >= 0 && curr_col < 8)
-        {
-            if (board[curr_row][curr_col] == opponent)
-            {
-                to_flip.push_back({curr_row, curr_col});
-            }
-            else if (board[curr_row][curr_col] == player && !to_flip.empty())
-            {
-                for (auto &pos : to_flip)
-                {
-                    board[pos.first][pos.second] = player;
-                }
-                break;
-            }
-            else
-            {
-                break;
-            }
-            curr_row += dirs[dir][0];
-            curr_col += dirs[dir][1];
-        }
+    if (!shard_send(coordinator_link, writer, client_info->socket))
+    {
+        log_warn("handoff", "Clientul %d nu a putut fi mutat pe shard-ul %d.", client_info->socket, target);
+        disconnect_client(client_info);
+        return;
     }
+    log_info("handoff", "Clientul %d a fost mutat pe shard-ul %d.", client_info->socket, target);
+    retire_client(client_info);
+}
+
+ssize_t input_read(Input_Buffer *input, int socket)
+{
+    size_t free_space = INPUT_BUFFER_SIZE - input->length;
+    size_t tail = (input->head + input->length) % INPUT_BUFFER_SIZE;
+    size_t first = INPUT_BUFFER_SIZE - tail;
+    if (first > free_space)
+        first = free_space;
+
+    struct iovec iov[2];
+    iov[0].iov_base = input->data + tail;
+    iov[0].iov_len = first;
+    iov[1].iov_base = input->data;
+    iov[1].iov_len = free_space - first;
+
+    ssize_t bytes_received = readv(socket, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (bytes_received > 0)
+        input->length += bytes_received;
+    return bytes_received;
 }
 
-void init_board(int board[8][8])
+void input_consume(Input_Buffer *input, size_t count)
 {
-    memset(board, 0, sizeof(int) * 64);
-    board[3][3] = 2;
-    board[3][4] = 1;
-    board[4][3] = 1;
-    board[4][4] = 2;
+    input->head = (input->head + count) % INPUT_BUFFER_SIZE;
+    input->length -= count;
+    input->scanned = 0;
 }
 
-bool has_valid_moves(int board[8][8], int player)
+void input_copy(Input_Buffer *input, size_t offset, char *out, size_t count)
 {
-    for (int i = 0; i < 8; i++)
+    size_t start = (input->head + offset) % INPUT_BUFFER_SIZE;
+    size_t first = INPUT_BUFFER_SIZE - start;
+    if (first > count)
+        first = count;
+    memcpy(out, input->data + start, first);
+    memcpy(out + first, input->data, count - first);
+}
+
+Input_Result input_next_command(Input_Buffer *input, char *command, size_t size)
+{
+    while (input->scanned < input->length)
     {
-        for (int j = 0; j < 8; j++)
+        size_t pos = (input->head + input->scanned) % INPUT_BUFFER_SIZE;
+        if (input->data[pos] != '\n')
         {
-            if (is_valid_move(board, i, j, player))
-            {
-                return true;
-            }
+            input->scanned++;
+            continue;
+        }
+
+        size_t line_length = input->scanned;
+        if (input->discarding || line_length >= size)
+        {
+            bool was_discarding = input->discarding;
+            input_consume(input, line_length + 1);
+            input->discarding = false;
+            if (!was_discarding)
+                return INPUT_TOO_LONG;
+            continue;
         }
+
+        input_copy(input, 0, command, line_length);
+        if (line_length > 0 && command[line_length - 1] == '\r')
+            line_length--;
+        command[line_length] = 0;
+
+        input_consume(input, input->scanned + 1);
+        return INPUT_COMMAND;
     }
-    return false;
+
+    if (input->length >= size)
+    {
+        bool was_discarding = input->discarding;
+        input_consume(input, input->length);
+        input->discarding = true;
+        if (!was_discarding)
+            return INPUT_TOO_LONG;
+    }
+    return INPUT_NONE;
 }
 
-void update_score(const char *username, int points)
+bool decode_command(int opcode, const char *payload, size_t length, char *command, size_t size)
 {
-    const char *sql = "UPDATE users SET score = score + ? WHERE username = ?;";
-    sqlite3_stmt *stmt;
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    switch (opcode)
     {
-        fprintf(stderr, "Eroare la statement: %s\n", sqlite3_errmsg(db));
-        return;
+    case OP_REGISTER:
+    case OP_LOGIN:
+    {
+        size_t username_length = strnlen(payload, length);
+        if (username_length == length)
+            return false;
+        snprintf(command, size, "%s %s %s", opcode == OP_REGISTER ? "register" : "login", payload, payload + username_length + 1);
+        return true;
+    }
+    case OP_LOGOUT:
+        snprintf(command, size, "logout");
+        return true;
+    case OP_PLAY:
+        snprintf(command, size, "play");
+        return true;
+    case OP_PLAY_AI:
+        if (length == 0)
+            snprintf(command, size, "play ai");
+        else
+            snprintf(command, size, "play ai %d", (uint8_t)payload[0]);
+        return true;
+    case OP_STOP:
+        snprintf(command, size, "stop");
+        return true;
+    case OP_MOVE:
+        if (length != 1 || (uint8_t)payload[0] >= 64)
+            return false;
+        snprintf(command, size, "move %d %d", payload[0] / 8, payload[0] % 8);
+        return true;
+    case OP_SURRENDER:
+        snprintf(command, size, "surrender");
+        return true;
+    case OP_SCOREBOARD:
+        snprintf(command, size, "scoreboard");
+        return true;
+    case OP_HELP:
+        snprintf(command, size, "help");
+        return true;
+    case OP_SYNC:
+        snprintf(command, size, "sync");
+        return true;
+    case OP_TEXT:
+        snprintf(command, size, "%s", payload);
+        return true;
     }
+    return false;
+}
+
+// Binary frames are rewritten into the equivalent text command so both protocols share handle_command.
+Input_Result input_next_frame(Input_Buffer *input, char *command, size_t size)
+{
+    if (input->length < CLIENT_HEADER_SIZE)
+        return INPUT_NONE;
 
-    sqlite3_bind_int(stmt, 1, points);
-    sqlite3_bind_text(stmt, 2, username, -1, SQLITE_STATIC);
+    uint8_t header[CLIENT_HEADER_SIZE];
+    input_copy(input, 0, (char *)header, CLIENT_HEADER_SIZE);
+    size_t payload_length = header[1];
+    if (input->length < CLIENT_HEADER_SIZE + payload_length)
+        return INPUT_NONE;
 
-    if (sqlite3_step(stmt) != SQLITE_DONE)
-    {
-        fprintf(stderr, "Eroare la actualizarea scorurilor: %s\n", sqlite3_errmsg(db));
-    }
+    char payload[MAX_CLIENT_PAYLOAD + 1];
+    input_copy(input, CLIENT_HEADER_SIZE, payload, payload_length);
+    payload[payload_length] = 0;
+    input_consume(input, CLIENT_HEADER_SIZE + payload_length);
 
-    sqlite3_finalize(stmt);
+    return decode_command(header[0], payload, payload_length, command, size) ? INPUT_COMMAND : INPUT_INVALID;
 }
 
-std::string get_board_string(int board[8][8])
+bool negotiate_protocol(Client_Info *client_info)
 {
-    std::string result = "Tabla curenta:\n";
-    result += "  0 1 2 3 4 5 6 7\n";
+    Input_Buffer *input = &client_info->input;
+    if (input->length == 0)
+        return false;
 
-    for (int i = 0; i < 8; i++)
+    char hello[2];
+    input_copy(input, 0, hello, 1);
+    if ((uint8_t)hello[0] != PROTOCOL_MAGIC)
     {
-        result += std::to_string(i) + " ";
-        for (int j = 0; j < 8; j++)
-        {
-            if (board[i][j] == 0)
-                result += ". ";
-            else if (board[i][j] == 1)
-                result += "B ";
-            else
-                result += "W ";
-        }
-        result += "\n";
+        client_info->negotiated = true;
+        return true;
     }
-    return result;
+    if (input->length < 2)
+        return false;
+
+    input_copy(input, 0, hello, 2);
+    input_consume(input, 2);
+    client_info->negotiated = true;
+    client_info->binary = true;
+    log_debug("protocol", "Clientul %d foloseste protocolul binar v%d.", client_info->socket, (uint8_t)hello[1]);
+    if ((uint8_t)hello[1] != PROTOCOL_VERSION)
+    {
+        send_message_to_client(client_info, "Versiune de protocol nesuportata!\n");
+        flush_dirty_clients();
+        disconnect_client(client_info);
+        return false;
+    }
+    return true;
 }
 
-void handle_move(Client_Info *client_info, char *move_str)
+// Credentials never reach the log: register and login are logged by name only.
+void log_command(Client_Info *client_info, const char *command)
 {
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
+    int length = strcspn(command, " ");
+    bool credentials = (length == 5 && strncmp(command, "login", 5) == 0) || (length == 8 && strncmp(command, "register", 8) == 0) ||
+                       (length == 6 && strncmp(command, "resume", 6) == 0);
+    log_info("command", "Clientul %d: %.*s", client_info->socket, credentials ? length : LOG_TEXT_SIZE, command);
+}
 
-    Game_Info &game = active_games[client_info->game_id];
+// Spectators and players waiting for their opponent are quiet for a reason; in a timed game the clock decides.
+bool waiting_on_others(Client_Info *client_info)
+{
+    if (client_info->watching >= 0)
+        return true;
+    if (client_info->status != IN_GAME)
+        return false;
+    std::unique_lock<std::mutex> game_lock;
+    Game_Info *game = lock_game(client_info->game_id, game_lock);
+    return game && (game->timed || game->turn != (client_info == game->player1 ? 1 : 2));
+}
 
-    bool is_player1 = (game.player1 == client_info);
-    if ((is_player1 && game.turn != 1) || (!is_player1 && game.turn != 2))
-    {
-        std::string board_str = get_board_string(game.board);
-        snprintf(response, BUFFER_SIZE, "Nu este randul tau!\n%s", board_str.c_str());
-        send_message_to_client(client_info->socket, response);
-        return;
-    }
+// Runs on the worker that owns the client, for the timers the main loop saw fire.
+void handle_timers(Client_Info *client_info, int fired)
+{
+    char response[BUFFER_SIZE];
+    auto now = std::chrono::steady_clock::now();
 
-    int row, col;
-    if (sscanf(move_str, "%d %d", &row, &col) != 2 ||
-        row < 0 || row >= 8 || col < 0 || col >= 8)
+    // A deadline left over from an earlier search is ignored; the current one has its own timer.
+    Match_Ticket *ticket = client_info->match_ticket;
+    if ((fired & (1 << TIMER_MATCH_DEADLINE)) && client_info->status == WAITING_FOR_PLAYER && ticket &&
+        now - ticket->enqueued >= MATCH_DEADLINE && cancel_matchmaking(client_info, CANCEL_DEADLINE))
     {
-        snprintf(response, BUFFER_SIZE, "Format invalid! move <linie> <coloana>\n");
-        send_message_to_client(client_info->socket, response);
-        return;
+        client_info->status = FREE;
+        metric_add(metrics.timeouts[TIMER_MATCH_DEADLINE]);
+        snprintf(response, BUFFER_SIZE, "Nu am gasit niciun adversar in %ld minute. Scrie play ca sa cauti din nou sau play ai ca sa joci cu calculatorul.\n",
+                 (long)std::chrono::duration_cast<std::chrono::minutes>(MATCH_DEADLINE).count());
+        send_message_to_client(client_info, response);
     }
 
-    if (!is_valid_move(game.board, row, col, game.turn))
+    // Reads only record when they happened; the timer catches up with last_input here instead of being moved on every read.
+    if (fired & (1 << TIMER_IDLE))
     {
-        std::string board_str = get_board_string(game.board);
-        snprintf(response, BUFFER_SIZE, "Miscare invalida!Mai incearca.\n%s", board_str.c_str());
-        send_message_to_client(client_info->socket, response);
-        return;
+        if (now - client_info->last_input < CLIENT_IDLE_TIMEOUT)
+        {
+            arm_timer(&client_info->idle_timer, TIMER_IDLE, client_info, 0, client_info->last_input + CLIENT_IDLE_TIMEOUT);
+        }
+        else if (waiting_on_others(client_info))
+        {
+            arm_timer(&client_info->idle_timer, TIMER_IDLE, client_info, 0, now + CLIENT_IDLE_TIMEOUT);
+        }
+        else
+        {
+            long minutes = std::chrono::duration_cast<std::chrono::minutes>(CLIENT_IDLE_TIMEOUT).count();
+            metric_add(metrics.timeouts[TIMER_IDLE]);
+            log_info("idle", "Clientul %d nu a mai trimis nimic de %ld minute.", client_info->socket, minutes);
+            snprintf(response, BUFFER_SIZE, "Ai fost deconectat dupa %ld minute de inactivitate.\n", minutes);
+            send_message_to_client(client_info, response);
+            flush_dirty_clients();
+            disconnect_client(client_info, true);
+        }
     }
+    flush_dirty_clients();
+}
 
-    make_move(game.board, row, col, game.turn);
-
-    game.turn = (game.turn == 1) ? 2 : 1;
+void handle_client(Client_Info *client_info)
+{
+    thread_local unsigned commands_seen;
+    char command[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
 
-    if (!has_valid_moves(game.board, game.turn))
+    int seen = client_info->pending_events.load();
+    while (!client_info->closed)
     {
-        game.turn = (game.turn == 1) ? 2 : 1;
-        if (!has_valid_moves(game.board, game.turn))
+        // Back from waiting on a ticket that was being paired: end the search now that it is settled.
+        if (client_info->cancel_pending && !client_info->parked)
         {
-            int black_count = 0, white_count = 0;
-            for (int i = 0; i < 8; i++)
+            int reason = client_info->cancel_pending;
+            client_info->cancel_pending = CANCEL_NONE;
+            if (reason == CANCEL_DISCONNECT)
             {
-                for (int j = 0; j < 8; j++)
-                {
-                    if (game.board[i][j] == 1)
-                        black_count++;
-                    else if (game.board[i][j] == 2)
-                        white_count++;
-                }
+                disconnect_client(client_info);
+                continue;
             }
+            if (reason == CANCEL_STOP)
+                command_stop(client_info, NULL);
+            else
+                handle_timers(client_info, 1 << TIMER_MATCH_DEADLINE);
+        }
 
-            if (black_count > white_count)
-            {
-                update_score(game.player1->username, 3);
-                update_score(game.player2->username, 1);
-            }
-            else if (white_count > black_count)
+        // Left for later while parked, and dropped by a client moving to another shard, which arms its own.
+        if (client_info->timers_fired.load() && !client_info->parked && client_info->handoff_target < 0)
+            handle_timers(client_info, client_info->timers_fired.exchange(0));
+
+        // Commands already buffered run first: a client coming back from authentication may have sent more.
+        Input_Result result;
+        while (client_info->negotiated && !client_info->closed && !client_info->parked && client_info->handoff_target < 0 &&
+               (result = client_info->binary ? input_next_frame(&client_info->input, command, BUFFER_SIZE)
+                                             : input_next_command(&client_info->input, command, BUFFER_SIZE)) != INPUT_NONE)
+        {
+            if (result == INPUT_TOO_LONG)
             {
-                update_score(game.player1->username, 1);
-                update_score(game.player2->username, 3);
+                snprintf(response, BUFFER_SIZE, "Comanda prea lunga!\n");
+                send_message_to_client(client_info, response);
+                continue;
             }
-            else
+            if (result == INPUT_INVALID)
             {
-                update_score(game.player1->username, 2);
-                update_score(game.player2->username, 2);
+                snprintf(response, BUFFER_SIZE, "Comanda necunoscuta!\n");
+                send_message_to_client(client_info, response);
+                continue;
             }
+            if (command[0] == 0)
+                continue;
 
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Game Over!\nNegru: %d\nAlb: %d\n%s",
-                     black_count, white_count, board_str.c_str());
-            game.player1->status = FREE;
-            game.player2->status = FREE;
-            send_message_to_client(game.player1->socket, response);
-            send_message_to_client(game.player2->socket, response);
+            if (++commands_seen % COMMAND_LOG_SAMPLE == 0)
+                log_command(client_info, command);
 
-            game.player1->game_id = -1;
-            game.player2->game_id = -1;
-            return;
+#ifdef COUNT_ALLOCATIONS
+            char name[BUFFER_SIZE];
+            long allocations = heap_allocations;
+            snprintf(name, sizeof(name), "%s", command);
+#endif
+            handle_command(client_info, command);
+#ifdef COUNT_ALLOCATIONS
+            if (heap_allocations != allocations)
+                fprintf(stderr, "Comanda \"%s\" a alocat de %ld ori\n", name, heap_allocations - allocations);
+#endif
         }
-    }
+        flush_dirty_clients();
+
+        if (!client_info->closed && !client_info->parked && client_info->handoff_target >= 0)
+        {
+            hand_off_client(client_info);
+            break;
+        }
+        // pending_events stays non-zero while parked, so epoll does not schedule the client again until
+        // unpark_client does; a job that finished before this worker got here leaves the client to it.
+        if (client_info->closed)
+            break;
+        if (client_info->parked)
+        {
+            int state = PARK_JOB;
+            if (client_info->parked.compare_exchange_strong(state, PARK_WAITING))
+                break;
+            client_info->parked = PARK_NONE;
+            continue;
+        }
+
+        ssize_t bytes_received = input_read(&client_info->input, client_info->socket);
+        if (bytes_received < 0 && errno == EINTR)
+            continue;
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            int remaining = client_info->pending_events.fetch_sub(seen) - seen;
+            if (remaining == 0)
+                break;
+            seen = remaining;
+            continue;
+        }
+        if (bytes_received <= 0)
+        {
+            disconnect_client(client_info);
+            continue;
+        }
+        metric_add(metrics.bytes_in, bytes_received);
+        client_info->last_input = std::chrono::steady_clock::now();
 
-    std::string board_str = get_board_string(game.board);
-    snprintf(response, BUFFER_SIZE, "Mutare corecta! Muta %s\n%s",
-             (game.turn == 1) ? game.player1->username : game.player2->username,
-             board_str.c_str());
-    send_message_to_client(game.player1->socket, response);
-    send_message_to_client(game.player2->socket, response);
+        if (!client_info->negotiated)
+            negotiate_protocol(client_info);
+    }
 }
 
-void create_new_game(Client_Info *player1, Client_Info *player2)
+void worker_thread()
 {
-    Game_Info new_game;
-    new_game.player1 = player1;
-    new_game.player2 = player2;
-    init_board(new_game.board);
-    new_game.turn = 1;
+    while (1)
+    {
+        Client_Info *client_info;
+        {
+            std::unique_lock<std::mutex> lock(ready_mutex);
+            ready_cond.wait(lock, []
+                            { return ready_clients.count != 0; });
+            client_info = ring_pop(ready_clients);
+        }
 
-    std::lock_guard<std::mutex> lock(games_mutex);
-    active_games.push_back(new_game);
+        handle_client(client_info);
+        flush_dirty_clients();
+        client_release(client_info);
+    }
+}
 
-    player1->game_id = active_games.size() - 1;
-    player2->game_id = active_games.size() - 1;
+void accept_clients(int server_socket)
+{
+    struct sockaddr_in client_address;
+    socklen_t client_addr_len = sizeof(client_address);
 
-    char response[BUFFER_SIZE];
-    std::string board_str = get_board_string(new_game.board);
+    while (1)
+    {
+        int client_socket = accept4(server_socket, (struct sockaddr *)&client_address, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_error("accept", "Eroare la accept: %s", strerror(errno));
+            if (errno == EINTR)
+                continue;
+            return;
+        }
 
-    snprintf(response, BUFFER_SIZE, "Jocul a inceput! Tu esti cu piesele negre(black)(B). %s\n", board_str.c_str());
-    send_message_to_client(player1->socket, response);
+        Client_Info *client_info = client_alloc(client_socket);
 
-    snprintf(response, BUFFER_SIZE, "Jocul a inceput! Tu esti cu piesele albe(white)(W) %s\n", board_str.c_str());
-    send_message_to_client(player2->socket, response);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = client_info;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0)
+        {
+            log_error("accept", "Eroare la epoll_ctl: %s", strerror(errno));
+            client_release(client_info);
+            continue;
+        }
 
-    printf("Joc creat: %s (Black) vs %s (White)\n", player1->username, player2->username);
+        log_info("connect", "Clientul %d s-a conectat.", client_socket);
+    }
 }
 
-void handle_play(Client_Info *client_info)
+// Takes the ticket out of shard_tickets; when the claim succeeds the caller owns the map's reference.
+Match_Ticket *claim_shard_ticket(uint32_t id)
 {
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    std::lock_guard<std::mutex> lock(waiting_mutex);
-    if (!waiting_queue.empty())
+    Match_Ticket *ticket;
     {
-        Client_Info *player1 = waiting_queue.front();
-        waiting_queue.pop();
-        client_info->status = IN_GAME;
-        player1->status = IN_GAME;
-        create_new_game(player1, client_info);
+        std::lock_guard<std::mutex> lock(shard_tickets_mutex);
+        auto found = shard_tickets.find(id);
+        if (found == shard_tickets.end())
+            return NULL;
+        ticket = found->second;
+        shard_tickets.erase(found);
     }
-    else
+    if (claim_ticket(ticket))
+        return ticket;
+    release_ticket(ticket);
+    return NULL;
+}
+
+void requeue_shard_ticket(Match_Ticket *ticket)
+{
     {
-        waiting_queue.push(client_info);
-        snprintf(response, BUFFER_SIZE, "Asteptati un adversar!\n");
-        client_info->status = WAITING_FOR_PLAYER;
-        send_message_to_client(client_info->socket, response);
+        std::lock_guard<std::mutex> lock(shard_tickets_mutex);
+        shard_tickets[ticket->id] = ticket;
+    }
+    send_ticket(ticket);
+    settle_ticket(ticket, TICKET_WAITING);
+}
+
+// Takes over a connection passed by the coordinator. The action runs before the socket joins epoll,
+// so no worker can touch the client until it is done.
+void adopt_client(Shard_Reader &reader, int socket)
+{
+    char username[50], command[64];
+    size_t input_length, output_length;
+    int action = shard_get_u8(reader);
+    uint32_t arg = shard_get_u32(reader);
+    shard_get_text(reader, username, sizeof(username));
+    int logged_in = shard_get_u8(reader);
+    bool binary = shard_get_u8(reader);
+    bool negotiated = shard_get_u8(reader);
+    bool discarding = shard_get_u8(reader);
+    const uint8_t *input = shard_get_blob(reader, &input_length);
+    const uint8_t *output = shard_get_blob(reader, &output_length);
+    shard_get_text(reader, command, sizeof(command));
+    if (reader.error || socket < 0 || input_length > INPUT_BUFFER_SIZE)
+    {
+        log_error("shard", "Mesaj de preluare invalid de la coordonator.");
+        if (socket >= 0)
+            close(socket);
+        return;
     }
-}
 
-void handle_command(Client_Info *client_info, char *command)
-{
-    char response[BUFFER_SIZE];
-    if (strncmp(command, "register", 8) == 0)
+    Client_Info *client_info = client_alloc(socket);
+    client_info->logged_in = logged_in;
+    memcpy(client_info->username, username, sizeof(username));
+    client_info->binary = binary;
+    client_info->negotiated = negotiated;
+    client_info->input.discarding = discarding;
+    memcpy(client_info->input.data, input, input_length);
+    client_info->input.length = input_length;
+    if (output_length)
+        queue_output(client_info, NULL, 0, (const char *)output, output_length);
+
+    if (action == ADOPT_JOIN)
     {
-        bzero(response, BUFFER_SIZE);
-        char *credentials = command + 8;
-        char *username = strtok(credentials, " ");
-        char *password = strtok(NULL, " ");
-        if (client_info->status == WAITING_FOR_PLAYER)
-        {
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (client_info->status == IN_GAME)
+        Match_Ticket *peer = claim_shard_ticket(arg);
+        if (peer)
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aeasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (username && password)
-        {
-            register_user(username, password, client_info->socket);
+            create_new_game(peer->client, client_info, 0, peer->clock_ms, peer->increment_ms);
+            settle_ticket(peer, TICKET_MATCHED);
+            release_ticket(peer);
         }
         else
         {
-            snprintf(response, BUFFER_SIZE, "Sintaxa: register <username> <password>\n");
-            send_message_to_client(client_info->socket, response);
+            // The peer is gone: command holds the "play" this client searched with, so it searches again here.
+            handle_command(client_info, command);
         }
     }
-    else if (strncmp(command, "login", 5) == 0)
+    else if (action == ADOPT_RESUME)
     {
-        bzero(response, BUFFER_SIZE);
-        char *credentials = command + 5;
-        char *username = strtok(credentials, " ");
-        char *password = strtok(NULL, " ");
-        if (client_info->status == WAITING_FOR_PLAYER)
-        {
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (client_info->status == IN_GAME)
+        resume_game(client_info);
+    }
+    else if (action == ADOPT_COMMAND)
+    {
+        handle_command(client_info, command);
+    }
+    flush_dirty_clients();
+
+    // Once in epoll a worker may pick the client up at any moment, so decide this first.
+    bool ready = client_info->input.length || client_info->handoff_target >= 0;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = client_info;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        log_error("shard", "Eroare la epoll_ctl: %s", strerror(errno));
+        disconnect_client(client_info);
+        return;
+    }
+    if (action == ADOPT_NEW)
+        log_info("connect", "Clientul %d s-a conectat.", socket);
+    if (ready)
+        schedule_client(client_info);
+}
+
+// Everything the coordinator sends a shard arrives here, one message at a time.
+void coordinator_link_thread()
+{
+    static uint8_t message[SHARD_MESSAGE_SIZE];
+    char username[50], record[PASSWORD_RECORD_SIZE], lines[SHARD_TEXT_SIZE];
+    while (1)
+    {
+        int fd;
+        ssize_t length = shard_receive(coordinator_link, message, sizeof(message), &fd);
+        if (length <= 0)
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
+            fprintf(stderr, "Shard-ul %d a pierdut legatura cu coordonatorul.\n", shard_index);
+            exit(EXIT_FAILURE);
         }
-        else if (client_info->logged_in == 1)
+
+        Shard_Reader reader;
+        shard_reader_init(reader, message, length);
+        Shard_Writer writer;
+        uint8_t reply[SHARD_TEXT_SIZE + 64];
+        switch (message[0])
         {
-            snprintf(response, BUFFER_SIZE, "Esti deja logat cu un alt cont!\n");
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (username && password)
+        case SHARD_ADOPT:
+            adopt_client(reader, fd);
+            fd = -1;
+            break;
+        case SHARD_REPLY:
+            deliver_reply(message, length);
+            break;
+        case SHARD_MATCH:
         {
-            if (login_user(username, password) == 1)
+            uint32_t first_id = shard_get_u32(reader);
+            uint32_t second_id = shard_get_u32(reader);
+            Match_Ticket *first = claim_shard_ticket(first_id);
+            Match_Ticket *second = claim_shard_ticket(second_id);
+            if (first && second)
             {
-                printf("praici");
-                client_info->logged_in = 1;
-                strncpy(client_info->username, username, sizeof(client_info->username));
-                snprintf(response, BUFFER_SIZE, "Login reusit!\n");
-                send_message_to_client(client_info->socket, response);
-            }
-            else if (login_user(username, password) == 2)
-            {
-                snprintf(response, BUFFER_SIZE, "Esti deja conectat!\n");
-                send_message_to_client(client_info->socket, response);
+                create_new_game(first->client, second->client, 0, first->clock_ms, first->increment_ms);
+                settle_ticket(first, TICKET_MATCHED);
+                settle_ticket(second, TICKET_MATCHED);
+                release_ticket(first);
+                release_ticket(second);
+                break;
             }
-            else
+            if (first)
+                requeue_shard_ticket(first);
+            if (second)
+                requeue_shard_ticket(second);
+            break;
+        }
+        case SHARD_MIGRATE:
+        {
+            uint32_t id = shard_get_u32(reader);
+            int target = shard_get_u8(reader);
+            uint32_t peer = shard_get_u32(reader);
+            Match_Ticket *ticket = claim_shard_ticket(id);
+            if (!ticket)
             {
-                snprintf(response, BUFFER_SIZE, "Login esuat!Verificati credentialele!\n");
-                send_message_to_client(client_info->socket, response);
+                shard_writer_init(writer, reply, sizeof(reply), SHARD_MIGRATE_FAILED);
+                shard_put_u8(writer, target);
+                shard_put_u32(writer, peer);
+                shard_send(coordinator_link, writer);
+                break;
             }
+            // While the ticket is claimed, cancel_matchmaking parks the client instead of dropping it; take a
+            // reference before letting go.
+            Client_Info *client_info = ticket->client;
+            client_info->refs.fetch_add(1);
+            char play[64] = "play";
+            if (ticket->clock_ms)
+                snprintf(play, sizeof(play), "play blitz %u+%u", ticket->clock_ms / 60000, ticket->increment_ms / 1000);
+            request_handoff(client_info, target, ADOPT_JOIN, peer, play);
+            settle_ticket(ticket, TICKET_MATCHED);
+            release_ticket(ticket);
+            schedule_client(client_info);
+            client_release(client_info);
+            break;
         }
-        else
+        case SHARD_REQUEUE:
         {
-            snprintf(response, BUFFER_SIZE, "Sintaxa:login <username> <password>\n");
-            send_message_to_client(client_info->socket, response);
+            uint32_t id = shard_get_u32(reader);
+            std::lock_guard<std::mutex> lock(shard_tickets_mutex);
+            auto found = shard_tickets.find(id);
+            if (found != shard_tickets.end() && found->second->state == TICKET_WAITING)
+                send_ticket(found->second);
+            break;
         }
-    }
-    else if (strcmp(command, "logout") == 0)
-    {
-        bzero(response, BUFFER_SIZE);
-        if (client_info->status == WAITING_FOR_PLAYER)
+        case SHARD_USER:
         {
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
-            send_message_to_client(client_info->socket, response);
+            int id = shard_get_u32(reader);
+            shard_get_text(reader, username, sizeof(username));
+            shard_get_text(reader, record, sizeof(record));
+            if (reader.error)
+                break;
+            {
+                std::lock_guard<std::mutex> lock(leaderboard_mutex);
+                leaderboard_set_locked(username, id, 0);
+            }
+            User_Shard &shard = user_shard(username);
+            std::lock_guard<std::mutex> lock(shard.lock);
+            user_add_locked(shard, username, id, record);
+            break;
         }
-        else if (client_info->status == IN_GAME)
+        case SHARD_SCORE:
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
+            int points = shard_get_u32(reader);
+            shard_get_text(reader, username, sizeof(username));
+            if (!reader.error)
+                leaderboard_add_points(username, points);
+            break;
         }
-        else if (client_info->logged_in)
+        case SHARD_LIST_QUERY:
         {
-            client_info->logged_in = 0;
-            logout_user(client_info->username);
-            bzero(client_info->username, sizeof(client_info->username));
-            snprintf(response, BUFFER_SIZE, "Logout reusit!\n");
-            send_message_to_client(client_info->socket, response);
+            int origin = shard_get_u8(reader);
+            uint32_t call = shard_get_u32(reader);
+            int listed;
+            int total = list_local_games(lines, sizeof(lines), LIST_GAMES_LIMIT, &listed);
+            shard_writer_init(writer, reply, sizeof(reply), SHARD_LIST_PART);
+            shard_put_u8(writer, origin);
+            shard_put_u32(writer, call);
+            shard_put_u32(writer, total);
+            shard_put_u32(writer, listed);
+            shard_put_text(writer, lines);
+            shard_send(coordinator_link, writer);
+            break;
         }
-        else
-        {
-            snprintf(response, BUFFER_SIZE, "Nu esti logat!\n");
-            send_message_to_client(client_info->socket, response);
+        default:
+            log_warn("shard", "Mesaj necunoscut de la coordonator: %d", message[0]);
         }
+        if (fd >= 0)
+            close(fd);
+        flush_dirty_clients();
     }
-    else if (strcmp(command, "play") == 0)
+}
+
+// The coordinator: owns no games and no database. It accepts connections and passes them to the shards
+// round robin, keeps who is online and the session tokens, and runs matchmaking over the shards' tickets.
+bool coordinator_send(int shard, const Shard_Writer &writer, int pass_fd)
+{
+    return shard_alive[shard] && shard_send(shard_links[shard], writer, pass_fd);
+}
+
+void coordinator_accept(int server_socket)
+{
+    static int next_shard;
+    uint8_t message[64];
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), SHARD_ADOPT);
+    shard_put_u8(writer, ADOPT_NEW);
+    shard_put_u32(writer, 0);
+    shard_put_text(writer, "");
+    for (int i = 0; i < 4; i++)
+        shard_put_u8(writer, 0);
+    shard_put_blob(writer, "", 0);
+    shard_put_blob(writer, "", 0);
+    shard_put_text(writer, "");
+
+    while (1)
     {
-        bzero(response, BUFFER_SIZE);
-        if (client_info->status == WAITING_FOR_PLAYER)
-        {
-            snprintf(response, BUFFER_SIZE, "Cauti deja un meci!\n");
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (client_info->status == IN_GAME)
-        {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (!client_info->logged_in)
+        int client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
         {
-            snprintf(response, BUFFER_SIZE, "Trebuie sa fii logat pentru a te juca!\n");
-            send_message_to_client(client_info->socket, response);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_error("accept", "Eroare la accept: %s", strerror(errno));
+            if (errno == EINTR)
+                continue;
+            return;
         }
-        else
+
+        for (int tries = 0; tries < shard_count; tries++)
         {
-            handle_play(client_info);
+            int shard = next_shard;
+            next_shard = (next_shard + 1) % shard_count;
+            if (coordinator_send(shard, writer, client_socket))
+                break;
         }
+        close(client_socket);
     }
-    else if (strncmp(command, "move", 4) == 0)
+}
+
+// Forwards a client moving between shards; the ADOPT payload is the HANDOFF message after its target byte.
+void forward_handoff(const uint8_t *message, size_t length, int socket)
+{
+    static uint8_t adopt[SHARD_MESSAGE_SIZE];
+    char username[50];
+    Shard_Reader reader;
+    shard_reader_init(reader, message, length);
+    int target = shard_get_u8(reader);
+    int action = shard_get_u8(reader);
+    uint32_t arg = shard_get_u32(reader);
+    shard_get_text(reader, username, sizeof(username));
+    bool logged_in = shard_get_u8(reader);
+    if (reader.error || socket < 0 || target >= shard_count)
     {
-        bzero(response, BUFFER_SIZE);
-        if (!client_info->logged_in)
-        {
-            snprintf(response, BUFFER_SIZE, "Trebuie sa fii logat pentru a executa o mutare!\n");
-            send_message_to_client(client_info->socket, response);
-            return;
-        }
-        else if (client_info->game_id == -1 || client_info->status == WAITING_FOR_PLAYER)
+        log_error("shard", "Mesaj de mutare invalid.");
+        if (socket >= 0)
+            close(socket);
+        return;
+    }
+
+    Shard_Writer writer;
+    shard_writer_init(writer, adopt, sizeof(adopt), SHARD_ADOPT);
+    shard_put_bytes(writer, message + 2, length - 2);
+    bool moved = coordinator_send(target, writer, socket);
+    close(socket);
+    if (!moved)
+    {
+        log_warn("shard", "Clientul %s nu a putut fi mutat pe shard-ul %d.", username, target);
+        if (logged_in)
+            online_users.erase(username);
+        if (action == ADOPT_JOIN)
         {
-            snprintf(response, BUFFER_SIZE, "Nu esti intr-un joc activ!\n");
-            send_message_to_client(client_info->socket, response);
-            return;
+            shard_writer_init(writer, adopt, sizeof(adopt), SHARD_REQUEUE);
+            shard_put_u32(writer, arg);
+            coordinator_send(target, writer);
         }
-        handle_move(client_info, command + 5);
+        return;
+    }
+    if (logged_in)
+        online_users[username] = target;
+}
+
+void finish_list(uint64_t key)
+{
+    static uint8_t message[SHARD_MESSAGE_SIZE];
+    List_Gather &gather = list_gathers[key];
+    Shard_Writer writer;
+    shard_writer_init(writer, message, sizeof(message), SHARD_REPLY);
+    shard_put_u32(writer, gather.call);
+    shard_put_u32(writer, gather.total);
+    shard_put_u32(writer, gather.listed);
+    shard_put_text(writer, gather.lines.c_str());
+    coordinator_send(gather.origin, writer);
+    list_gathers.erase(key);
+}
+
+void add_list_part(int shard, Shard_Reader &reader)
+{
+    size_t length;
+    int origin = shard_get_u8(reader);
+    uint32_t call = shard_get_u32(reader);
+    uint32_t total = shard_get_u32(reader);
+    shard_get_u32(reader);
+    const char *lines = (const char *)shard_get_blob(reader, &length);
+    uint64_t key = (uint64_t)origin << 32 | call;
+    auto found = list_gathers.find(key);
+    if (reader.error || found == list_gathers.end())
+        return;
+
+    List_Gather &gather = found->second;
+    gather.total += total;
+    for (size_t start = 0; start < length && gather.listed < LIST_GAMES_LIMIT; gather.listed++)
+    {
+        const char *end = (const char *)memchr(lines + start, '\n', length - start);
+        size_t line_length = end ? (size_t)(end - lines) + 1 - start : length - start;
+        gather.lines.append(lines + start, line_length);
+        start += line_length;
+    }
+    gather.waiting &= ~(1u << shard);
+    if (!gather.waiting)
+        finish_list(key);
+}
+
+void handle_shard_message(int shard, const uint8_t *message, size_t length, int fd)
+{
+    static uint8_t reply[SHARD_MESSAGE_SIZE];
+    char username[50], token[SESSION_TOKEN_SIZE];
+    Shard_Reader reader;
+    shard_reader_init(reader, message, length);
+    Shard_Writer writer;
+    switch (message[0])
+    {
+    case SHARD_HANDOFF:
+        forward_handoff(message, length, fd);
+        return;
+    case SHARD_CALL_LOGIN:
+    {
+        uint32_t call = shard_get_u32(reader);
+        shard_get_text(reader, username, sizeof(username));
+        if (reader.error)
+            break;
+        bool busy = online_users.count(username) != 0;
+        if (!busy)
+            online_users[username] = shard;
+        auto home = suspended_homes.find(username);
+        shard_writer_init(writer, reply, sizeof(reply), SHARD_REPLY);
+        shard_put_u32(writer, call);
+        shard_put_u8(writer, busy ? SHARD_BUSY : SHARD_OK);
+        shard_put_u8(writer, home != suspended_homes.end() ? home->second : NO_SHARD);
+        coordinator_send(shard, writer);
+        break;
     }
-    else if (strcmp(command, "scoreboard") == 0)
+    case SHARD_CALL_RESUME:
     {
-        bzero(response, BUFFER_SIZE);
-        if (client_info->status == WAITING_FOR_PLAYER)
+        uint32_t call = shard_get_u32(reader);
+        shard_get_text(reader, token, sizeof(token));
+        Shard_Reply_Status status = SHARD_INVALID;
+        username[0] = 0;
+        auto found = reader.error ? sessions.end() : sessions.find(token);
+        auto now = std::chrono::steady_clock::now();
+        if (found != sessions.end() && found->second.expires <= now)
         {
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
-            send_message_to_client(client_info->socket, response);
+            user_tokens.erase(found->second.username);
+            sessions.erase(found);
         }
-        else if (client_info->status == IN_GAME)
+        else if (found != sessions.end())
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
+            memcpy(username, found->second.username, sizeof(username));
+            status = online_users.count(username) ? SHARD_BUSY : SHARD_OK;
+            if (status == SHARD_OK)
+            {
+                online_users[username] = shard;
+                found->second.expires = now + SESSION_TTL;
+            }
         }
-        else
+        auto home = suspended_homes.find(username);
+        shard_writer_init(writer, reply, sizeof(reply), SHARD_REPLY);
+        shard_put_u32(writer, call);
+        shard_put_u8(writer, status);
+        shard_put_u8(writer, home != suspended_homes.end() ? home->second : NO_SHARD);
+        shard_put_text(writer, username);
+        coordinator_send(shard, writer);
+        break;
+    }
+    case SHARD_CALL_LIST:
+    {
+        uint32_t call = shard_get_u32(reader);
+        List_Gather &gather = list_gathers[(uint64_t)shard << 32 | call];
+        gather.origin = shard;
+        gather.call = call;
+        gather.waiting = 0;
+        gather.total = 0;
+        gather.listed = 0;
+        gather.lines.clear();
+        shard_writer_init(writer, reply, sizeof(reply), SHARD_LIST_QUERY);
+        shard_put_u8(writer, shard);
+        shard_put_u32(writer, call);
+        for (int i = 0; i < shard_count; i++)
         {
-            scoreboard(client_info);
+            if (coordinator_send(i, writer))
+                gather.waiting |= 1u << i;
         }
+        break;
+    }
+    case SHARD_LIST_PART:
+        add_list_part(shard, reader);
+        break;
+    case SHARD_LOGOUT:
+    {
+        shard_get_text(reader, username, sizeof(username));
+        auto found = online_users.find(username);
+        if (found != online_users.end() && found->second == shard)
+            online_users.erase(found);
+        break;
+    }
+    case SHARD_OPEN_SESSION:
+    {
+        shard_get_text(reader, username, sizeof(username));
+        shard_get_text(reader, token, sizeof(token));
+        if (reader.error)
+            break;
+        std::string &old_token = user_tokens[username];
+        sessions.erase(old_token);
+        old_token = token;
+        Session &session = sessions[token];
+        memcpy(session.username, username, sizeof(username));
+        session.expires = std::chrono::steady_clock::now() + SESSION_TTL;
+        break;
+    }
+    case SHARD_CLOSE_SESSION:
+    {
+        shard_get_text(reader, username, sizeof(username));
+        auto found = user_tokens.find(username);
+        if (found == user_tokens.end())
+            break;
+        sessions.erase(found->second);
+        user_tokens.erase(found);
+        break;
+    }
+    case SHARD_QUEUE:
+    {
+        uint32_t id = shard_get_u32(reader);
+        int score = shard_get_u32(reader);
+        uint32_t waited = shard_get_u32(reader);
+        uint32_t clock_ms = shard_get_u32(reader);
+        uint32_t increment_ms = shard_get_u32(reader);
+        if (reader.error)
+            break;
+        Match_Ticket *ticket = ticket_alloc();
+        ticket->client = NULL;
+        ticket->id = id;
+        ticket->shard = shard;
+        ticket->score = score;
+        ticket->clock_ms = clock_ms;
+        ticket->increment_ms = increment_ms;
+        ticket->enqueued = std::chrono::steady_clock::now() - std::chrono::milliseconds(waited);
+        ticket->state = TICKET_WAITING;
+        ticket->refs = 2;
+        remote_tickets[(uint64_t)shard << 32 | id] = ticket;
+        queue_ticket(ticket);
+        break;
+    }
+    case SHARD_CANCEL:
+    {
+        auto found = remote_tickets.find((uint64_t)shard << 32 | shard_get_u32(reader));
+        if (found == remote_tickets.end())
+            break;
+        found->second->state = TICKET_CANCELLED;
+        release_ticket(found->second);
+        remote_tickets.erase(found);
+        break;
+    }
+    case SHARD_MIGRATE_FAILED:
+    {
+        int target = shard_get_u8(reader);
+        uint32_t peer = shard_get_u32(reader);
+        if (reader.error || target >= shard_count)
+            break;
+        shard_writer_init(writer, reply, sizeof(reply), SHARD_REQUEUE);
+        shard_put_u32(writer, peer);
+        coordinator_send(target, writer);
+        break;
     }
-    else if (strcmp(command, "surrender") == 0)
+    case SHARD_USER:
+    case SHARD_SCORE:
     {
-        bzero(response, BUFFER_SIZE);
-        Game_Info &game = active_games[client_info->game_id];
-        if (client_info->game_id == -1 || client_info->status == WAITING_FOR_PLAYER)
+        // Every shard keeps the whole leaderboard, so new accounts and points are copied to the others.
+        shard_writer_init(writer, reply, sizeof(reply), message[0]);
+        shard_put_bytes(writer, message + 1, length - 1);
+        for (int i = 0; i < shard_count; i++)
         {
-            snprintf(response, BUFFER_SIZE, "Nu esti intr-un joc activ!\n");
-            send_message_to_client(client_info->socket, response);
-            return;
+            if (i != shard)
+                coordinator_send(i, writer);
         }
-        snprintf(response, BUFFER_SIZE, "%s a abandonat jocul!", client_info->username);
-        send_message_to_client(game.player1->socket, response);
-        send_message_to_client(game.player2->socket, response);
-        if (client_info->username == game.player1->username)
+        break;
+    }
+    case SHARD_SUSPENDED:
+        shard_get_text(reader, username, sizeof(username));
+        if (!reader.error)
+            suspended_homes[username] = shard;
+        break;
+    case SHARD_UNSUSPENDED:
+    {
+        shard_get_text(reader, username, sizeof(username));
+        auto found = suspended_homes.find(username);
+        if (found != suspended_homes.end() && found->second == shard)
+            suspended_homes.erase(found);
+        break;
+    }
+    default:
+        log_warn("shard", "Mesaj necunoscut de la shard-ul %d: %d", shard, message[0]);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+// A shard that exits takes its games and connections with it; the rest keep running.
+void drop_shard(int shard)
+{
+    log_error("shard", "Shard-ul %d s-a oprit.", shard);
+    shard_alive[shard] = false;
+    close(shard_links[shard]);
+
+    for (auto it = online_users.begin(); it != online_users.end();)
+        it = it->second == shard ? online_users.erase(it) : std::next(it);
+    for (auto it = suspended_homes.begin(); it != suspended_homes.end();)
+        it = it->second == shard ? suspended_homes.erase(it) : std::next(it);
+    for (auto it = remote_tickets.begin(); it != remote_tickets.end();)
+    {
+        if (it->second->shard != shard)
         {
-            update_score(game.player1->username, 1);
-            update_score(game.player2->username, 3);
+            ++it;
+            continue;
         }
-        else
+        it->second->state = TICKET_CANCELLED;
+        release_ticket(it->second);
+        it = remote_tickets.erase(it);
+    }
+
+    std::vector<uint64_t> finished;
+    for (auto it = list_gathers.begin(); it != list_gathers.end();)
+    {
+        if (it->second.origin == shard)
         {
-            update_score(game.player1->username, 3);
-            update_score(game.player2->username, 1);
+            it = list_gathers.erase(it);
+            continue;
         }
-        game.player1->status = FREE;
-        game.player2->status = FREE;
+        it->second.waiting &= ~(1u << shard);
+        if (!it->second.waiting)
+            finished.push_back(it->first);
+        ++it;
+    }
+    for (uint64_t key : finished)
+        finish_list(key);
 
-        game.player1->game_id = -1;
-        game.player2->game_id = -1;
+    if (std::none_of(shard_alive, shard_alive + shard_count, [](bool alive)
+                     { return alive; }))
+    {
+        fprintf(stderr, "Toate shard-urile s-au oprit.\n");
+        exit(EXIT_FAILURE);
     }
-    else if (strcmp(command, "stop") == 0)
+}
+
+int open_listen_socket();
+
+void run_coordinator()
+{
+    log_start(stdout, log_parse_level(getenv("LOG_LEVEL"), LOG_LEVEL_INFO));
+    signal(SIGPIPE, SIG_IGN);
+    int server_socket = open_listen_socket();
+    int poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll_fd < 0)
     {
-        bzero(response, BUFFER_SIZE);
-        std::lock_guard<std::mutex> lock(waiting_mutex);
-        if (client_info->status == WAITING_FOR_PLAYER)
-        {
-            waiting_queue.pop();
-            snprintf(response, BUFFER_SIZE, "Am oprit cautarea!\n");
-            client_info->status = FREE;
-            send_message_to_client(client_info->socket, response);
-        }
-        else if (client_info->status == IN_GAME)
+        perror("Eroare la crearea epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = MAX_SHARDS;
+    epoll_ctl(poll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    for (int i = 0; i < shard_count; i++)
+    {
+        event.data.u32 = i;
+        epoll_ctl(poll_fd, EPOLL_CTL_ADD, shard_links[i], &event);
+    }
+    log_info("listen", "Coordonatorul asculta pe portul %d, cu %d shard-uri...", PORT, shard_count);
+
+    static uint8_t message[SHARD_MESSAGE_SIZE];
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<Match_Ticket *> lobby;
+    std::vector<Match_Ticket *> unmatched;
+    auto next_round = std::chrono::steady_clock::now() + std::chrono::milliseconds(MATCH_INTERVAL_MS);
+    while (1)
+    {
+        auto now = std::chrono::steady_clock::now();
+        int timeout = next_round > now ? std::chrono::duration_cast<std::chrono::milliseconds>(next_round - now).count() + 1 : 0;
+        int ready = epoll_wait(poll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0 && errno != EINTR)
+            log_error("epoll", "Eroare la epoll_wait: %s", strerror(errno));
+
+        for (int i = 0; i < ready; i++)
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Poti folosi comanda doar daca cauti un meci!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
+            int source = events[i].data.u32;
+            if (source == MAX_SHARDS)
+            {
+                coordinator_accept(server_socket);
+                continue;
+            }
+            if (!shard_alive[source])
+                continue;
+
+            int fd;
+            ssize_t length = shard_receive(shard_links[source], message, sizeof(message), &fd);
+            if (length <= 0)
+            {
+                if (fd >= 0)
+                    close(fd);
+                drop_shard(source);
+                continue;
+            }
+            handle_shard_message(source, message, length, fd);
         }
-        else
+
+        if (std::chrono::steady_clock::now() >= next_round)
         {
-            snprintf(response, BUFFER_SIZE, "Poti folosi comanda doar daca cauti un meci!\n");
-            send_message_to_client(client_info->socket, response);
+            match_lobby(lobby, unmatched);
+            next_round = std::chrono::steady_clock::now() + std::chrono::milliseconds(MATCH_INTERVAL_MS);
         }
     }
-    else if (strcmp(command, "help") == 0)
+}
+
+// Forks the shards; returns in each of them, while the parent becomes the coordinator and never returns.
+// Runs first thing in main, before any thread exists.
+void start_shards()
+{
+    for (int i = 0; i < shard_count; i++)
     {
-        bzero(response, BUFFER_SIZE);
-        const char *help_msg =
-            "Comenzi valabile:\n"
-            "register <username> <password> - Creaza un nou cont\n"
-            "login <username> <password> - Autentificate\n"
-            "logout - Log-out din contul curent\n"
-            "play - Pregateste un joc Reversi\n"
-            "stop - Opreste cautarea unui meci\n"
-            "move <linie> <coloana> - Executa o mutare in joc\n"
-            "surrender - Abandoneaza jocul curent\n"
-            "scoreboard - Top 10 jucatori\n"
-            "help - Arata acest mesaj\n"
-            "quit - Deconeteaza clientul de la server\n";
-        bzero(response, BUFFER_SIZE);
-        if (client_info->status == WAITING_FOR_PLAYER)
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
         {
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n");
-            send_message_to_client(client_info->socket, response);
+            perror("Eroare la crearea legaturii cu shard-ul");
+            exit(EXIT_FAILURE);
         }
-        else if (client_info->status == IN_GAME)
+
+        pid_t pid = fork();
+        if (pid < 0)
         {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Nu poti utiliza aceasta comanda decat dupa ce termini meciul!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
+            perror("Eroare la fork");
+            exit(EXIT_FAILURE);
         }
-        else
+        if (pid == 0)
         {
-            snprintf(response, BUFFER_SIZE, "%s", help_msg);
-            send_message_to_client(client_info->socket, response);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            close(pair[0]);
+            for (int j = 0; j < i; j++)
+                close(shard_links[j]);
+            shard_index = i;
+            log_shard = i;
+            coordinator_link = pair[1];
+            match_id_step = shard_count;
+            next_match_id = i + 1;
+            snprintf(game_log_path, sizeof(game_log_path), "games.%d.log", i);
+            return;
         }
+        close(pair[1]);
+        shard_links[i] = pair[0];
+        shard_alive[i] = true;
     }
-    else
+    run_coordinator();
+}
+
+void init_metrics()
+{
+    Metric_Histogram *latencies[SQL_STATEMENTS + 2] = {&metrics.move_latency, &metrics.auth_latency};
+    for (int i = 0; i < SQL_STATEMENTS; i++)
+        latencies[i + 2] = &metrics.sql_latency[i];
+    for (Metric_Histogram *histogram : latencies)
     {
-        bzero(response, BUFFER_SIZE);
-        if (client_info->status == IN_GAME)
-        {
-            Game_Info &game = active_games[client_info->game_id];
-            std::string board_str = get_board_string(game.board);
-            snprintf(response, BUFFER_SIZE, "Comanda necunoscuta!\n%s", board_str.c_str());
-            send_message_to_client(client_info->socket, response);
-        }
-        snprintf(response, BUFFER_SIZE, "Comanda necunoscuta");
-        send_message_to_client(client_info->socket, response);
+        histogram->bounds = latency_bounds;
+        histogram->bucket_count = sizeof(latency_bounds) / sizeof(latency_bounds[0]);
+    }
+    metrics.queue_wait.bounds = wait_bounds;
+    metrics.queue_wait.bucket_count = sizeof(wait_bounds) / sizeof(wait_bounds[0]);
+}
+
+void render_metrics(std::string &out)
+{
+    char label[64];
+    out.clear();
+
+    metric_header(out, "reversi_connections", "gauge", "Conexiuni deschise.");
+    metric_write_gauge(out, "reversi_connections", metrics.connections.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_connections_total", "counter", "Conexiuni acceptate.");
+    metric_write(out, "reversi_connections_total", "", metrics.connections_total.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_games", "gauge", "Jocuri in desfasurare.");
+    metric_write_gauge(out, "reversi_games", metrics.games.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_games_total", "counter", "Jocuri incepute.");
+    metric_write(out, "reversi_games_total", "", metrics.games_total.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_matchmaking_queue", "gauge", "Jucatori care asteapta un adversar.");
+    metric_write_gauge(out, "reversi_matchmaking_queue", metrics.queue_depth.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_matchmaking_wait_seconds", "histogram", "Timpul petrecut in coada pana la gasirea unui adversar.");
+    metric_write_histogram(out, "reversi_matchmaking_wait_seconds", "", metrics.queue_wait);
+
+    metric_header(out, "reversi_commands_total", "counter", "Comenzi primite, dupa tip.");
+    for (int i = 0; i <= COMMAND_COUNT; i++)
+    {
+        snprintf(label, sizeof(label), "{command=\"%s\"}", i < COMMAND_COUNT ? commands[i].name : "unknown");
+        metric_write(out, "reversi_commands_total", label, command_counts[i].value.load(std::memory_order_relaxed));
+    }
+    metric_header(out, "reversi_move_seconds", "histogram", "Timpul de procesare al comenzii move.");
+    metric_write_histogram(out, "reversi_move_seconds", "", metrics.move_latency);
+    metric_header(out, "reversi_auth_seconds", "histogram", "Timpul unei verificari sau generari de hash pentru parola.");
+    metric_write_histogram(out, "reversi_auth_seconds", "", metrics.auth_latency);
+    metric_header(out, "reversi_sqlite_seconds", "histogram", "Durata sqlite3_step, dupa statement.");
+    for (int i = 0; i < SQL_STATEMENTS; i++)
+    {
+        snprintf(label, sizeof(label), "statement=\"%s\"", sql_statement_names[i]);
+        metric_write_histogram(out, "reversi_sqlite_seconds", label, metrics.sql_latency[i]);
+    }
+
+    metric_header(out, "reversi_timeouts_total", "counter", "Ceasuri expirate, clienti deconectati pentru inactivitate, cautari abandonate si cereri fara raspuns de la coordonator.");
+    const char *timeout_kinds[TIMER_KINDS] = {"idle", "matchmaking", "clock", "coordinator", "reconnect"};
+    for (int i = 0; i < TIMER_KINDS; i++)
+    {
+        snprintf(label, sizeof(label), "{kind=\"%s\"}", timeout_kinds[i]);
+        metric_write(out, "reversi_timeouts_total", label, metrics.timeouts[i].value.load(std::memory_order_relaxed));
     }
+
+    metric_header(out, "reversi_tt_probes_total", "counter", "Cautari in tabela de transpozitii comuna a AI-ului.");
+    metric_write(out, "reversi_tt_probes_total", "", metrics.tt_probes.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_tt_hits_total", "counter", "Pozitii gasite deja evaluate in tabela de transpozitii.");
+    metric_write(out, "reversi_tt_hits_total", "", metrics.tt_hits.value.load(std::memory_order_relaxed));
+
+    metric_header(out, "reversi_log_dropped_total", "counter", "Mesaje de log pierdute cand logger-ul a ramas in urma.");
+    metric_write(out, "reversi_log_dropped_total", "", log_dropped.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_received_bytes_total", "counter", "Octeti primiti de la clienti.");
+    metric_write(out, "reversi_received_bytes_total", "", metrics.bytes_in.value.load(std::memory_order_relaxed));
+    metric_header(out, "reversi_sent_bytes_total", "counter", "Octeti trimisi catre clienti.");
+    metric_write(out, "reversi_sent_bytes_total", "", metrics.bytes_out.value.load(std::memory_order_relaxed));
 }
 
-void *handle_client(void *arg)
+// Serves GET /metrics on localhost only, one short-lived connection at a time.
+void metrics_thread()
 {
-    Client_Info *client_info = (Client_Info *)arg;
-    char buffer[BUFFER_SIZE];
+    int metrics_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_socket < 0)
+    {
+        log_error("metrics", "Eroare la crearea socket-ului de metrici: %s", strerror(errno));
+        return;
+    }
+
+    int optval = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 
-    printf("Clientul %d s-a conectat. \n", client_info->socket);
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(METRICS_PORT + shard_index);
+    if (bind(metrics_socket, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(metrics_socket, 16) < 0)
+    {
+        log_error("metrics", "Eroare la pornirea portului de metrici: %s", strerror(errno));
+        close(metrics_socket);
+        return;
+    }
 
+    std::string body;
+    char request[BUFFER_SIZE];
+    char header[256];
     while (1)
     {
-        bzero(buffer, BUFFER_SIZE);
-        int bytes_received = read(client_info->socket, buffer, BUFFER_SIZE - 1);
-        char response[BUFFER_SIZE];
-        bzero(response, BUFFER_SIZE);
-        if (bytes_received <= 0)
+        int connection = accept4(metrics_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0)
         {
-            printf("Clientul %d s-a deconectat.\n", client_info->socket);
+            if (errno != EINTR)
+                log_error("metrics", "Eroare la accept pe portul de metrici: %s", strerror(errno));
+            continue;
+        }
 
-            if (client_info->logged_in)
-            {
-                if (client_info->status == WAITING_FOR_PLAYER)
-                {
-                    waiting_queue.pop();
-                    logout_user(client_info->username);
-                }
-                else if (client_info->status == IN_GAME)
-                {
-                    Game_Info &game = active_games[client_info->game_id];
-                    snprintf(response, BUFFER_SIZE, "%s a abandonat jocul!", client_info->username);
-
-                    if (client_info->username == game.player1->username)
-                    {
-                        update_score(game.player1->username, 1);
-                        update_score(game.player2->username, 3);
-                        send_message_to_client(game.player2->socket, response);
-                        game.player2->status = FREE;
-                        game.player2->game_id = -1;
-                    }
-                    else
-                    {
-                        update_score(game.player1->username, 3);
-                        update_score(game.player2->username, 1);
-                        send_message_to_client(game.player1->socket, response);
-                        game.player1->status = FREE;
-                        game.player1->game_id = -1;
-                    }
-                    logout_user(client_info->username);
-                }
-                else
-                {
-                    logout_user(client_info->username);
-                }
-            }
+        struct timeval timeout = {1, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        ssize_t length = recv(connection, request, sizeof(request) - 1, 0);
+        request[length > 0 ? length : 0] = 0;
 
-            close(client_info->socket);
-            free(client_info);
-            return NULL;
-        }
+        bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+        if (found)
+            render_metrics(body);
+        else
+            body = "Not Found\n";
+        size_t header_length = snprintf(header, sizeof(header),
+                                        "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                        found ? "200 OK" : "404 Not Found", body.size());
 
-        buffer[strcspn(buffer, "\n")] = 0;
+        struct iovec iov[2] = {{header, header_length}, {(void *)body.data(), body.size()}};
+        writev(connection, iov, 2);
+        close(connection);
+    }
+}
 
-        printf("Comandă primită: %s [from client %d]\n", buffer, client_info->socket);
+// Turns the wheel on the main thread. Only the expiries are collected under timers_mutex: game clocks are
+// settled here, client timers are passed to the worker that owns the client.
+void run_timers(std::vector<Timer_Event> &fired)
+{
+    {
+        std::lock_guard<std::mutex> lock(timers_mutex);
+        timer_advance(timers, current_tick(), [&](Timer *timer)
+                      {
+                          if (timer->kind != TIMER_CLOCK && timer->kind != TIMER_GRACE && !client_try_ref((Client_Info *)timer->owner))
+                              return;
+                          fired.push_back({timer->kind, timer->owner, timer->id}); });
+    }
 
-        handle_command(client_info, buffer);
+    for (Timer_Event &event : fired)
+    {
+        if (event.kind == TIMER_CLOCK)
+        {
+            clock_expired(event.id);
+            continue;
+        }
+        if (event.kind == TIMER_GRACE)
+        {
+            grace_expired(event.id);
+            continue;
+        }
+        Client_Info *client_info = (Client_Info *)event.owner;
+        if (event.kind == TIMER_CALL)
+        {
+            expire_call(client_info, event.id);
+            client_release(client_info);
+            continue;
+        }
+        client_info->timers_fired.fetch_or(1 << event.kind);
+        schedule_client(client_info);
+        client_release(client_info);
     }
+    fired.clear();
+    flush_dirty_clients();
 }
 
-int main()
+int open_listen_socket()
 {
-    init_database();
     int server_socket;
-    struct sockaddr_in server_address, client_address;
-    socklen_t client_addr_len = sizeof(client_address);
+    struct sockaddr_in server_address;
     int optval = 1;
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == 0)
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket < 0)
     {
         perror("Eroare la crearea socket-ului");
         exit(EXIT_FAILURE);
@@ -841,43 +5513,125 @@ int main()
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_socket, 5) < 0)
+    if (listen(server_socket, SOMAXCONN) < 0)
     {
         perror("Eroare la listen");
         close(server_socket);
         exit(EXIT_FAILURE);
     }
+    return server_socket;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "--shards") == 0)
+        shard_count = atoi(argv[2]);
+    if (argc != 1 && (shard_count < 1 || shard_count > MAX_SHARDS))
+    {
+        fprintf(stderr, "Utilizare: %s [--shards 1-%d]\n", argv[0], MAX_SHARDS);
+        return EXIT_FAILURE;
+    }
+    if (shard_count)
+        start_shards();
+
+    log_start(stdout, log_parse_level(getenv("LOG_LEVEL"), LOG_LEVEL_INFO));
+    timers_start = std::chrono::steady_clock::now();
+    timer_wheel_init(timers, 0);
+    init_database();
+    load_users();
+    init_metrics();
+    recover_games();
+    std::thread(game_log_writer_thread).detach();
+    std::thread(db_writer_thread).detach();
+    if (coordinator_link < 0)
+        std::thread(matchmaking_thread).detach();
+    std::thread(metrics_thread).detach();
+    for (int i = 0; i < AI_THREADS; i++)
+        std::thread(ai_thread).detach();
+    for (int i = 0; i < AUTH_THREADS; i++)
+        std::thread(auth_thread).detach();
+    std::thread(analysis_thread).detach();
+    signal(SIGPIPE, SIG_IGN);
+    // Shards get their connections from the coordinator instead of listening themselves.
+    int server_socket = coordinator_link < 0 ? open_listen_socket() : -1;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0)
+    {
+        perror("Eroare la crearea epoll");
+        exit(EXIT_FAILURE);
+    }
 
-    printf("Serverul ascultă pe portul %d...\n", PORT);
+    struct epoll_event event;
+    if (server_socket >= 0)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &server_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    }
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
 
-    while (1)
+    std::vector<std::thread> workers;
+    for (int i = 0; i < WORKER_THREADS; i++)
+        workers.emplace_back(worker_thread);
+
+    if (coordinator_link >= 0)
+    {
+        std::thread(coordinator_link_thread).detach();
+        log_info("listen", "Shard-ul %d din %d a pornit, jurnal %s, metrici pe portul %d.", shard_index, shard_count, game_log_path, METRICS_PORT + shard_index);
+    }
+    else
     {
+        log_info("listen", "Serverul asculta pe portul %d...", PORT);
+    }
 
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_addr_len);
-        if (client_socket < 0)
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<Client_Info *> to_release;
+    std::vector<Timer_Event> fired;
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timer_timeout());
+        if (ready < 0)
         {
-            perror("Eroare la accept");
+            if (errno != EINTR)
+                log_error("epoll", "Eroare la epoll_wait: %s", strerror(errno));
             continue;
         }
 
-        Client_Info *client_info = (Client_Info *)malloc(sizeof(Client_Info));
-        client_info->socket = (int)client_socket;
-        client_info->logged_in = 0;
-        client_info->game_id = -1;
-        client_info->status = FREE;
-        bzero(client_info->username, sizeof(client_info->username));
-
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_info) != 0)
+        for (int i = 0; i < ready; i++)
         {
-            perror("Eroare la crearea thread-ului");
-            close(client_socket);
-            free(client_info);
+            if (events[i].data.ptr == &server_socket)
+            {
+                accept_clients(server_socket);
+            }
+            else if (events[i].data.ptr == &wake_fd)
+            {
+                uint64_t wakeups;
+                while (read(wake_fd, &wakeups, sizeof(wakeups)) > 0)
+                    ;
+            }
+            else
+            {
+                Client_Info *client_info = (Client_Info *)events[i].data.ptr;
+                if (events[i].events & EPOLLOUT)
+                    flush_client(client_info);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    schedule_client(client_info);
+            }
         }
-        else
+
         {
-            pthread_detach(thread_id);
+            std::lock_guard<std::mutex> lock(closed_mutex);
+            to_release.swap(closed_clients);
         }
+        for (Client_Info *client_info : to_release)
+            client_release(client_info);
+        to_release.clear();
+
+        run_timers(fired);
     }
 
     sqlite3_close(db);
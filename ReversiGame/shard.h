@@ -0,0 +1,243 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+// With --shards N the first process becomes a coordinator and forks N shards, each a full server that owns
+// its own games. They talk over one SOCK_SEQPACKET socketpair per shard: every message is [type u8][fields...],
+// and ADOPT/HANDOFF carry a client socket alongside as SCM_RIGHTS.
+#define MAX_SHARDS 16
+#define SHARD_MESSAGE_SIZE 16384
+#define SHARD_TEXT_SIZE 4096
+#define SHARD_CALL_TIMEOUT_MS 5000
+#define SHARD_OUTPUT_LIMIT 8192 // unsent replies a moving client may carry; more means it stopped reading
+#define NO_SHARD 0xFF
+
+enum Shard_Message_Type
+{
+    SHARD_ADOPT = 1,      // coordinator -> shard, with fd: take over a connection
+    SHARD_HANDOFF,        // shard -> coordinator, with fd: [target] + ADOPT payload, forwarded to target
+    SHARD_CALL_LOGIN,     // [call][username] -> REPLY [call][status][home shard]
+    SHARD_CALL_RESUME,    // [call][token] -> REPLY [call][status][home shard][username]
+    SHARD_CALL_LIST,      // [call] -> REPLY [call][total][listed][lines]
+    SHARD_REPLY,          // coordinator -> shard: [call][...]
+    SHARD_LOGOUT,         // [username]
+    SHARD_OPEN_SESSION,   // [username][token]
+    SHARD_CLOSE_SESSION,  // [username]
+    SHARD_QUEUE,          // [ticket][score][waited ms][clock ms][increment ms]
+    SHARD_CANCEL,         // [ticket]
+    SHARD_MATCH,          // coordinator -> shard: [first ticket][second ticket], both on that shard
+    SHARD_MIGRATE,        // coordinator -> shard: [ticket][target shard][peer ticket]
+    SHARD_MIGRATE_FAILED, // shard -> coordinator: [target shard][peer ticket]
+    SHARD_REQUEUE,        // coordinator -> shard: [ticket]
+    SHARD_USER,           // [id][username][password], forwarded to every other shard
+    SHARD_SCORE,          // [points][username], forwarded to every other shard
+    SHARD_LIST_QUERY,     // coordinator -> shard: [origin][call]
+    SHARD_LIST_PART,      // shard -> coordinator: [origin][call][total][listed][lines]
+    SHARD_SUSPENDED,      // [username]: a recovered game on this shard waits for this player
+    SHARD_UNSUSPENDED     // [username]
+};
+
+enum Shard_Reply_Status
+{
+    SHARD_OK,
+    SHARD_BUSY,
+    SHARD_INVALID
+};
+
+// What the receiving shard does with an adopted connection before it starts reading from it.
+enum Adopt_Action
+{
+    ADOPT_NEW,     // fresh connection from accept
+    ADOPT_JOIN,    // start a game against the waiting ticket in arg, or run the play command in text if it is gone
+    ADOPT_RESUME,  // put the player back into their recovered game
+    ADOPT_COMMAND  // run the command in text, e.g. "replay 7" for a match this shard owns
+};
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    bool overflow;
+} Shard_Writer;
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    bool error;
+} Shard_Reader;
+
+inline void shard_writer_init(Shard_Writer &writer, uint8_t *data, size_t capacity, int type)
+{
+    writer.data = data;
+    writer.capacity = capacity;
+    writer.length = 1;
+    writer.overflow = false;
+    data[0] = type;
+}
+
+inline void shard_put_bytes(Shard_Writer &writer, const void *bytes, size_t length)
+{
+    if (writer.length + length > writer.capacity)
+    {
+        writer.overflow = true;
+        return;
+    }
+    memcpy(writer.data + writer.length, bytes, length);
+    writer.length += length;
+}
+
+inline void shard_put_u8(Shard_Writer &writer, uint8_t value)
+{
+    shard_put_bytes(writer, &value, 1);
+}
+
+inline void shard_put_u32(Shard_Writer &writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    write_u32(bytes, value);
+    shard_put_bytes(writer, bytes, 4);
+}
+
+// Blobs and strings are [length u16][bytes]; strings are read back NUL-terminated.
+inline void shard_put_blob(Shard_Writer &writer, const void *bytes, size_t length)
+{
+    uint8_t header[2];
+    write_u16(header, length);
+    shard_put_bytes(writer, header, 2);
+    shard_put_bytes(writer, bytes, length);
+}
+
+inline void shard_put_text(Shard_Writer &writer, const char *text)
+{
+    shard_put_blob(writer, text, strlen(text));
+}
+
+inline void shard_reader_init(Shard_Reader &reader, const uint8_t *data, size_t length)
+{
+    reader.data = data;
+    reader.length = length;
+    reader.offset = 1;
+    reader.error = length < 1;
+}
+
+inline const uint8_t *shard_get_bytes(Shard_Reader &reader, size_t length)
+{
+    if (reader.error || reader.offset + length > reader.length)
+    {
+        reader.error = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader.data + reader.offset;
+    reader.offset += length;
+    return bytes;
+}
+
+inline uint8_t shard_get_u8(Shard_Reader &reader)
+{
+    const uint8_t *bytes = shard_get_bytes(reader, 1);
+    return bytes ? bytes[0] : 0;
+}
+
+inline uint32_t shard_get_u32(Shard_Reader &reader)
+{
+    const uint8_t *bytes = shard_get_bytes(reader, 4);
+    return bytes ? read_u32(bytes) : 0;
+}
+
+inline const uint8_t *shard_get_blob(Shard_Reader &reader, size_t *length)
+{
+    const uint8_t *header = shard_get_bytes(reader, 2);
+    *length = header ? read_u16(header) : 0;
+    return shard_get_bytes(reader, *length);
+}
+
+inline void shard_get_text(Shard_Reader &reader, char *text, size_t size)
+{
+    size_t length;
+    const uint8_t *bytes = shard_get_blob(reader, &length);
+    if (!bytes || length >= size)
+    {
+        reader.error = true;
+        text[0] = 0;
+        return;
+    }
+    memcpy(text, bytes, length);
+    text[length] = 0;
+}
+
+// pass_fd < 0 sends the message alone.
+inline bool shard_send(int link, const Shard_Writer &writer, int pass_fd = -1)
+{
+    if (writer.overflow)
+        return false;
+
+    struct iovec iov;
+    iov.iov_base = writer.data;
+    iov.iov_len = writer.length;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    if (pass_fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &pass_fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do
+        sent = sendmsg(link, &message, MSG_NOSIGNAL);
+    while (sent < 0 && errno == EINTR);
+    return sent == (ssize_t)writer.length;
+}
+
+// Returns the message length, 0 when the other side closed the link, -1 on error (errno set).
+// A passed socket lands in *received_fd, otherwise it is set to -1.
+inline ssize_t shard_receive(int link, uint8_t *data, size_t size, int *received_fd)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    *received_fd = -1;
+    ssize_t received;
+    do
+        received = recvmsg(link, &message, MSG_CMSG_CLOEXEC);
+    while (received < 0 && errno == EINTR);
+    if (received <= 0)
+        return received;
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            memcpy(received_fd, CMSG_DATA(header), sizeof(int));
+    }
+    return received;
+}
+
+#endif
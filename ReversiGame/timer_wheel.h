@@ -0,0 +1,179 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots, the first turning once per tick and
+// each of the others once per lap of the one below. A timer sits in the lowest wheel whose current lap still
+// contains its deadline, so adding and cancelling are O(1) list operations and a tick looks at one slot;
+// timers in the outer wheels are moved inwards only when the wheel below wraps around to their slot.
+#define TIMER_TICK_MS 10
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_MAX_TICKS ((1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1) // about 46 hours
+
+// Embedded in whatever it times. kind, owner and id are for the caller: they say what to do when it fires.
+typedef struct Timer
+{
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;
+    int kind;
+    int id;
+    void *owner;
+} Timer;
+
+// Every slot is a circular list headed by a sentinel, so unlinking never needs to know which slot it is in.
+typedef struct
+{
+    uint64_t now;
+    size_t count;
+    Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+} Timer_Wheel;
+
+inline void timer_init(Timer *timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+inline bool timer_armed(const Timer *timer)
+{
+    return timer->next != NULL;
+}
+
+inline void timer_wheel_init(Timer_Wheel &wheel, uint64_t now)
+{
+    wheel.now = now;
+    wheel.count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            Timer *head = &wheel.slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+inline void timer_link(Timer_Wheel &wheel, Timer *timer)
+{
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+           (timer->expires >> (TIMER_SLOT_BITS * (level + 1))) != (wheel.now >> (TIMER_SLOT_BITS * (level + 1))))
+        level++;
+
+    Timer *head = &wheel.slots[level][(timer->expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+inline void timer_unlink(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Re-adding an armed timer moves it. Deadlines already past fire on the next tick.
+inline void timer_add(Timer_Wheel &wheel, Timer *timer, uint64_t expires)
+{
+    if (timer_armed(timer))
+        timer_unlink(timer);
+    else
+        wheel.count++;
+    if (expires <= wheel.now)
+        expires = wheel.now + 1;
+    if (expires - wheel.now > TIMER_MAX_TICKS)
+        expires = wheel.now + TIMER_MAX_TICKS;
+    timer->expires = expires;
+    timer_link(wheel, timer);
+}
+
+inline void timer_cancel(Timer_Wheel &wheel, Timer *timer)
+{
+    if (!timer_armed(timer))
+        return;
+    timer_unlink(timer);
+    wheel.count--;
+}
+
+// The first tick after now at which timer_advance has work: a timer in the innermost wheel expiring, or a slot of
+// an outer wheel coming up to be moved inwards. Scans at most TIMER_LEVELS * TIMER_SLOTS slot heads; an outer
+// slot found this way only says when to look again, since its timers expire at or after it.
+inline uint64_t timer_next_tick(const Timer_Wheel &wheel)
+{
+    if (wheel.count == 0)
+        return UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        int shift = TIMER_SLOT_BITS * level;
+        uint64_t lap = (wheel.now >> (shift + TIMER_SLOT_BITS)) << (shift + TIMER_SLOT_BITS);
+        int current = (wheel.now >> shift) & (TIMER_SLOTS - 1);
+        for (int slot = current + 1; slot < TIMER_SLOTS; slot++)
+        {
+            const Timer *head = &wheel.slots[level][slot];
+            if (head->next != head)
+                return lap + ((uint64_t)slot << shift);
+        }
+    }
+    // Only deadlines clamped to TIMER_MAX_TICKS are left: they wrapped around to a slot of the outermost wheel
+    // at or before the current one, which comes up again in its next lap.
+    int shift = TIMER_SLOT_BITS * (TIMER_LEVELS - 1);
+    uint64_t lap = ((wheel.now >> (shift + TIMER_SLOT_BITS)) + 1) << (shift + TIMER_SLOT_BITS);
+    for (int slot = 0; slot < TIMER_SLOTS; slot++)
+    {
+        const Timer *head = &wheel.slots[TIMER_LEVELS - 1][slot];
+        if (head->next != head)
+            return lap + ((uint64_t)slot << shift);
+    }
+    return UINT64_MAX;
+}
+
+// Moves the wheel forward to tick until, calling fire(timer) for every timer that expires on the way.
+// A fired timer is already disarmed, so fire may add it again. Ticks with nothing to do are skipped.
+template <typename Fire>
+void timer_advance(Timer_Wheel &wheel, uint64_t until, Fire fire)
+{
+    while (wheel.now < until)
+    {
+        uint64_t next = timer_next_tick(wheel);
+        if (next > until)
+        {
+            wheel.now = until;
+            return;
+        }
+        wheel.now = next;
+
+        for (int level = 1; level < TIMER_LEVELS && (wheel.now & ((1ull << (TIMER_SLOT_BITS * level)) - 1)) == 0; level++)
+        {
+            Timer *head = &wheel.slots[level][(wheel.now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+            Timer *timer = head->next;
+            head->next = head;
+            head->prev = head;
+            while (timer != head)
+            {
+                Timer *next = timer->next;
+                timer_link(wheel, timer);
+                timer = next;
+            }
+        }
+
+        Timer *head = &wheel.slots[0][wheel.now & (TIMER_SLOTS - 1)];
+        while (head->next != head)
+        {
+            Timer *timer = head->next;
+            timer_unlink(timer);
+            wheel.count--;
+            fire(timer);
+        }
+    }
+}
+
+#endif